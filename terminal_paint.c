@@ -7,31 +7,129 @@
  * Implements character-based drawing with color support and file persistence.
  * 
  * @section build Build Instructions
- * Linux/Unix: gcc -O2 -Wall -Wextra terminal_paint.c -o terminal_paint -lncurses
- * Windows (MSYS2): gcc terminal_paint.c -o terminal_paint -I/ucrt64/include/ncursesw -L/ucrt64/lib -lncursesw
+ * Linux/Unix: gcc -O2 -Wall -Wextra -pthread terminal_paint.c -o terminal_paint -lncursesw
+ * Windows (MSYS2): gcc -pthread terminal_paint.c -o terminal_paint -I/ucrt64/include/ncursesw -L/ucrt64/lib -lncursesw
  * 
  * @section implementation Implementation Details
  * - Canvas: Dynamic 2D cell array storing character and color data
- * - Input: ncurses getch() with switch-case key mapping
+ * - Clear: O(1) generation bump; rows with a stale generation stamp read as blank
+ * - Occupancy: Per-row first/last/count of non-blank cells, maintained on write
+ * - Glyphs: Cells hold 16-bit glyph IDs; Latin-1 maps directly, other code
+ *   points are interned in a per-thread table and drawn with the wide API
+ * - Colors: Cells hold 16-bit style IDs (palette or RGB fg/bg) interned like
+ *   glyphs; ncurses pairs are bound on demand from an LRU cache, and rebinding
+ *   a pair still on screen redraws only the cells drawn with it
+ * - Brushes: Square/round/spray sizes 1-32 and stamps loaded from canvas files,
+ *   applied through precomputed row-span masks; each application marks one dirty
+ *   rect. Spray draws one xoshiro256** word per eight cells of a span
+ * - Dither: 8x8 Bayer ordered fills between two cells, at a fixed density or
+ *   as a left-to-right gradient, over the selection or the active layer
+ * - Dots: Optional 2x4 (braille) or 1x2 (half-block) sub-cell addressing; dot
+ *   rows are packed eight cells at a time into glyph codes through lookup tables
+ * - Symmetry: Mirror (horizontal, vertical, 4-way) and N-fold radial painting;
+ *   per-copy transforms are precomputed as 2x2 matrices and every copy feeds
+ *   the same dirty set
+ * - Dirty tracking: Edits mark per-row dirty spans that are redrawn once per frame
+ * - Minimap: Pyramid of per-block non-blank counts over the canvas (or the open
+ *   document), updated on every write; the overview draws from the level that fits
+ * - Find and replace: Masked (char, color) matches over occupied spans, compared
+ *   several cells at a time; limited to a rectangular selection when one is set
+ * - Transforms: Rotate, flip and nearest-neighbour scale of the selection or the
+ *   active layer; quarter turns transpose through 32x32 cell tiles
+ * - Animation: Frames of one layer stored as runs of changed cells against
+ *   the previous frame, with onion skin and fixed-rate delta playback
+ * - Documents: Binary canvases mapped MAP_SHARED as the base layer's storage;
+ *   the canvas is a viewport, only touched pages fault in, saving is an msync
+ * - Layers: Up to MAX_LAYERS buffers composited top-down (space is transparent);
+ *   edits update the composite per cell, visibility changes recomposite only
+ *   the layer's occupied spans
+ * - Navigation: Held arrow keys move in growing steps; jumps find the next
+ *   blank/non-blank boundary from the row occupancy index and cells directly
+ * - Input: Dedicated thread decodes raw terminal bytes into a lock-free SPSC
+ *   key queue; the main thread applies queued keys in batches and refreshes
+ *   once per batch, so a slow terminal never stops keys being read. Bracketed
+ *   pastes are collected whole by the thread and handed over as one key
+ * - Text: Typed characters and pasted blocks are written at the cursor one
+ *   span per line, bypassing the per-key command dispatch
+ * - Frames: Terminal updates are capped at a configurable rate (--fps); changes
+ *   accumulate between ticks, and an adaptive mode lowers the rate when
+ *   refresh() takes longer than the frame budget
  * - Rendering: Selective screen updates using ncurses drawing functions
- * - File format: Plain text with dimension header and comma-separated values
+ * - File format: Plain text with dimension header and comma-separated values, or
+ *   binary (.bin): header, per-row occupancy index and page-aligned raw cells,
+ *   followed by the glyph and style tables
  * - Load behavior: Overlays loaded canvas onto existing canvas (preserves non-overlapping areas)
+ * - Export: ANSI escape art, asciicast v2, HTML and PPM, streamed through a single large buffer
+ * - Import: PPM/PGM images box-downsampled to cells, luminance mapped onto the brush ramp
+ * - SIMD: SSE2/AVX2 kernels picked at startup, with scalar fallbacks
+ * - Headless: "export", "import", "replace", "convert", "validate", "stat",
+ *   "batch" (validate/stat/convert a directory on N worker threads) and
+ *   "create" (blank .bin document) run without initializing ncurses
  * 
  * @section controls Control Mapping
- * Movement: Arrow keys
+ * Movement: Arrow keys (accelerate when held), Shift+arrows (jump to the next
+ *   blank/non-blank boundary), :goto X Y
  * Paint: Space (single), Enter (toggle continuous)
- * Tools: B (brush cycle), C (color cycle), E (eraser), X (clear)
- * Colors: 0-7 (direct index selection)
- * File: S (save), L (load)
+ * Tools: B (brush cycle), c (color cycle), E (eraser), X (clear)
+ * Brush: + / - (size), O (square/round/spray), T (stamp from paint_stamp.txt),
+ *   :spray PCT (spray density), :seed N (restart the spray's random sequence)
+ * Dots: Z (cycle braille / half-block sub-cell drawing / off)
+ * Text: W (type at the cursor until Esc); pasted text lands at the cursor
+ * Symmetry: Y (cycle off / horizontal / vertical / 4-way / radial), :sym, :center
+ * Edit: M (mark selection corners), R (replace cell under cursor with brush),
+ *   :rotate 90|180|270, :flip h|v, :scale N|1/N|N/M, :dither A B [PCT]
+ *   (selection or whole layer)
+ * Animation: A (add frame), D (delete frame), , / . (previous/next), U (onion skin), G (play)
+ * Colors: 0-7 (direct index selection), C (next 256-color entry), : (color/fg/bg commands)
+ * Layers: N (new), [ ] (select), V (show/hide), K (lock)
+ * Instrumentation: F (toggle stats line)
+ * Minimap: Tab (corner overlay / full-screen overview / off)
+ * File: S (save), L (load), P (publish .ans/.cast/.html/.ppm), I (import image)
  * Exit: Q
  */
 
+// Wide-character curses (cchar_t) and wcwidth() on top of the default feature set
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+#define NCURSES_WIDECHAR 1
+
 #include <ncursesw/curses.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <locale.h>
+#include <wchar.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#else
+#define HAVE_SSE2 0
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2 1
+#else
+#define HAVE_AVX2 0
+#endif
 
 /*==============================================================================
  * CONSTANTS AND CONFIGURATION
@@ -49,6 +147,12 @@
  */
 #define MAX_CANVAS_HEIGHT 1000
 
+/**
+ * @def MAX_LAYERS
+ * @brief Maximum number of layers in a document
+ */
+#define MAX_LAYERS 8
+
 /**
  * @def DEFAULT_SAVE_FILE
  * @brief Default filename for save/load operations
@@ -56,484 +160,8551 @@
 #define DEFAULT_SAVE_FILE "paint_save.txt"
 
 /**
- * @def BRUSH_COUNT
- * @brief Number of available brush characters
+ * @def DEFAULT_STAMP_FILE
+ * @brief Default canvas file loaded as a stamp brush
  */
-#define BRUSH_COUNT (sizeof(brush_chars))
+#define DEFAULT_STAMP_FILE "paint_stamp.txt"
 
 /**
- * @def COLOR_COUNT
- * @brief Number of available colors in the palette
+ * @def BRUSH_SIZE_MAX
+ * @brief Largest square/round brush diameter in cells
  */
-#define COLOR_COUNT 8
+#define BRUSH_SIZE_MAX 32
 
 /**
- * @def STATUS_LINES_TOP
- * @brief Number of status lines reserved at top of screen
+ * @def BRUSH_SHAPE_SQUARE
+ * @brief Solid brush covering its whole size x size box
  */
-#define STATUS_LINES_TOP    2
+#define BRUSH_SHAPE_SQUARE 0
 
 /**
- * @def STATUS_LINES_BOTTOM
- * @brief Number of status lines reserved at bottom of screen
+ * @def BRUSH_SHAPE_ROUND
+ * @brief Solid brush covering the circle inscribed in its box
  */
-#define STATUS_LINES_BOTTOM 1
+#define BRUSH_SHAPE_ROUND  1
 
-/*==============================================================================
- * TYPE DEFINITIONS
- *============================================================================*/
+/**
+ * @def BRUSH_SHAPE_STAMP
+ * @brief Multi-cell brush loaded from a canvas file
+ */
+#define BRUSH_SHAPE_STAMP  2
 
 /**
- * @struct Cell
- * @brief Represents a single canvas cell with character and color information
- * 
- * Each cell stores both the ASCII character to display and its color index.
- * Color indices map to ncurses color pairs for efficient rendering.
+ * @def BRUSH_SHAPE_SPRAY
+ * @brief Round footprint of which each application paints a random subset
  */
-typedef struct {
-    unsigned char ch;    /**< ASCII character (' ' for empty cells) */
-    short color;         /**< Color index (0-7, maps to COLOR_* constants) */
-} Cell;
+#define BRUSH_SHAPE_SPRAY  3
 
 /**
- * @struct AppState
- * @brief Global application state container
- * 
- * Centralizes all application state for better organization and
- * easier debugging/maintenance.
+ * @def SPRAY_DEFAULT_DENSITY
+ * @brief Percentage of the spray footprint painted per application
  */
-typedef struct {
-    Cell *canvas;           /**< Dynamic canvas array */
-    int canvas_width;       /**< Canvas width in characters */
-    int canvas_height;      /**< Canvas height in characters */
-    int cursor_x;           /**< Current cursor X position */
-    int cursor_y;           /**< Current cursor Y position */
-    bool pen_down;          /**< Pen mode: paint while moving */
-    int brush_index;        /**< Current brush character index */
-    short current_color;    /**< Current color index (0-7) */
-    bool running;           /**< Main loop control flag */
-} AppState;
+#define SPRAY_DEFAULT_DENSITY 20
 
-/*==============================================================================
- * GLOBAL DATA
- *============================================================================*/
+/**
+ * @def RANDOM_DEFAULT_SEED
+ * @brief Seed of the spray's random sequence at startup
+ * @details Fixed, so a replayed keystroke sequence sprays the same cells.
+ */
+#define RANDOM_DEFAULT_SEED 0x7E41A1C5EEDull
 
 /**
- * @var g_app
- * @brief Global application state instance
- * @details Centralized state container for the entire application
+ * @def SUBCELL_OFF
+ * @brief Sub-cell mode: cursor and brush address whole cells
  */
-static AppState g_app = {0};
+#define SUBCELL_OFF     0
 
 /**
- * @var brush_chars
- * @brief Available brush characters ordered by visual density
- * @details Modifiable array that can be altered for special modes like eraser
+ * @def SUBCELL_BRAILLE
+ * @brief Sub-cell mode: 2x4 dots per cell drawn as braille patterns
  */
-static char brush_chars[] = { '#', '*', '@', '%', '+', 'o', 'x', '.', '~', '&' };
+#define SUBCELL_BRAILLE 1
 
 /**
- * @var original_brush_chars
- * @brief Backup copy of original brush characters
- * @details Used to restore brushes after eraser mode or other modifications
+ * @def SUBCELL_HALF
+ * @brief Sub-cell mode: 1x2 dots per cell drawn as half blocks
  */
-static const char original_brush_chars[] = { '#', '*', '@', '%', '+', 'o', 'x', '.', '~', '&' };
+#define SUBCELL_HALF    2
 
 /**
- * @var base_colors
- * @brief Color mapping to ncurses COLOR_* constants
- * @details Maps color indices 0-7 to their corresponding ncurses color values
+ * @def SUBCELL_MODES
+ * @brief Number of sub-cell modes (Z cycles through them)
  */
-static const short base_colors[COLOR_COUNT] = {
-    COLOR_BLACK, COLOR_RED, COLOR_GREEN, COLOR_YELLOW,
-    COLOR_BLUE, COLOR_MAGENTA, COLOR_CYAN, COLOR_WHITE
-};
+#define SUBCELL_MODES   3
 
 /**
- * @var color_names
- * @brief Human-readable color names for status display
- * @details String representations of colors for user interface display
+ * @def BRAILLE_BASE
+ * @brief Code point of the empty braille pattern; dot bits are added to it
  */
-static const char *color_names[COLOR_COUNT] = {
-    "BLACK", "RED", "GREEN", "YELLOW", "BLUE", "MAGENTA", "CYAN", "WHITE"
-};
+#define BRAILLE_BASE 0x2800
 
-/*==============================================================================
- * FORWARD DECLARATIONS
- *============================================================================*/
+/**
+ * @def MINIMAP_OFF
+ * @brief Minimap mode: hidden
+ */
+#define MINIMAP_OFF    0
 
-static int sneak_peek_at_file(FILE *f);
-static bool start_stuff(void);
-static void clean_stuff(void);
-static bool setup_palette(void);
-static void canvas_fit(void);
-static void input_stuff(int key);
-static void refresh_view(void);
-static void show_status_info(void);
-static void paint_entire_canvas(void);
-static void render_stuff(int x, int y);
-static void show_or_hide_cursor(bool show);
-static Cell* find_spot(int x, int y);
-static void paint_stuff(void);
-static void start_with_blank_canvas(void);
-static void move_brush(int dx, int dy);
-static void save_masterpiece(const char *filename);
-static void load_masterpiece(const char *filename);
-static bool check_if_coordinates_make_sense(int x, int y);
+/**
+ * @def MINIMAP_CORNER
+ * @brief Minimap mode: overlay in the top-right corner of the canvas
+ */
+#define MINIMAP_CORNER 1
 
-/*==============================================================================
- * UTILITY FUNCTIONS
- *============================================================================*/
+/**
+ * @def MINIMAP_FULL
+ * @brief Minimap mode: overview covering the whole canvas area
+ */
+#define MINIMAP_FULL   2
 
 /**
- * @brief Peek at the next character in a file stream without consuming it
- * @param f File stream to peek into
- * @return Next character or EOF if at end of file
+ * @def MINIMAP_MODES
+ * @brief Number of minimap modes (Tab cycles through them)
  */
-static int sneak_peek_at_file(FILE *f) {
-    int c = fgetc(f);
-    if (c != EOF) {
-        ungetc(c, f);
-    }
-    return c;
-}
+#define MINIMAP_MODES  3
 
 /**
- * @brief Convert canvas coordinates to screen coordinates
- * @param y Canvas Y coordinate
- * @return Screen Y coordinate
+ * @def MINIMAP_BASE_BLOCKS
+ * @brief Most blocks in the finest pyramid level; larger worlds use bigger blocks
  */
-static inline int canvas_to_screen_y(int y) {
-    return STATUS_LINES_TOP + y;
-}
+#define MINIMAP_BASE_BLOCKS (1 << 18)
 
 /**
- * @brief Convert canvas coordinates to screen coordinates
- * @param x Canvas X coordinate  
- * @return Screen X coordinate
+ * @def MINIMAP_LEVELS_MAX
+ * @brief Pyramid level capacity (enough to halve 65535 cells down to one block)
  */
-static inline int canvas_to_screen_x(int x) {
-    return x;
-}
+#define MINIMAP_LEVELS_MAX 17
 
 /**
- * @brief Validate canvas coordinates
- * @param x X coordinate to validate
- * @param y Y coordinate to validate
- * @return true if coordinates are within canvas bounds
+ * @def MOTION_REPEAT_US
+ * @brief Movement keys closer together than this count as a held key
  */
-static bool check_if_coordinates_make_sense(int x, int y) {
-    return (x >= 0 && x < g_app.canvas_width && 
-            y >= 0 && y < g_app.canvas_height);
-}
+#define MOTION_REPEAT_US 100000
 
-/*==============================================================================
- * CANVAS OPERATIONS
- *============================================================================*/
+/**
+ * @def MOTION_RAMP_KEYS
+ * @brief Repeats of a held movement key before its step doubles
+ */
+#define MOTION_RAMP_KEYS 4
 
 /**
- * @brief Get a pointer to the cell at the specified coordinates
- * @param x X coordinate
- * @param y Y coordinate
- * @return Pointer to Cell or NULL if coordinates are invalid
+ * @def MOTION_STEP_MAX
+ * @brief Largest step of accelerated movement
  */
-static Cell* find_spot(int x, int y) {
-    if (!check_if_coordinates_make_sense(x, y)) {
-        return NULL;
-    }
-    return &g_app.canvas[y * g_app.canvas_width + x];
-}
+#define MOTION_STEP_MAX 16
 
 /**
- * @brief Paint at the current cursor position
+ * @def SYMMETRY_OFF
+ * @brief Symmetry mode: paint only at the cursor
  */
-static void paint_stuff(void) {
-    Cell *cell = find_spot(g_app.cursor_x, g_app.cursor_y);
-    if (!cell) return;
-    
-    cell->ch = brush_chars[g_app.brush_index];
-    cell->color = g_app.current_color;
-    render_stuff(g_app.cursor_x, g_app.cursor_y);
-}
+#define SYMMETRY_OFF        0
 
+/**
+ * @def SYMMETRY_HORIZONTAL
+ * @brief Symmetry mode: mirror left/right across the center column
+ */
+#define SYMMETRY_HORIZONTAL 1
 
+/**
+ * @def SYMMETRY_VERTICAL
+ * @brief Symmetry mode: mirror top/bottom across the center row
+ */
+#define SYMMETRY_VERTICAL   2
 
 /**
- * @brief Fill the canvas with spaces
+ * @def SYMMETRY_FOUR
+ * @brief Symmetry mode: mirror across both axes
  */
-static void start_with_blank_canvas(void) {
-    const size_t total_cells = (size_t)g_app.canvas_width * (size_t)g_app.canvas_height;
-    
-    for (size_t i = 0; i < total_cells; ++i) {
-        g_app.canvas[i].ch = ' ';
-        g_app.canvas[i].color = g_app.current_color;
-    }
-    
-    paint_entire_canvas();
-}
+#define SYMMETRY_FOUR       3
 
 /**
- * @brief Move cursor with boundary checking and optional auto-paint
- * @param dx X movement delta (-1, 0, or 1)
- * @param dy Y movement delta (-1, 0, or 1)
+ * @def SYMMETRY_RADIAL
+ * @brief Symmetry mode: N copies rotated evenly around the center
  */
-static void move_brush(int dx, int dy) {
-    int new_x = g_app.cursor_x + dx;
-    int new_y = g_app.cursor_y + dy;
-    
-    // Clamp to canvas boundaries
-    if (new_x < 0) new_x = 0;
-    if (new_x >= g_app.canvas_width) new_x = g_app.canvas_width - 1;
-    if (new_y < 0) new_y = 0;
-    if (new_y >= g_app.canvas_height) new_y = g_app.canvas_height - 1;
-    
-    // Only update if position actually changed
-    if (new_x != g_app.cursor_x || new_y != g_app.cursor_y) {
-        g_app.cursor_x = new_x;
-        g_app.cursor_y = new_y;
-        
-        // Auto-paint if pen is down
-        if (g_app.pen_down) {
-            paint_stuff();
-        }
-    }
-}
+#define SYMMETRY_RADIAL     4
 
-/*==============================================================================
- * RENDERING SYSTEM
- *============================================================================*/
+/**
+ * @def SYMMETRY_MODES
+ * @brief Number of symmetry modes (Y cycles through them)
+ */
+#define SYMMETRY_MODES      5
 
 /**
- * @brief Render a single canvas cell to the screen
- * @param x Canvas X coordinate
- * @param y Canvas Y coordinate
+ * @def SYMMETRY_MAX
+ * @brief Most copies of each brush application (radial folds)
  */
-static void render_stuff(int x, int y) {
-    Cell *cell = find_spot(x, y);
-    if (!cell) return;
-    
-    int screen_y = canvas_to_screen_y(y);
-    int screen_x = canvas_to_screen_x(x);
-    
-    // Set color attributes
-    attrset(COLOR_PAIR(cell->color + 1));
-    mvaddch(screen_y, screen_x, cell->ch ? cell->ch : ' ');
-    attrset(A_NORMAL);
-}
+#define SYMMETRY_MAX 16
 
 /**
- * @brief Render the entire canvas to the screen
+ * @def SYMMETRY_DEFAULT_FOLDS
+ * @brief Radial folds until :sym chooses another count
  */
-static void paint_entire_canvas(void) {
-    for (int y = 0; y < g_app.canvas_height; ++y) {
-        for (int x = 0; x < g_app.canvas_width; ++x) {
-            render_stuff(x, y);
-        }
-    }
-}
+#define SYMMETRY_DEFAULT_FOLDS 6
 
 /**
- * @brief Render or hide the cursor highlight
- * @param show true to show cursor, false to hide
+ * @def TRANSFORM_TILE
+ * @brief Side of the square tiles quarter-turn rotations copy through
+ * @details 32x32 cells are 4 KiB, so a source tile and its destination
+ * stay in L1 while the tile's rows are scattered into columns.
  */
-static void show_or_hide_cursor(bool show) {
-    Cell *cell = find_spot(g_app.cursor_x, g_app.cursor_y);
-    if (!cell) return;
-    
-    int screen_y = canvas_to_screen_y(g_app.cursor_y);
-    int screen_x = canvas_to_screen_x(g_app.cursor_x);
-    
-    if (show) {
-        // Highlight cursor with reverse video
-        attrset(COLOR_PAIR(cell->color + 1) | A_REVERSE);
-        mvaddch(screen_y, screen_x, cell->ch ? cell->ch : ' ');
-        attrset(A_NORMAL);
-    } else {
-        // Render normally
-        render_stuff(g_app.cursor_x, g_app.cursor_y);
-    }
-}
+#define TRANSFORM_TILE 32
 
 /**
- * @brief Render the status bars and help information
+ * @def TRANSFORM_SCALE_MAX
+ * @brief Largest scale factor accepted by :scale
  */
-static void show_status_info(void) {
-    // Top status line
-    move(0, 0);
-    clrtoeol();
-    attrset(A_BOLD);
-    printw("Terminal Paint :D  |  Brush: '%c'  |  Color: %s  |  Pen: %s  |  Canvas: %dx%d",
-           brush_chars[g_app.brush_index],
-           color_names[g_app.current_color],
-           g_app.pen_down ? "DOWN" : "UP",
-           g_app.canvas_width,
-           g_app.canvas_height);
-    attrset(A_NORMAL);
+#define TRANSFORM_SCALE_MAX 16
 
-    // Second status line with controls
-    move(1, 0);
-    clrtoeol();
-    printw("Position: (%d,%d)  |  Movement: Arrow keys  |  "
-           "Paint: Space  |  Pen: Enter  |  Tools: B/C/E/X  |  "
-           "Colors: 0-7  |  File: S/L  |  Quit: Q",
-           g_app.cursor_x, g_app.cursor_y);
+/**
+ * @def ANIM_DEFAULT_FPS
+ * @brief Default animation playback rate in frames per second
+ */
+#define ANIM_DEFAULT_FPS 12
 
-    // Bottom help line
-    move(LINES - 1, 0);
-    clrtoeol();
-    printw("Tips: Enter toggles pen mode for continuous painting. "
-           "Files save to '%s'. Use 0-7 for quick color selection.",
-           DEFAULT_SAVE_FILE);
-}
+/**
+ * @def BINARY_MAGIC
+ * @brief First four bytes of a binary canvas file (.bin)
+ */
+#define BINARY_MAGIC "TPCB"
 
 /**
- * @brief Render the complete frame (status + canvas + cursor)
+ * @def BINARY_VERSION
+ * @brief Binary canvas format version (2 added the glyph table, 3 the style
+ * table; older versions still read)
  */
-static void refresh_view(void) {
-    show_status_info();
-    show_or_hide_cursor(true);
-    refresh();
-}
+#define BINARY_VERSION 3
 
-/*==============================================================================
- * FILE I/O OPERATIONS
- *============================================================================*/
+/**
+ * @def BINARY_BYTE_ORDER
+ * @brief Marker stored in native byte order to reject foreign-endian files
+ */
+#define BINARY_BYTE_ORDER 0x01020304u
 
 /**
- * @brief Save the current canvas to a file in custom text format
- * @param filename Target filename (NULL uses DEFAULT_SAVE_FILE)
- * 
- * @details
- * File format specification:
- * - Line 1: "width height" (canvas dimensions)
- * - Subsequent lines: "color,ascii color,ascii ..." (space-separated pairs)
- * - Each row on separate line
- * - color: 0-7 (color index)
- * - ascii: 0-255 (ASCII character code, 32 = space)
- * 
- * @note File creation errors are silently ignored for simplicity
+ * @def BINARY_ALIGN
+ * @brief Alignment of the cell section of binary files (one page)
  */
-static void save_masterpiece(const char *filename) {
-    if (!filename) filename = DEFAULT_SAVE_FILE;
-    
-    FILE *f = fopen(filename, "w");
-    if (!f) {
-        // Could add error reporting here
-        return;
-    }
-    
-    // Write header
-    fprintf(f, "%d %d\n", g_app.canvas_width, g_app.canvas_height);
-    
-    // Write canvas data
-    for (int y = 0; y < g_app.canvas_height; ++y) {
-        for (int x = 0; x < g_app.canvas_width; ++x) {
-            Cell *cell = find_spot(x, y);
-            if (!cell) continue;
-            
-            fprintf(f, "%d,%d", (int)cell->color, (int)cell->ch);
-            if (x < g_app.canvas_width - 1) {
-                fputc(' ', f);
-            }
-        }
-        fputc('\n', f);
+#define BINARY_ALIGN 4096
+
+/**
+ * @def AUTOSAVE_DEFAULT_BACKUPS
+ * @brief Numbered autosave backups kept unless --backups says otherwise
+ */
+#define AUTOSAVE_DEFAULT_BACKUPS 5
+
+/**
+ * @def AUTOSAVE_MAX_BACKUPS
+ * @brief Largest accepted --backups value
+ */
+#define AUTOSAVE_MAX_BACKUPS 99
+
+/**
+ * @def AUTOSAVE_RETRY_MS
+ * @brief Delay before a failed autosave is attempted again
+ */
+#define AUTOSAVE_RETRY_MS 5000
+
+/**
+ * @def HASH_MULTIPLIER
+ * @brief Odd 64-bit constant (2^64 / golden ratio) used to mix canvas hashes
+ */
+#define HASH_MULTIPLIER 0x9E3779B97F4A7C15ull
+
+/**
+ * @def BINARY_PATCH_PERCENT
+ * @brief Most rows (percent) a binary save patches in place
+ * @details Beyond this, streaming the whole file is cheaper than seeking.
+ */
+#define BINARY_PATCH_PERCENT 50
+
+/**
+ * @def MAX_DOCUMENT_SIDE
+ * @brief Largest width or height of a binary document
+ * @details Documents larger than the canvas limits can only be opened
+ * memory-mapped (--open), where the canvas is a viewport onto them.
+ */
+#define MAX_DOCUMENT_SIDE 65535
+
+/**
+ * @def BATCH_MESSAGE_SIZE
+ * @brief Size of per-file result and error messages in batch commands
+ */
+#define BATCH_MESSAGE_SIZE 512
+
+/**
+ * @def DEFAULT_ANSI_FILE
+ * @brief Default filename for ANSI escape art export
+ */
+#define DEFAULT_ANSI_FILE "paint_save.ans"
+
+/**
+ * @def DEFAULT_CAST_FILE
+ * @brief Default filename for asciinema v2 cast export
+ */
+#define DEFAULT_CAST_FILE "paint_save.cast"
+
+/**
+ * @def DEFAULT_HTML_FILE
+ * @brief Default filename for HTML export
+ */
+#define DEFAULT_HTML_FILE "paint_save.html"
+
+/**
+ * @def DEFAULT_PPM_FILE
+ * @brief Default filename for PPM image export
+ */
+#define DEFAULT_PPM_FILE "paint_save.ppm"
+
+/**
+ * @def DEFAULT_IMPORT_FILE
+ * @brief Default image filename for interactive import
+ */
+#define DEFAULT_IMPORT_FILE "paint_import.ppm"
+
+/**
+ * @def IMPORT_DEFAULT_COLUMNS
+ * @brief Default width in cells for headless image import
+ */
+#define IMPORT_DEFAULT_COLUMNS 80
+
+/**
+ * @def FONT_GLYPH_WIDTH
+ * @brief Width in pixels of a built-in font glyph
+ */
+#define FONT_GLYPH_WIDTH  5
+
+/**
+ * @def FONT_GLYPH_HEIGHT
+ * @brief Height in pixels of a built-in font glyph
+ */
+#define FONT_GLYPH_HEIGHT 7
+
+/**
+ * @def PPM_CELL_WIDTH
+ * @brief Width in pixels of one cell in PPM export (glyph plus spacing)
+ */
+#define PPM_CELL_WIDTH  6
+
+/**
+ * @def PPM_CELL_HEIGHT
+ * @brief Height in pixels of one cell in PPM export (glyph plus spacing)
+ */
+#define PPM_CELL_HEIGHT 8
+
+/**
+ * @def EXPORT_BUFFER_SIZE
+ * @brief Size of the streaming writer buffer used by exporters
+ */
+#define EXPORT_BUFFER_SIZE (256 * 1024)
+
+/**
+ * @def STATUS_MESSAGE_SIZE
+ * @brief Capacity of the transient status bar message
+ */
+#define STATUS_MESSAGE_SIZE 128
+
+/**
+ * @def STATUS_LINE_SIZE
+ * @brief Capacity of a status line built before it is clipped to the screen
+ */
+#define STATUS_LINE_SIZE 512
+
+/**
+ * @def KEY_QUEUE_CAPACITY
+ * @brief Capacity of the input key queue (must be a power of two)
+ */
+#define KEY_QUEUE_CAPACITY 1024
+
+/**
+ * @def PASTE_QUEUE_CAPACITY
+ * @brief Pastes that can await the main thread (must be a power of two)
+ */
+#define PASTE_QUEUE_CAPACITY 16
+
+/**
+ * @def PASTE_MAX_BYTES
+ * @brief Largest paste kept; the rest of a longer paste is read and dropped
+ */
+#define PASTE_MAX_BYTES (4 * 1024 * 1024)
+
+/**
+ * @def KEY_PASTE
+ * @brief Queued key standing for the next entry of the paste queue
+ */
+#define KEY_PASTE (KEY_MAX + 1)
+
+/**
+ * @def ESCAPE_TIMEOUT_MS
+ * @brief How long to wait after ESC before treating it as a lone key
+ */
+#define ESCAPE_TIMEOUT_MS 25
+
+/**
+ * @def INPUT_TIMEOUT
+ * @brief input_next_byte() result: no byte arrived in time
+ */
+#define INPUT_TIMEOUT (-2)
+
+/**
+ * @def INPUT_CLOSED
+ * @brief input_next_byte() result: terminal closed or thread asked to stop
+ */
+#define INPUT_CLOSED  (-3)
+
+/**
+ * @def FRAME_RATE_LOCAL
+ * @brief Default frame rate cap for local terminals
+ */
+#define FRAME_RATE_LOCAL  60
+
+/**
+ * @def FRAME_RATE_REMOTE
+ * @brief Default frame rate cap when running over SSH
+ */
+#define FRAME_RATE_REMOTE 15
+
+/**
+ * @def FRAME_RATE_MIN
+ * @brief Lowest rate the adaptive mode will drop to
+ */
+#define FRAME_RATE_MIN 2
+
+/**
+ * @def FRAME_RATE_MAX
+ * @brief Highest accepted --fps value
+ */
+#define FRAME_RATE_MAX 240
+
+/**
+ * @def FRAME_RATE_RECOVERY
+ * @brief Consecutive fast frames before the adaptive mode raises the rate
+ */
+#define FRAME_RATE_RECOVERY 30
+
+/**
+ * @def BRUSH_COUNT
+ * @brief Number of available brush characters
+ */
+#define BRUSH_COUNT (sizeof(brush_chars) / sizeof(brush_chars[0]))
+
+/**
+ * @def IMPORT_RAMP_LEVELS
+ * @brief Brushes (the ASCII ones, from the start of the list) used by image import
+ */
+#define IMPORT_RAMP_LEVELS 10
+
+/**
+ * @def GLYPH_DIRECT
+ * @brief Glyph IDs below this are the Latin-1 code points U+0000-U+00FF
+ */
+#define GLYPH_DIRECT 256
+
+/**
+ * @def GLYPH_MAX
+ * @brief Number of glyph IDs (a cell stores 16 bits)
+ */
+#define GLYPH_MAX 65536
+
+/**
+ * @def UTF8_MAX
+ * @brief Longest UTF-8 encoding of one code point, in bytes
+ */
+#define UTF8_MAX 4
+
+/**
+ * @def GLYPH_INDEX_MIN
+ * @brief Initial slot count of the glyph intern hash (power of two)
+ */
+#define GLYPH_INDEX_MIN 64
+
+/**
+ * @def COLOR_COUNT
+ * @brief Number of base colors (the named ones, selected with 0-7)
+ */
+#define COLOR_COUNT 8
+
+/**
+ * @def ANSI_COLOR_COUNT
+ * @brief Palette entries that are the 16 ANSI colors (base and bright)
+ */
+#define ANSI_COLOR_COUNT 16
+
+/**
+ * @def PALETTE_SIZE
+ * @brief Entries in the xterm 256-color palette
+ */
+#define PALETTE_SIZE 256
+
+/**
+ * @def COLOR_RGB
+ * @brief ColorSpec flag marking a 24-bit 0xRRGGBB value rather than a palette index
+ */
+#define COLOR_RGB 0x1000000u
+
+/**
+ * @def STYLE_DIRECT
+ * @brief Style IDs below this are the base colors on black
+ */
+#define STYLE_DIRECT COLOR_COUNT
+
+/**
+ * @def STYLE_MAX
+ * @brief Number of style IDs (a cell stores 16 bits)
+ */
+#define STYLE_MAX 65536
+
+/**
+ * @def STYLE_INDEX_MIN
+ * @brief Initial slot count of the style intern hash (power of two)
+ */
+#define STYLE_INDEX_MIN 64
+
+/**
+ * @def STYLE_TEXT_SIZE
+ * @brief Buffer size for a style in text form ("#rrggbb/#rrggbb")
+ */
+#define STYLE_TEXT_SIZE 24
+
+/**
+ * @def PAIR_LIMIT
+ * @brief Highest color pair number used (curses passes pairs as short)
+ */
+#define PAIR_LIMIT SHRT_MAX
+
+/**
+ * @def PROMPT_SIZE
+ * @brief Capacity of the command prompt (:) input line
+ */
+#define PROMPT_SIZE 64
+
+/**
+ * @def STATUS_LINES_TOP
+ * @brief Number of status lines reserved at top of screen
+ */
+#define STATUS_LINES_TOP    2
+
+/**
+ * @def STATUS_LINES_BOTTOM
+ * @brief Number of status lines reserved at bottom of screen
+ */
+#define STATUS_LINES_BOTTOM 1
+
+/*==============================================================================
+ * TYPE DEFINITIONS
+ *============================================================================*/
+
+/**
+ * @typedef GlyphId
+ * @brief Character of a cell: a Latin-1 code point below GLYPH_DIRECT,
+ * otherwise an index into the interned glyph table
+ */
+typedef uint16_t GlyphId;
+
+/**
+ * @typedef StyleId
+ * @brief Colors of a cell: a base color on black below STYLE_DIRECT,
+ * otherwise an index into the interned style table
+ */
+typedef uint16_t StyleId;
+
+/**
+ * @typedef ColorSpec
+ * @brief A palette index (0-255) or COLOR_RGB | 0xRRGGBB
+ */
+typedef uint32_t ColorSpec;
+
+/**
+ * @struct Cell
+ * @brief Represents a single canvas cell with character and color information
+ * 
+ * Each cell stores both a glyph ID for the character to display and a
+ * style ID for its foreground and background. Styles are mapped to ncurses
+ * color pairs on demand when drawn.
+ */
+typedef struct {
+    GlyphId glyph;       /**< Character (' ' for empty cells), see glyph_code() */
+    StyleId color;       /**< Foreground and background, see style_of() */
+} Cell;
+
+_Static_assert(sizeof(Cell) == sizeof(uint32_t), "Cell must pack into one 32-bit word");
+
+/**
+ * @struct RowSpan
+ * @brief Occupancy summary of one canvas row
+ * 
+ * Maintained incrementally by buffer_put() so that whole-canvas walks
+ * (save, full repaint) can skip blank rows and trim blank margins.
+ */
+typedef struct {
+    int first;           /**< First non-blank column (-1 if row is empty) */
+    int last;            /**< Last non-blank column (-1 if row is empty) */
+    int count;           /**< Number of non-blank cells in the row */
+} RowSpan;
+
+/**
+ * @struct BrushSpan
+ * @brief One horizontal run of a brush mask
+ */
+typedef struct {
+    int dy;                 /**< Row offset from the top of the mask */
+    int dx;                 /**< Column offset of the run from the left of the mask */
+    int len;                /**< Run length in cells */
+    int src;                /**< Index of the run's first stamp cell (stamps only) */
+} BrushSpan;
+
+/**
+ * @struct BrushMask
+ * @brief Precomputed footprint of the current brush as row spans
+ */
+typedef struct {
+    int shape;              /**< BRUSH_SHAPE_SQUARE ... BRUSH_SHAPE_SPRAY */
+    int size;               /**< Diameter in cells of solid brushes */
+    int density;            /**< Percentage of the footprint a spray paints (1-100) */
+    int width;              /**< Mask bounding box width */
+    int height;             /**< Mask bounding box height */
+    BrushSpan *spans;       /**< Spans (solid_spans or a heap array for stamps) */
+    int span_count;         /**< Number of spans */
+    Cell *stamp;            /**< Stamp cells (width x height), NULL for solid brushes */
+    BrushSpan solid_spans[BRUSH_SIZE_MAX]; /**< Storage for solid brush spans */
+} BrushMask;
+
+/**
+ * @struct Random
+ * @brief xoshiro256** generator state
+ */
+typedef struct {
+    uint64_t s[4];          /**< State; never all zero once seeded */
+} Random;
+
+/**
+ * @struct Motion
+ * @brief Held-key detection for accelerated cursor movement
+ */
+typedef struct {
+    int key;                /**< Last movement key */
+    int repeats;            /**< Consecutive quick repeats of it */
+    int64_t last_us;        /**< When it was handled */
+} Motion;
+
+/**
+ * @struct Symmetry
+ * @brief Symmetry mode and the transforms that place each copy of a stroke
+ * 
+ * Each transform is a 2x2 matrix applied to the cursor's offset from the
+ * center, in the units of the grid being painted (cells, or dots in
+ * sub-cell mode). Cells are twice as tall as wide, so rotations are scaled
+ * to stay round on screen. The first transform is always the identity.
+ */
+typedef struct {
+    int mode;               /**< SYMMETRY_OFF ... SYMMETRY_RADIAL */
+    int folds;              /**< Copies in radial mode (2-SYMMETRY_MAX) */
+    bool centered;          /**< center_x/center_y were chosen; else the canvas center */
+    int center_x;           /**< Center column (document coordinates when one is open) */
+    int center_y;           /**< Center row */
+    int grid;               /**< Sub-cell mode the matrices were built for (-1: stale) */
+    int count;              /**< Transforms in use */
+    double m[SYMMETRY_MAX][4]; /**< Row-major matrices: x' = m0 x + m1 y, y' = m2 x + m3 y */
+} Symmetry;
+
+/**
+ * @struct SubCell
+ * @brief Dot bitmap for sub-cell drawing over the active layer
+ * 
+ * Dot rows are bit arrays (LSB first) padded to whole groups of eight
+ * cells, so one group is 2 bytes per dot row in braille mode and 1 byte
+ * in half-block mode.
+ */
+typedef struct {
+    int mode;               /**< SUBCELL_OFF, SUBCELL_BRAILLE or SUBCELL_HALF */
+    int dot_x;              /**< Cursor X in dots */
+    int dot_y;              /**< Cursor Y in dots */
+    uint8_t *bits;          /**< Dot rows, stride bytes each */
+    size_t stride;          /**< Bytes per dot row */
+    int width;              /**< Canvas width the bitmap was sized for */
+    int height;             /**< Canvas height the bitmap was sized for */
+    uint8_t *codes;         /**< One row of packed dot codes, one per cell */
+    Cell *row;              /**< One row of cells to write back */
+} SubCell;
+
+/**
+ * @struct CellBuffer
+ * @brief Canvas-sized cell storage with lazy clear and occupancy index
+ * 
+ * Used both for each layer and for the composite that is displayed and saved.
+ * The base layer's cells may instead be a window into a mapped document.
+ */
+typedef struct {
+    Cell *cells;            /**< Row-major cell array */
+    int stride;             /**< Cells between row starts (canvas width unless mapped) */
+    unsigned *row_gen;      /**< Per-row generation stamp (stale rows read as blank) */
+    unsigned gen;           /**< Current generation, bumped on every clear */
+    Cell blank;             /**< Cell value that stale rows read as */
+    RowSpan *rows;          /**< Per-row occupancy index (valid for live rows) */
+    bool mapped;            /**< cells alias a document mapping (not owned) */
+    uint64_t *row_edit;     /**< Per-row sequence number of the last edit (composite only) */
+    int touched_top;        /**< First row written since the document index was updated */
+    int touched_bottom;     /**< Last such row (-1 if none); mapped buffers only */
+} CellBuffer;
+
+/**
+ * @struct Layer
+ * @brief One layer of the document; blank cells let lower layers show through
+ */
+typedef struct {
+    CellBuffer buf;         /**< Layer contents */
+    bool visible;           /**< Included in the composite */
+    bool locked;            /**< Rejects edits */
+} Layer;
+
+/**
+ * @struct MiniMap
+ * @brief Downsampling pyramid of non-blank cell counts behind the overview
+ * 
+ * Level k splits the world (the open document, else the composited canvas)
+ * into square blocks of 2^(shift + k) cells and counts the non-blank cells
+ * in each. Writes to the source buffer adjust one block per level, so the
+ * overview reads whichever level fits without scanning any cells.
+ */
+typedef struct {
+    int mode;               /**< MINIMAP_OFF, MINIMAP_CORNER or MINIMAP_FULL */
+    const CellBuffer *source; /**< Buffer being counted (NULL until built) */
+    int shift;              /**< log2 of the level-0 block size in cells */
+    int levels;             /**< Levels in use; the last is a single block */
+    int width[MINIMAP_LEVELS_MAX];  /**< Blocks per row at each level */
+    int height[MINIMAP_LEVELS_MAX]; /**< Block rows at each level */
+    uint32_t *count[MINIMAP_LEVELS_MAX]; /**< Non-blank cells per block, row-major */
+    int x0, y0, x1, y1;     /**< Canvas cells under the last corner overlay (x1 < x0: none) */
+} MiniMap;
+
+/**
+ * @struct Instrumentation
+ * @brief Runtime counters shown on the stats line (F)
+ */
+typedef struct {
+    size_t queue_depth;      /**< Keys waiting when the last batch started */
+    size_t queue_high_water; /**< Deepest the key queue has been */
+    size_t last_batch;       /**< Keys applied in the last batch */
+    unsigned long keys_total; /**< Keys applied since startup */
+} Instrumentation;
+
+/**
+ * @struct FrameScheduler
+ * @brief Caps how often model changes are pushed to the terminal
+ */
+typedef struct {
+    int max_fps;             /**< Configured frame rate cap */
+    int fps;                 /**< Current rate (below max_fps if adaptive lowered it) */
+    bool adaptive;           /**< Lower the rate when refreshes exceed the budget */
+    bool dirty;              /**< Model changed since the last frame */
+    int64_t next_frame_us;   /**< Earliest time the next frame may be emitted */
+    int64_t last_write_us;   /**< Duration of the last refresh() */
+    int64_t write_avg_us;    /**< Smoothed refresh() duration */
+    int fast_frames;         /**< Consecutive frames well within budget */
+    unsigned long frame_count; /**< Frames emitted since startup */
+} FrameScheduler;
+
+/**
+ * @struct DeltaRun
+ * @brief A horizontal run of cells that changed between two frames
+ */
+typedef struct {
+    uint16_t x;             /**< First column */
+    uint16_t y;             /**< Row */
+    uint16_t len;           /**< Run length in cells */
+} DeltaRun;
+
+/**
+ * @struct FrameDelta
+ * @brief One animation frame, stored as the changes from the previous frame
+ */
+typedef struct {
+    DeltaRun *runs;         /**< Changed runs in row-major order */
+    int run_count;          /**< Number of runs */
+    Cell *cells;            /**< New contents of all runs, back to back */
+    int cell_count;         /**< Total cells across runs */
+} FrameDelta;
+
+/**
+ * @struct Timeline
+ * @brief Animation frames of one layer plus playback state
+ * 
+ * Frame 0 is a delta against a blank layer. Only the frame on display and
+ * the one before it are kept in full, for editing and the onion skin.
+ */
+typedef struct {
+    FrameDelta *frames;     /**< Frame deltas (count used, capacity allocated) */
+    int count;              /**< Number of frames; 0 when there is no animation */
+    int capacity;           /**< Allocated frame slots */
+    int current;            /**< Frame on display */
+    int layer;              /**< Layer the animation lives on */
+    Cell *shown;            /**< Current frame as stored (canvas-sized) */
+    Cell *onion;            /**< Previous frame (blank for frame 0) */
+    Cell *scratch;          /**< Work grid for commits */
+    bool onion_skin;        /**< Draw the previous frame dimmed under blanks */
+    bool playing;           /**< Playback running */
+    int fps;                /**< Playback rate */
+    int64_t next_us;        /**< When the next playback frame is due */
+} Timeline;
+
+/**
+ * @struct GlyphTable
+ * @brief Code points of the glyph IDs at and above GLYPH_DIRECT
+ * 
+ * IDs are handed out in order of first use and never reused, so cells stay
+ * valid as the table grows. Lookups by ID are an array index; interning a
+ * code point goes through an open-addressed hash.
+ */
+typedef struct {
+    uint32_t *code;         /**< Code point of glyph ID GLYPH_DIRECT + i */
+    int count;              /**< Interned glyphs */
+    GlyphId *index;         /**< Hash of code points to IDs (0: empty slot) */
+    size_t index_size;      /**< Slots in index (power of two, over twice count) */
+} GlyphTable;
+
+/**
+ * @struct Style
+ * @brief Foreground and background color of a cell
+ */
+typedef struct {
+    ColorSpec fg;           /**< Foreground */
+    ColorSpec bg;           /**< Background (palette 0, black, is the default) */
+} Style;
+
+/**
+ * @struct StyleTable
+ * @brief Colors of the style IDs at and above STYLE_DIRECT
+ * 
+ * Interned like glyphs: IDs are never reused, lookups by ID index an
+ * array and interning goes through an open-addressed hash.
+ */
+typedef struct {
+    Style *style;           /**< Colors of style ID STYLE_DIRECT + i */
+    int count;              /**< Interned styles */
+    StyleId *index;         /**< Hash of styles to IDs (0: empty slot) */
+    size_t index_size;      /**< Slots in index (power of two, over twice count) */
+} StyleTable;
+
+/**
+ * @struct PairSlot
+ * @brief One ncurses color pair managed by the pair cache
+ */
+typedef struct {
+    StyleId style;          /**< Style the pair is initialized to */
+    bool bound;             /**< style is valid */
+    int prev;               /**< Neighbour towards the list head (0: none) */
+    int next;               /**< Neighbour towards the list tail (0: none) */
+    int shown;              /**< Canvas cells currently drawn with the pair */
+    int x0, y0, x1, y1;     /**< Bounding box of those cells */
+} PairSlot;
+
+/**
+ * @struct PairList
+ * @brief Doubly linked LRU list of pair slots, most recently drawn first
+ */
+typedef struct {
+    int head;               /**< Most recently used pair (0: empty) */
+    int tail;               /**< Least recently used pair (0: empty) */
+} PairList;
+
+/**
+ * @struct PairCache
+ * @brief Color pairs allocated to styles on demand, least recently drawn reused first
+ * 
+ * Pairs 1..COLOR_COUNT permanently hold the base styles. The rest are bound
+ * to styles as they are drawn: a pair nothing on screen uses (idle) is
+ * recycled first; otherwise the least recently drawn shown pair is rebound
+ * and the cells still using it are queued for redraw.
+ */
+typedef struct {
+    int colors;             /**< Terminal colors (COLORS) */
+    int first;              /**< First managed pair number */
+    int last;               /**< Last managed pair number (first - 1 if none) */
+    uint16_t *pair_of;      /**< Pair bound to each style ID (0: none) */
+    uint8_t *repair;        /**< Style was rebound away while on screen */
+    PairSlot *slots;        /**< Indexed by pair number */
+    PairList idle;          /**< Bound or unused pairs with no cell on screen */
+    PairList shown;         /**< Pairs drawn on screen */
+    uint16_t *screen;       /**< Pair drawn at each canvas cell (0: unknown) */
+    int screen_width;       /**< Width of screen */
+    int screen_height;      /**< Height of screen */
+    unsigned long evictions; /**< Shown pairs rebound so far */
+} PairCache;
+
+/**
+ * @struct Prompt
+ * @brief Command line opened with ':' on the bottom status line
+ */
+typedef struct {
+    bool active;            /**< Keys go to the prompt */
+    char text[PROMPT_SIZE]; /**< Typed command */
+    size_t len;             /**< Bytes in text */
+} Prompt;
+
+/**
+ * @struct TextEntry
+ * @brief Text mode: typed characters are written at the cursor
+ */
+typedef struct {
+    bool active;            /**< Printable keys type instead of running commands */
+    int line_x;             /**< Column Enter returns to */
+    int next_x;             /**< Where the last character left the cursor */
+    int next_y;             /**< (typing elsewhere starts a new line_x) */
+    char pending[UTF8_MAX + 1]; /**< Bytes of an incomplete UTF-8 character */
+    int pending_len;        /**< Bytes in pending */
+} TextEntry;
+
+/**
+ * @struct Selection
+ * @brief Rectangular canvas selection that limits find-and-replace
+ * 
+ * Corners are in document coordinates when a document is open (canvas
+ * coordinates otherwise), so the selection stays on the cells it was made
+ * over while the viewport scrolls.
+ */
+typedef struct {
+    bool anchored;          /**< First corner placed, waiting for the second */
+    bool active;            /**< Rectangle below is in effect */
+    int x0, y0;             /**< Top-left corner (the anchor while anchored) */
+    int x1, y1;             /**< Bottom-right corner, inclusive */
+} Selection;
+
+/**
+ * @struct BinaryHeader
+ * @brief Header of the binary canvas format (.bin), in native byte order
+ */
+typedef struct {
+    char magic[4];          /**< BINARY_MAGIC */
+    uint32_t byte_order;    /**< BINARY_BYTE_ORDER as written by the saving host */
+    uint32_t version;       /**< BINARY_VERSION */
+    uint32_t width;         /**< Canvas width in cells */
+    uint32_t height;        /**< Canvas height in cells */
+    uint32_t rows_offset;   /**< Offset of the per-row RowSpan index */
+    uint32_t cells_offset;  /**< Offset of the cells (multiple of BINARY_ALIGN) */
+    Cell blank;             /**< Cell blank positions hold */
+    uint32_t glyph_count;   /**< Code points following the cells, for IDs >= GLYPH_DIRECT */
+    uint32_t style_count;   /**< Styles following the glyphs, for IDs >= STYLE_DIRECT */
+    uint32_t reserved[6];   /**< Zero */
+} BinaryHeader;
+
+_Static_assert(sizeof(Style) == 2 * sizeof(uint32_t), "Style entries are part of the binary format");
+_Static_assert(sizeof(BinaryHeader) == 64, "BinaryHeader layout is part of the file format");
+
+/**
+ * @struct Document
+ * @brief A binary canvas file mapped as the storage of the base layer
+ */
+typedef struct {
+    char name[PATH_MAX];    /**< File name, for the status bar */
+    int fd;                 /**< Open file descriptor */
+    void *map;              /**< Whole-file shared mapping (NULL when closed) */
+    size_t map_size;        /**< Mapping length */
+    BinaryHeader *header;   /**< Header inside the mapping */
+    RowSpan *rows;          /**< Stored occupancy index inside the mapping */
+    Cell *cells;            /**< Cells inside the mapping */
+    int width;              /**< Document width in cells */
+    int height;             /**< Document height in cells */
+    int view_x;             /**< Document column at the canvas's left edge */
+    int view_y;             /**< Document row at the canvas's top edge */
+    int dirty_top;          /**< First row changed since the last sync */
+    int dirty_bottom;       /**< Last row changed since the last sync (-1 if none) */
+} Document;
+
+/**
+ * @struct SaveState
+ * @brief Edit sequence of the composite and what the last save covered
+ */
+typedef struct {
+    const char *path;           /**< File S saves to and L loads from */
+    uint64_t edits;             /**< Composite edits so far (sequence counter) */
+    uint64_t clear_edit;        /**< Sequence number of the last whole-canvas clear */
+    char baseline[PATH_MAX];    /**< File the last save wrote ("" if none) */
+    uint64_t baseline_edit;     /**< Sequence number that save covered */
+    uint64_t baseline_hash;     /**< canvas_hash() of what that save wrote */
+    int baseline_glyphs;        /**< Glyph table entries that save wrote */
+    int baseline_styles;        /**< Style table entries that save wrote */
+    struct stat baseline_stat;  /**< Identity of the file right after that save */
+    int patched_rows;           /**< Rows the last binary save patched (-1: full write) */
+    bool skipped;               /**< The last save found the file already up to date */
+} SaveState;
+
+/**
+ * @struct CanvasSnapshot
+ * @brief Copy of the composite handed to the autosave thread
+ */
+typedef struct {
+    int width;              /**< Canvas width */
+    int height;             /**< Canvas height */
+    Cell blank;             /**< Cell value of blank rows */
+    RowSpan *rows;          /**< Occupancy of every row */
+    Cell *cells;            /**< Row-major cells; only occupied rows are filled in */
+    uint32_t *glyphs;       /**< Copy of the glyph table */
+    int glyph_count;        /**< Entries in glyphs */
+    Style *styles;          /**< Copy of the style table */
+    int style_count;        /**< Entries in styles */
+} CanvasSnapshot;
+
+/**
+ * @struct Autosave
+ * @brief Autosave settings and the hand-off to the backup writer thread
+ */
+typedef struct {
+    int interval_s;             /**< Seconds between autosaves (0: none) */
+    int every_edits;            /**< Row edits that force an autosave (0: none) */
+    int backups;                /**< Numbered backups kept */
+    bool running;               /**< Writer thread is running */
+    int64_t next_us;            /**< When the interval is next due */
+    int64_t retry_us;           /**< No new attempt before this after a failure */
+    uint64_t saved_edit;        /**< Edit sequence the last written backup covers */
+    uint64_t saved_hash;        /**< canvas_hash() of the last written backup */
+    uint64_t queued_hash;       /**< canvas_hash() of the last snapshot handed over */
+    char stem[PATH_MAX];        /**< Backup names are stem.N.bin */
+    pthread_t thread;           /**< Writer thread */
+    pthread_mutex_t lock;       /**< Guards pending and stop */
+    pthread_cond_t wake;        /**< Signalled when pending or stop changes */
+    CanvasSnapshot *pending;    /**< Snapshot waiting to be written */
+    uint64_t pending_hash;      /**< canvas_hash() of pending */
+    uint64_t pending_edit;      /**< Edit sequence of pending */
+    bool stop;                  /**< Writer should exit once pending is written */
+    atomic_int error;           /**< errno of the last failed backup (0: none) */
+    atomic_bool written;        /**< A backup succeeded; written_hash/edit are new */
+    uint64_t written_hash;      /**< canvas_hash() of the last successful backup (under lock) */
+    uint64_t written_edit;      /**< Edit sequence of the last successful backup (under lock) */
+} Autosave;
+
+/**
+ * @struct AppState
+ * @brief Global application state container
+ * 
+ * Centralizes all application state for better organization and
+ * easier debugging/maintenance.
+ */
+typedef struct {
+    CellBuffer canvas;      /**< Composite of visible layers (displayed, saved, exported) */
+    Layer layers[MAX_LAYERS]; /**< Layer stack, index 0 at the bottom */
+    int layer_count;        /**< Number of layers in use */
+    int active_layer;       /**< Index of the layer edits apply to */
+    Cell *scratch_row;      /**< One row of cells for compositing */
+    RowSpan *scratch_spans; /**< One span per row for dirty-region bookkeeping */
+    RowSpan *dirty_rows;    /**< Per-row columns to redraw at the next frame */
+    int dirty_top;          /**< First row with a dirty span (canvas_height if none) */
+    int dirty_bottom;       /**< Last row with a dirty span (-1 if none) */
+    BrushMask brush;        /**< Current brush footprint */
+    Random rng;             /**< Spray randomness (seeded, so replays repeat) */
+    SubCell subcell;        /**< Sub-cell (dot) drawing */
+    Motion motion;          /**< Movement key acceleration */
+    Symmetry symmetry;      /**< Mirror/radial painting */
+    MiniMap minimap;        /**< Overview pyramid (interactive only) */
+    Selection selection;    /**< Region find-and-replace is limited to */
+    Timeline timeline;      /**< Animation frames */
+    GlyphTable glyphs;      /**< Interned glyphs (per thread, like the rest of g_app) */
+    StyleTable styles;      /**< Interned styles (per thread) */
+    PairCache pairs;        /**< Color pairs bound to styles (interactive only) */
+    Prompt prompt;          /**< ':' command line */
+    TextEntry text;         /**< Text mode */
+    Document document;      /**< Mapped document behind the base layer, if any */
+    SaveState save;         /**< Edit tracking for saves */
+    Autosave autosave;      /**< Timed backups */
+    int canvas_width;       /**< Canvas width in characters */
+    int canvas_height;      /**< Canvas height in characters */
+    int cursor_x;           /**< Current cursor X position */
+    int cursor_y;           /**< Current cursor Y position */
+    bool pen_down;          /**< Pen mode: paint while moving */
+    int brush_index;        /**< Current brush character index */
+    StyleId current_color;  /**< Current style (colors) */
+    bool running;           /**< Main loop control flag */
+    char status_msg[STATUS_MESSAGE_SIZE]; /**< Transient message replacing the tips line */
+    bool show_stats;        /**< Show instrumentation instead of the tips line */
+    Instrumentation stats;  /**< Runtime counters */
+    FrameScheduler frames;  /**< Terminal update pacing */
+} AppState;
+
+/**
+ * @struct KeyQueue
+ * @brief Lock-free single-producer/single-consumer ring of key codes
+ * 
+ * The input thread only advances tail and the main thread only advances
+ * head; each index lives on its own cache line.
+ */
+typedef struct {
+    int keys[KEY_QUEUE_CAPACITY];           /**< Ring storage */
+    _Alignas(64) atomic_size_t head;        /**< Next slot to read (consumer) */
+    _Alignas(64) atomic_size_t tail;        /**< Next slot to write (producer) */
+} KeyQueue;
+
+/**
+ * @struct Paste
+ * @brief One bracketed paste, collected by the input thread
+ */
+typedef struct {
+    char *text;             /**< Pasted bytes, NUL-terminated (owned by the receiver) */
+    size_t len;             /**< Bytes in text */
+} Paste;
+
+/**
+ * @struct PasteQueue
+ * @brief Single-producer/single-consumer ring of pastes, one per KEY_PASTE queued
+ */
+typedef struct {
+    Paste pastes[PASTE_QUEUE_CAPACITY];     /**< Ring storage */
+    _Alignas(64) atomic_size_t head;        /**< Next slot to read (consumer) */
+    _Alignas(64) atomic_size_t tail;        /**< Next slot to write (producer) */
+} PasteQueue;
+
+/**
+ * @struct InputThread
+ * @brief State shared between the input thread and the main thread
+ */
+typedef struct {
+    pthread_t thread;       /**< Thread reading the terminal */
+    KeyQueue queue;         /**< Decoded keys awaiting the main thread */
+    PasteQueue pastes;      /**< Paste payloads of the KEY_PASTE keys in queue */
+    int wake_pipe[2];       /**< Written after keys are queued; main thread polls it */
+    int stop_pipe[2];       /**< Written by the main thread to stop the input thread */
+    atomic_bool closed;     /**< Set once the terminal reaches EOF */
+    unsigned char buf[4096]; /**< Raw bytes read from the terminal (thread-private) */
+    size_t len;             /**< Bytes in buf */
+    size_t pos;             /**< Next unread byte in buf */
+} InputThread;
+
+/**
+ * @struct StreamWriter
+ * @brief Buffered single-pass output stream used by exporters
+ * 
+ * Exporters append small fragments; the buffer is written out whenever it
+ * fills, so memory use is independent of canvas size.
+ */
+typedef struct {
+    FILE *f;                        /**< Destination file (unbuffered) */
+    size_t len;                     /**< Bytes currently buffered */
+    bool failed;                    /**< Sticky write error flag */
+    char buf[EXPORT_BUFFER_SIZE];   /**< Output buffer */
+} StreamWriter;
+
+/**
+ * @struct PnmReader
+ * @brief Streaming reader for PPM/PGM images (P2, P3, P5, P6)
+ */
+typedef struct {
+    FILE *f;                /**< Image file positioned at the next pixel row */
+    int width;              /**< Image width in pixels */
+    int height;             /**< Image height in pixels */
+    int maxval;             /**< Maximum sample value (1-65535) */
+    int channels;           /**< 1 for PGM, 3 for PPM */
+    bool ascii;             /**< Plain (P2/P3) rather than raw samples */
+    unsigned char *raw;     /**< Row buffer for raw samples */
+} PnmReader;
+
+/**
+ * @struct CanvasStats
+ * @brief Summary printed by the stat command
+ */
+typedef struct {
+    int width;              /**< Canvas width */
+    int height;             /**< Canvas height */
+    long used;              /**< Non-blank cells */
+    int left, top;          /**< Bounding box of non-blank cells (top-left) */
+    int right, bottom;      /**< Bounding box (bottom-right, inclusive) */
+    long colors[COLOR_COUNT]; /**< Non-blank cells per base color */
+    long other_colors;      /**< Non-blank cells in other styles */
+    int glyphs;             /**< Distinct non-blank characters */
+} CanvasStats;
+
+/**
+ * @enum BatchCommand
+ * @brief Per-file operations of the validate, stat, convert and batch commands
+ */
+typedef enum {
+    BATCH_VALIDATE,         /**< Strictly parse the file */
+    BATCH_STAT,             /**< Parse and print statistics */
+    BATCH_CONVERT           /**< Load and write in another format */
+} BatchCommand;
+
+/**
+ * @struct BatchJob
+ * @brief A directory of files shared by the batch workers
+ */
+typedef struct {
+    BatchCommand cmd;       /**< Operation for every file */
+    const char *dir;        /**< Input directory */
+    const char *out_dir;    /**< Output directory (convert) */
+    const char *ext;        /**< Output extension, with the dot (convert) */
+    int jobs;               /**< Worker threads */
+    char **names;           /**< File names in dir, sorted */
+    size_t count;           /**< Number of names */
+    atomic_size_t next;     /**< Next unclaimed index into names */
+    atomic_size_t failed;   /**< Files that failed */
+    _Atomic uint64_t bytes; /**< Input bytes processed */
+} BatchJob;
+
+/**
+ * @struct SimdKernels
+ * @brief Data-parallel kernels, bound to the widest implementation the CPU supports
+ */
+typedef struct {
+    void (*accumulate_bytes)(uint32_t *acc, const uint8_t *src, size_t n);
+    void (*classify_rgb)(const uint8_t *r, const uint8_t *g, const uint8_t *b,
+                         size_t n, uint8_t *luma, uint8_t *color);
+    size_t (*skip_equal_cells)(const Cell *cells, size_t n, uint32_t bits);
+    size_t (*find_matching_cell)(const Cell *cells, size_t n, uint32_t bits, uint32_t mask);
+} SimdKernels;
+
+/*==============================================================================
+ * GLOBAL DATA
+ *============================================================================*/
+
+/**
+ * @var g_app
+ * @brief Global application state instance
+ * @details Centralized state container for the entire application. Each
+ * thread gets its own copy, so batch workers can load, convert and save
+ * canvases in parallel; the input thread never touches it.
+ */
+static _Thread_local AppState g_app = {0};
+
+/**
+ * @var g_input
+ * @brief Input thread and its key queue
+ */
+static InputThread g_input;
+
+/**
+ * @var simd
+ * @brief Active SIMD kernels
+ * @details Unbound until select_simd_kernels() runs at startup
+ */
+static SimdKernels simd = { 0 };
+
+/**
+ * @var brush_chars
+ * @brief Available brush characters (code points), ASCII ones ordered by visual density
+ * @details Modifiable array that can be altered for special modes like eraser
+ */
+static uint32_t brush_chars[] = {
+    '#', '*', '@', '%', '+', 'o', 'x', '.', '~', '&',
+    0x2588, 0x2593, 0x2592, 0x2591, 0x2580, 0x2584, 0x25CF, 0x2022,
+    0x2500, 0x2502, 0x253C, 0x2571, 0x2572,
+};
+
+/**
+ * @var original_brush_chars
+ * @brief Backup copy of original brush characters
+ * @details Used to restore brushes after eraser mode or other modifications
+ */
+static const uint32_t original_brush_chars[] = {
+    '#', '*', '@', '%', '+', 'o', 'x', '.', '~', '&',
+    0x2588, 0x2593, 0x2592, 0x2591, 0x2580, 0x2584, 0x25CF, 0x2022,
+    0x2500, 0x2502, 0x253C, 0x2571, 0x2572,
+};
+
+/**
+ * @var base_colors
+ * @brief Color mapping to ncurses COLOR_* constants
+ * @details Maps color indices 0-7 to their corresponding ncurses color values
+ */
+static const short base_colors[COLOR_COUNT] = {
+    COLOR_BLACK, COLOR_RED, COLOR_GREEN, COLOR_YELLOW,
+    COLOR_BLUE, COLOR_MAGENTA, COLOR_CYAN, COLOR_WHITE
+};
+
+/**
+ * @var color_names
+ * @brief Human-readable color names for status display
+ * @details String representations of colors for user interface display
+ */
+static const char *color_names[COLOR_COUNT] = {
+    "BLACK", "RED", "GREEN", "YELLOW", "BLUE", "MAGENTA", "CYAN", "WHITE"
+};
+
+/**
+ * @var export_rgb
+ * @brief RGB values of the palette colors for image and HTML export
+ * @details Standard xterm values for the 8 base colors and their bright
+ * variants, in palette index order; palette_rgb() derives the rest
+ */
+static const unsigned char export_rgb[ANSI_COLOR_COUNT][3] = {
+    {   0,   0,   0 }, { 205,   0,   0 }, {   0, 205,   0 }, { 205, 205,   0 },
+    {   0,   0, 238 }, { 205,   0, 205 }, {   0, 205, 205 }, { 229, 229, 229 },
+    { 127, 127, 127 }, { 255,   0,   0 }, {   0, 255,   0 }, { 255, 255,   0 },
+    {  92,  92, 255 }, { 255,   0, 255 }, {   0, 255, 255 }, { 255, 255, 255 }
+};
+
+/**
+ * @var cube_levels
+ * @brief Channel values of the 6x6x6 color cube (palette entries 16-231)
+ */
+static const unsigned char cube_levels[6] = { 0, 95, 135, 175, 215, 255 };
+
+/**
+ * @var font_5x7
+ * @brief Built-in bitmap font for printable ASCII (0x20-0x7E)
+ * @details Column-major: one byte per glyph column, bit 0 is the top row
+ */
+static const unsigned char font_5x7[95][FONT_GLYPH_WIDTH] = {
+    { 0x00, 0x00, 0x00, 0x00, 0x00 },  /* ' ' */
+    { 0x00, 0x00, 0x5F, 0x00, 0x00 },  /* '!' */
+    { 0x00, 0x07, 0x00, 0x07, 0x00 },  /* '"' */
+    { 0x14, 0x7F, 0x14, 0x7F, 0x14 },  /* '#' */
+    { 0x24, 0x2A, 0x7F, 0x2A, 0x12 },  /* '$' */
+    { 0x23, 0x13, 0x08, 0x64, 0x62 },  /* '%' */
+    { 0x36, 0x49, 0x55, 0x22, 0x50 },  /* '&' */
+    { 0x00, 0x05, 0x03, 0x00, 0x00 },  /* ''' */
+    { 0x00, 0x1C, 0x22, 0x41, 0x00 },  /* '(' */
+    { 0x00, 0x41, 0x22, 0x1C, 0x00 },  /* ')' */
+    { 0x08, 0x2A, 0x1C, 0x2A, 0x08 },  /* '*' */
+    { 0x08, 0x08, 0x3E, 0x08, 0x08 },  /* '+' */
+    { 0x00, 0x50, 0x30, 0x00, 0x00 },  /* ',' */
+    { 0x08, 0x08, 0x08, 0x08, 0x08 },  /* '-' */
+    { 0x00, 0x60, 0x60, 0x00, 0x00 },  /* '.' */
+    { 0x20, 0x10, 0x08, 0x04, 0x02 },  /* '/' */
+    { 0x3E, 0x51, 0x49, 0x45, 0x3E },  /* '0' */
+    { 0x00, 0x42, 0x7F, 0x40, 0x00 },  /* '1' */
+    { 0x42, 0x61, 0x51, 0x49, 0x46 },  /* '2' */
+    { 0x21, 0x41, 0x45, 0x4B, 0x31 },  /* '3' */
+    { 0x18, 0x14, 0x12, 0x7F, 0x10 },  /* '4' */
+    { 0x27, 0x45, 0x45, 0x45, 0x39 },  /* '5' */
+    { 0x3C, 0x4A, 0x49, 0x49, 0x30 },  /* '6' */
+    { 0x01, 0x71, 0x09, 0x05, 0x03 },  /* '7' */
+    { 0x36, 0x49, 0x49, 0x49, 0x36 },  /* '8' */
+    { 0x06, 0x49, 0x49, 0x29, 0x1E },  /* '9' */
+    { 0x00, 0x36, 0x36, 0x00, 0x00 },  /* ':' */
+    { 0x00, 0x56, 0x36, 0x00, 0x00 },  /* ';' */
+    { 0x08, 0x14, 0x22, 0x41, 0x00 },  /* '<' */
+    { 0x14, 0x14, 0x14, 0x14, 0x14 },  /* '=' */
+    { 0x00, 0x41, 0x22, 0x14, 0x08 },  /* '>' */
+    { 0x02, 0x01, 0x51, 0x09, 0x06 },  /* '?' */
+    { 0x32, 0x49, 0x79, 0x41, 0x3E },  /* '@' */
+    { 0x7E, 0x11, 0x11, 0x11, 0x7E },  /* 'A' */
+    { 0x7F, 0x49, 0x49, 0x49, 0x36 },  /* 'B' */
+    { 0x3E, 0x41, 0x41, 0x41, 0x22 },  /* 'C' */
+    { 0x7F, 0x41, 0x41, 0x22, 0x1C },  /* 'D' */
+    { 0x7F, 0x49, 0x49, 0x49, 0x41 },  /* 'E' */
+    { 0x7F, 0x09, 0x09, 0x09, 0x01 },  /* 'F' */
+    { 0x3E, 0x41, 0x49, 0x49, 0x7A },  /* 'G' */
+    { 0x7F, 0x08, 0x08, 0x08, 0x7F },  /* 'H' */
+    { 0x00, 0x41, 0x7F, 0x41, 0x00 },  /* 'I' */
+    { 0x20, 0x40, 0x41, 0x3F, 0x01 },  /* 'J' */
+    { 0x7F, 0x08, 0x14, 0x22, 0x41 },  /* 'K' */
+    { 0x7F, 0x40, 0x40, 0x40, 0x40 },  /* 'L' */
+    { 0x7F, 0x02, 0x0C, 0x02, 0x7F },  /* 'M' */
+    { 0x7F, 0x04, 0x08, 0x10, 0x7F },  /* 'N' */
+    { 0x3E, 0x41, 0x41, 0x41, 0x3E },  /* 'O' */
+    { 0x7F, 0x09, 0x09, 0x09, 0x06 },  /* 'P' */
+    { 0x3E, 0x41, 0x51, 0x21, 0x5E },  /* 'Q' */
+    { 0x7F, 0x09, 0x19, 0x29, 0x46 },  /* 'R' */
+    { 0x46, 0x49, 0x49, 0x49, 0x31 },  /* 'S' */
+    { 0x01, 0x01, 0x7F, 0x01, 0x01 },  /* 'T' */
+    { 0x3F, 0x40, 0x40, 0x40, 0x3F },  /* 'U' */
+    { 0x1F, 0x20, 0x40, 0x20, 0x1F },  /* 'V' */
+    { 0x3F, 0x40, 0x38, 0x40, 0x3F },  /* 'W' */
+    { 0x63, 0x14, 0x08, 0x14, 0x63 },  /* 'X' */
+    { 0x07, 0x08, 0x70, 0x08, 0x07 },  /* 'Y' */
+    { 0x61, 0x51, 0x49, 0x45, 0x43 },  /* 'Z' */
+    { 0x00, 0x7F, 0x41, 0x41, 0x00 },  /* '[' */
+    { 0x02, 0x04, 0x08, 0x10, 0x20 },  /* '\\' */
+    { 0x00, 0x41, 0x41, 0x7F, 0x00 },  /* ']' */
+    { 0x04, 0x02, 0x01, 0x02, 0x04 },  /* '^' */
+    { 0x40, 0x40, 0x40, 0x40, 0x40 },  /* '_' */
+    { 0x00, 0x01, 0x02, 0x04, 0x00 },  /* '`' */
+    { 0x20, 0x54, 0x54, 0x54, 0x78 },  /* 'a' */
+    { 0x7F, 0x48, 0x44, 0x44, 0x38 },  /* 'b' */
+    { 0x38, 0x44, 0x44, 0x44, 0x20 },  /* 'c' */
+    { 0x38, 0x44, 0x44, 0x48, 0x7F },  /* 'd' */
+    { 0x38, 0x54, 0x54, 0x54, 0x18 },  /* 'e' */
+    { 0x08, 0x7E, 0x09, 0x01, 0x02 },  /* 'f' */
+    { 0x0C, 0x52, 0x52, 0x52, 0x3E },  /* 'g' */
+    { 0x7F, 0x08, 0x04, 0x04, 0x78 },  /* 'h' */
+    { 0x00, 0x44, 0x7D, 0x40, 0x00 },  /* 'i' */
+    { 0x20, 0x40, 0x44, 0x3D, 0x00 },  /* 'j' */
+    { 0x7F, 0x10, 0x28, 0x44, 0x00 },  /* 'k' */
+    { 0x00, 0x41, 0x7F, 0x40, 0x00 },  /* 'l' */
+    { 0x7C, 0x04, 0x18, 0x04, 0x78 },  /* 'm' */
+    { 0x7C, 0x08, 0x04, 0x04, 0x78 },  /* 'n' */
+    { 0x38, 0x44, 0x44, 0x44, 0x38 },  /* 'o' */
+    { 0x7C, 0x14, 0x14, 0x14, 0x08 },  /* 'p' */
+    { 0x08, 0x14, 0x14, 0x18, 0x7C },  /* 'q' */
+    { 0x7C, 0x08, 0x04, 0x04, 0x08 },  /* 'r' */
+    { 0x48, 0x54, 0x54, 0x54, 0x20 },  /* 's' */
+    { 0x04, 0x3F, 0x44, 0x40, 0x20 },  /* 't' */
+    { 0x3C, 0x40, 0x40, 0x20, 0x7C },  /* 'u' */
+    { 0x1C, 0x20, 0x40, 0x20, 0x1C },  /* 'v' */
+    { 0x3C, 0x40, 0x30, 0x40, 0x3C },  /* 'w' */
+    { 0x44, 0x28, 0x10, 0x28, 0x44 },  /* 'x' */
+    { 0x0C, 0x50, 0x50, 0x50, 0x3C },  /* 'y' */
+    { 0x44, 0x64, 0x54, 0x4C, 0x44 },  /* 'z' */
+    { 0x00, 0x08, 0x36, 0x41, 0x00 },  /* '{' */
+    { 0x00, 0x00, 0x7F, 0x00, 0x00 },  /* '|' */
+    { 0x00, 0x41, 0x36, 0x08, 0x00 },  /* '}' */
+    { 0x08, 0x04, 0x08, 0x10, 0x08 },  /* '~' */
+};
+
+/**
+ * @var subcell_dots
+ * @brief Dots per cell (columns, rows) in each sub-cell mode
+ */
+static const int subcell_dots[SUBCELL_MODES][2] = { { 1, 1 }, { 2, 4 }, { 1, 2 } };
+
+/**
+ * @var subcell_names
+ * @brief Sub-cell mode names for status display
+ */
+static const char *subcell_names[SUBCELL_MODES] = { "off", "braille", "half-block" };
+
+/**
+ * @var half_block_chars
+ * @brief Half-block glyph for each 2-bit code (bit 0 top, bit 1 bottom)
+ */
+static const uint32_t half_block_chars[4] = { ' ', 0x2580, 0x2584, 0x2588 };
+
+/**
+ * @var subcell_pack_lut
+ * @brief Glyph code contributions of one bitmap byte, per mode and dot row
+ * @details Entry [mode - 1][r][byte] holds, in byte lane k, the code bits
+ * the byte's dots set in the k-th cell it covers. OR-ing the entries of a
+ * group's bytes over all dot rows yields the codes of eight cells in one
+ * 64-bit word. Filled by subcell_build_tables().
+ */
+static uint64_t subcell_pack_lut[SUBCELL_MODES - 1][4][256];
+
+/**
+ * @var subcell_unpack_lut
+ * @brief Dots of each dot row of a cell, per mode and glyph code
+ * @details Entry [mode - 1][code][r] holds the cell's dots in row r as
+ * bits 0..columns-1. Filled by subcell_build_tables().
+ */
+static uint8_t subcell_unpack_lut[SUBCELL_MODES - 1][256][4];
+
+/*==============================================================================
+ * FORWARD DECLARATIONS
+ *============================================================================*/
+
+static int sneak_peek_at_file(FILE *f);
+static bool start_stuff(void);
+static void clean_stuff(void);
+static bool setup_palette(void);
+static void canvas_fit(void);
+static void input_stuff(int key);
+static void refresh_view(void);
+static void show_status_info(void);
+static void paint_entire_canvas(void);
+static void render_stuff(int x, int y);
+static void show_or_hide_cursor(bool show);
+static const Cell* peek_spot(int x, int y);
+static bool put_cell(int x, int y, Cell value);
+static RowSpan row_occupancy(int y);
+static void erase_canvas_area(void);
+static void mark_dirty(int x0, int y0, int x1, int y1);
+static void flush_dirty(void);
+static void apply_brush(int cx, int cy, Cell value);
+static void rebuild_brush_mask(void);
+static bool load_stamp_brush(const char *filename);
+static void set_brush_shape(int shape);
+static void resize_brush(int delta);
+static void random_seed(Random *rng, uint64_t seed);
+static uint64_t spray_hits(int n);
+static bool spray_next_run(uint64_t *hits, int *first, int *len);
+static bool parse_cell_pattern(const char *spec, uint32_t *bits, uint32_t *mask);
+static void toggle_selection(void);
+static int replace_matching(uint32_t bits, uint32_t mask, uint32_t to, uint32_t set_mask);
+static void replace_under_cursor(void);
+static int64_t now_usec(void);
+static void timeline_free(void);
+static bool timeline_commit(void);
+static void timeline_goto(int index);
+static void timeline_add_frame(void);
+static void timeline_delete_frame(void);
+static void timeline_step(int step);
+static void timeline_toggle_onion(void);
+static void timeline_toggle_play(void);
+static int timeline_wait_ms(void);
+static bool timeline_tick(void);
+static const Cell* onion_cell(int x, int y);
+static bool export_animation_cast(const char *filename);
+static void report_error(char *err, size_t err_size, const char *fmt, ...);
+static bool binary_header_valid(const BinaryHeader *header, uint64_t file_size,
+                                char *err, size_t err_size);
+static inline uint32_t binary_cells_offset(int height);
+static inline uint64_t binary_glyphs_offset(int width, int height);
+static inline uint64_t binary_styles_offset(int width, int height, uint32_t glyph_count);
+static bool binary_append_tables(int fd, int width, int height, int glyphs, int styles);
+static bool has_extension(const char *filename, const char *ext);
+static Cell* read_any_canvas(const char *filename, int *width, int *height);
+static bool save_binary_incremental(const char *filename);
+static void document_scroll(int dx, int dy, int *moved_x, int *moved_y);
+static bool document_sync(void);
+static void document_close(void);
+static bool open_document(const char *filename);
+static void paint_stuff(void);
+static void start_with_blank_canvas(void);
+static void move_brush(int dx, int dy);
+static void subcell_paint(int dot_x, int dot_y);
+static int symmetry_points(int x, int y, int *px, int *py);
+static void subcell_move(int dx, int dy);
+static void subcell_release(void);
+static void minimap_count(int x, int y, int delta);
+static void minimap_clear(void);
+static void minimap_free(void);
+static void minimap_draw(void);
+static bool save_masterpiece(const char *filename);
+static bool save_text(const char *filename);
+static bool save_baseline_current(const char *filename);
+static void load_masterpiece(const char *filename);
+static bool check_if_coordinates_make_sense(int x, int y);
+static void set_status_message(const char *fmt, ...);
+static bool export_ansi(const char *filename);
+static bool export_asciicast(const char *filename);
+static bool export_html(const char *filename);
+static bool export_ppm(const char *filename);
+static bool export_by_extension(const char *filename);
+static Cell* read_canvas_file(const char *filename, int *width, int *height);
+static bool canvas_allocate(int width, int height);
+static void canvas_release(void);
+static bool canvas_from_file(const char *filename);
+static int run_command_line(int argc, char **argv);
+static void select_simd_kernels(void);
+static void import_picture(const char *filename);
+static void add_layer(void);
+static void toggle_layer_visibility(void);
+static bool start_input_thread(void);
+static void stop_input_thread(void);
+static void wait_for_input(int timeout_ms);
+static size_t process_input_batch(void);
+static void paste_text(const char *text, size_t len);
+static bool text_key(int key);
+static void frames_init(int max_fps, bool adaptive);
+static int frames_wait_ms(void);
+static void frames_tick(void);
+static int default_frame_rate(void);
+static void publish_masterpiece(void);
+static BinaryHeader binary_header(int width, int height, Cell blank);
+static uint64_t canvas_hash(void);
+static void snapshot_free(CanvasSnapshot *snap);
+static bool autosave_start(void);
+static void autosave_stop(void);
+static int autosave_wait_ms(void);
+static void autosave_tick(void);
+static void palette_rgb(ColorSpec color, unsigned char rgb[3]);
+static int nearest_palette(const unsigned char rgb[3], int entries);
+static void pair_cache_forget(void);
+static bool parse_color(const char *text, StyleId *color);
+
+/*==============================================================================
+ * UTILITY FUNCTIONS
+ *============================================================================*/
+
+/**
+ * @brief Peek at the next character in a file stream without consuming it
+ * @param f File stream to peek into
+ * @return Next character or EOF if at end of file
+ */
+static int sneak_peek_at_file(FILE *f) {
+    int c = fgetc(f);
+    if (c != EOF) {
+        ungetc(c, f);
+    }
+    return c;
+}
+
+/**
+ * @brief Convert canvas coordinates to screen coordinates
+ * @param y Canvas Y coordinate
+ * @return Screen Y coordinate
+ */
+static inline int canvas_to_screen_y(int y) {
+    return STATUS_LINES_TOP + y;
+}
+
+/**
+ * @brief Convert canvas coordinates to screen coordinates
+ * @param x Canvas X coordinate  
+ * @return Screen X coordinate
+ */
+static inline int canvas_to_screen_x(int x) {
+    return x;
+}
+
+/**
+ * @brief Validate canvas coordinates
+ * @param x X coordinate to validate
+ * @param y Y coordinate to validate
+ * @return true if coordinates are within canvas bounds
+ */
+static bool check_if_coordinates_make_sense(int x, int y) {
+    return (x >= 0 && x < g_app.canvas_width && 
+            y >= 0 && y < g_app.canvas_height);
+}
+
+/**
+ * @brief Show a transient message in place of the bottom tips line
+ * @param fmt printf-style format string
+ * @details The message stays until the next key press.
+ */
+static void set_status_message(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(g_app.status_msg, sizeof(g_app.status_msg), fmt, args);
+    va_end(args);
+}
+
+/*==============================================================================
+ * GLYPHS
+ *============================================================================*/
+
+/**
+ * @brief Check that a value is a Unicode scalar value
+ * @param code Candidate code point
+ * @return true for U+0000-U+10FFFF outside the surrogate range
+ */
+static inline bool glyph_code_valid(uint32_t code) {
+    return code <= 0x10FFFF && (code < 0xD800 || code > 0xDFFF);
+}
+
+/**
+ * @brief Get the code point of a glyph ID
+ * @param glyph Glyph ID
+ * @return Code point; IDs not in the table read as '?'
+ */
+static inline uint32_t glyph_code(GlyphId glyph) {
+    if (glyph < GLYPH_DIRECT) return glyph;
+    int i = glyph - GLYPH_DIRECT;
+    return i < g_app.glyphs.count ? g_app.glyphs.code[i] : '?';
+}
+
+/**
+ * @brief Home slot of a code point in the intern hash
+ * @param code Code point
+ * @param size Slot count (power of two)
+ * @return Slot index
+ */
+static inline size_t glyph_slot(uint32_t code, size_t size) {
+    return (size_t)((code * 0x9E3779B1u) >> 7) & (size - 1);
+}
+
+/**
+ * @brief Double the intern hash and re-insert every glyph
+ * @return false if out of memory (the table is unchanged)
+ */
+static bool glyph_table_grow(void) {
+    GlyphTable *t = &g_app.glyphs;
+    size_t size = t->index_size ? t->index_size * 2 : GLYPH_INDEX_MIN;
+    GlyphId *index = calloc(size, sizeof(GlyphId));
+    uint32_t *code = realloc(t->code, size / 2 * sizeof(uint32_t));
+    if (!index || !code) {
+        free(index);
+        if (code) t->code = code;
+        return false;
+    }
+    
+    for (int i = 0; i < t->count; ++i) {
+        size_t slot = glyph_slot(code[i], size);
+        while (index[slot]) slot = (slot + 1) & (size - 1);
+        index[slot] = (GlyphId)(GLYPH_DIRECT + i);
+    }
+    free(t->index);
+    t->index = index;
+    t->index_size = size;
+    t->code = code;
+    return true;
+}
+
+/**
+ * @brief Get the glyph ID of a code point, adding it to the table if new
+ * @param code Code point
+ * @return Glyph ID; invalid code points, and new ones once all GLYPH_MAX
+ *         IDs are taken, come back as '?'
+ */
+static GlyphId glyph_intern(uint32_t code) {
+    if (code < GLYPH_DIRECT) return (GlyphId)code;
+    if (!glyph_code_valid(code)) return '?';
+    
+    GlyphTable *t = &g_app.glyphs;
+    if (t->index_size) {
+        size_t slot = glyph_slot(code, t->index_size);
+        for (; t->index[slot]; slot = (slot + 1) & (t->index_size - 1)) {
+            if (t->code[t->index[slot] - GLYPH_DIRECT] == code) return t->index[slot];
+        }
+    }
+    
+    if (GLYPH_DIRECT + t->count >= GLYPH_MAX) return '?';
+    if ((size_t)(t->count + 1) * 2 > t->index_size && !glyph_table_grow()) return '?';
+    
+    size_t slot = glyph_slot(code, t->index_size);
+    while (t->index[slot]) slot = (slot + 1) & (t->index_size - 1);
+    t->code[t->count] = code;
+    t->index[slot] = (GlyphId)(GLYPH_DIRECT + t->count);
+    t->count++;
+    return t->index[slot];
+}
+
+/**
+ * @brief Forget every interned glyph
+ * @note Only safe once no cell refers to an interned ID
+ */
+static void glyph_table_free(void) {
+    free(g_app.glyphs.code);
+    free(g_app.glyphs.index);
+    memset(&g_app.glyphs, 0, sizeof(g_app.glyphs));
+}
+
+/**
+ * @brief Encode a code point as UTF-8
+ * @param code Code point (invalid ones encode as '?')
+ * @param out Output, at least UTF8_MAX bytes; not terminated
+ * @return Bytes written
+ */
+static int utf8_encode(uint32_t code, char *out) {
+    if (!glyph_code_valid(code)) code = '?';
+    if (code < 0x80) {
+        out[0] = (char)code;
+        return 1;
+    }
+    if (code < 0x800) {
+        out[0] = (char)(0xC0 | (code >> 6));
+        out[1] = (char)(0x80 | (code & 0x3F));
+        return 2;
+    }
+    if (code < 0x10000) {
+        out[0] = (char)(0xE0 | (code >> 12));
+        out[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (code & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (code >> 18));
+    out[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (code & 0x3F));
+    return 4;
+}
+
+/**
+ * @brief Decode one UTF-8 character
+ * @param p In/out: position in a NUL-terminated string, advanced past the character
+ * @return Code point, or UINT32_MAX for a malformed or overlong sequence
+ */
+static uint32_t utf8_decode(const char **p) {
+    const unsigned char *s = (const unsigned char *)*p;
+    int len = s[0] < 0x80 ? 1 : s[0] < 0xC2 ? 0 : s[0] < 0xE0 ? 2 : s[0] < 0xF0 ? 3 : s[0] < 0xF5 ? 4 : 0;
+    if (len == 0) return UINT32_MAX;
+    
+    static const uint32_t lead_mask[] = { 0, 0x7F, 0x1F, 0x0F, 0x07 };
+    static const uint32_t min_code[] = { 0, 0, 0x80, 0x800, 0x10000 };
+    uint32_t code = s[0] & lead_mask[len];
+    for (int i = 1; i < len; ++i) {
+        if ((s[i] & 0xC0) != 0x80) return UINT32_MAX;
+        code = (code << 6) | (s[i] & 0x3F);
+    }
+    if (code < min_code[len] || !glyph_code_valid(code)) return UINT32_MAX;
+    
+    *p += len;
+    return code;
+}
+
+/*==============================================================================
+ * STYLES
+ *============================================================================*/
+
+/**
+ * @brief Check that a value is a palette index or a flagged RGB color
+ * @param color Candidate color
+ * @return true if valid
+ */
+static inline bool color_spec_valid(ColorSpec color) {
+    return color < PALETTE_SIZE || (color >> 24) == (COLOR_RGB >> 24);
+}
+
+/**
+ * @brief Get the colors of a style ID
+ * @param id Style ID
+ * @return Colors; IDs not in the table read as white on black
+ */
+static inline Style style_of(StyleId id) {
+    if (id < STYLE_DIRECT) return (Style){ id, 0 };
+    int i = id - STYLE_DIRECT;
+    return i < g_app.styles.count ? g_app.styles.style[i] : (Style){ 7, 0 };
+}
+
+/**
+ * @brief Home slot of a style in the intern hash
+ * @param style Colors
+ * @param size Slot count (power of two)
+ * @return Slot index
+ */
+static inline size_t style_slot(Style style, size_t size) {
+    uint64_t key = (uint64_t)style.fg << 32 | style.bg;
+    return (size_t)((key * HASH_MULTIPLIER) >> 40) & (size - 1);
+}
+
+/**
+ * @brief Double the intern hash and re-insert every style
+ * @return false if out of memory (the table is unchanged)
+ */
+static bool style_table_grow(void) {
+    StyleTable *t = &g_app.styles;
+    size_t size = t->index_size ? t->index_size * 2 : STYLE_INDEX_MIN;
+    StyleId *index = calloc(size, sizeof(StyleId));
+    Style *style = realloc(t->style, size / 2 * sizeof(Style));
+    if (!index || !style) {
+        free(index);
+        if (style) t->style = style;
+        return false;
+    }
+    
+    for (int i = 0; i < t->count; ++i) {
+        size_t slot = style_slot(style[i], size);
+        while (index[slot]) slot = (slot + 1) & (size - 1);
+        index[slot] = (StyleId)(STYLE_DIRECT + i);
+    }
+    free(t->index);
+    t->index = index;
+    t->index_size = size;
+    t->style = style;
+    return true;
+}
+
+/**
+ * @brief Get the style ID of a color combination, adding it to the table if new
+ * @param style Colors (both valid ColorSpecs)
+ * @return Style ID; a base color on black is its own ID. New styles once
+ *         all STYLE_MAX IDs are taken come back as the nearest base color.
+ */
+static StyleId style_intern(Style style) {
+    if (style.bg == 0 && style.fg < COLOR_COUNT) return (StyleId)style.fg;
+    
+    StyleTable *t = &g_app.styles;
+    if (t->index_size) {
+        size_t slot = style_slot(style, t->index_size);
+        for (; t->index[slot]; slot = (slot + 1) & (t->index_size - 1)) {
+            Style *found = &t->style[t->index[slot] - STYLE_DIRECT];
+            if (found->fg == style.fg && found->bg == style.bg) return t->index[slot];
+        }
+    }
+    
+    if (STYLE_DIRECT + t->count >= STYLE_MAX ||
+        ((size_t)(t->count + 1) * 2 > t->index_size && !style_table_grow())) {
+        unsigned char rgb[3];
+        palette_rgb(style.fg, rgb);
+        return (StyleId)nearest_palette(rgb, COLOR_COUNT);
+    }
+    
+    size_t slot = style_slot(style, t->index_size);
+    while (t->index[slot]) slot = (slot + 1) & (t->index_size - 1);
+    t->style[t->count] = style;
+    t->index[slot] = (StyleId)(STYLE_DIRECT + t->count);
+    t->count++;
+    return t->index[slot];
+}
+
+/**
+ * @brief Forget every interned style
+ * @note Only safe once no cell refers to an interned ID. Pairs bound to
+ *       the old IDs are released too.
+ */
+static void style_table_free(void) {
+    free(g_app.styles.style);
+    free(g_app.styles.index);
+    memset(&g_app.styles, 0, sizeof(g_app.styles));
+    pair_cache_forget();
+}
+
+/**
+ * @brief Get the RGB value of a color
+ * @param color Palette index or RGB color
+ * @param rgb Out: red, green and blue
+ * @details Palette entries follow xterm: 16 ANSI colors, a 6x6x6 cube and
+ * a 24-step gray ramp.
+ */
+static void palette_rgb(ColorSpec color, unsigned char rgb[3]) {
+    if (color & COLOR_RGB) {
+        rgb[0] = (unsigned char)(color >> 16);
+        rgb[1] = (unsigned char)(color >> 8);
+        rgb[2] = (unsigned char)color;
+    } else if (color < ANSI_COLOR_COUNT) {
+        memcpy(rgb, export_rgb[color], 3);
+    } else if (color < 232) {
+        unsigned i = color - 16;
+        rgb[0] = cube_levels[i / 36];
+        rgb[1] = cube_levels[i / 6 % 6];
+        rgb[2] = cube_levels[i % 6];
+    } else {
+        rgb[0] = rgb[1] = rgb[2] = (unsigned char)(8 + 10 * (color - 232));
+    }
+}
+
+/**
+ * @brief Find the palette entry closest to an RGB value
+ * @param rgb Red, green and blue
+ * @param entries Palette entries to consider: COLOR_COUNT, ANSI_COLOR_COUNT or PALETTE_SIZE
+ * @return Palette index
+ * @details The full palette is searched through the cube and the gray ramp
+ * arithmetically, so the cost does not depend on the palette size.
+ */
+static int nearest_palette(const unsigned char rgb[3], int entries) {
+    int best = 0;
+    long best_dist = LONG_MAX;
+    
+    int ansi = entries < ANSI_COLOR_COUNT ? entries : ANSI_COLOR_COUNT;
+    for (int i = 0; i < ansi; ++i) {
+        long dist = 0;
+        for (int c = 0; c < 3; ++c) {
+            long d = (long)rgb[c] - export_rgb[i][c];
+            dist += d * d;
+        }
+        if (dist < best_dist) {
+            best = i;
+            best_dist = dist;
+        }
+    }
+    if (entries < PALETTE_SIZE) return best;
+    
+    // Nearest cube level per channel, and the nearest gray step
+    int level[3];
+    for (int c = 0; c < 3; ++c) {
+        level[c] = rgb[c] < 48 ? 0 : rgb[c] < 115 ? 1 : (rgb[c] - 35) / 40;
+    }
+    int average = (rgb[0] + rgb[1] + rgb[2]) / 3;
+    int gray = average < 8 ? 0 : average > 238 ? 23 : (average - 3) / 10;
+    int candidates[2] = { 16 + 36 * level[0] + 6 * level[1] + level[2], 232 + gray };
+    
+    for (int i = 0; i < 2; ++i) {
+        unsigned char entry[3];
+        palette_rgb((ColorSpec)candidates[i], entry);
+        long dist = 0;
+        for (int c = 0; c < 3; ++c) {
+            long d = (long)rgb[c] - entry[c];
+            dist += d * d;
+        }
+        if (dist < best_dist) {
+            best = candidates[i];
+            best_dist = dist;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Parse one color: a base color name, a palette index 0-255 or #rrggbb
+ * @param p In/out: position in a string, advanced past the color
+ * @param color Out: color
+ * @return true if a color was parsed
+ */
+static bool color_spec_parse(const char **p, ColorSpec *color) {
+    const char *s = *p;
+    
+    if (*s == '#') {
+        unsigned value = 0;
+        int digits = 0;
+        for (++s; digits < 6; ++digits, ++s) {
+            int c = *s;
+            int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                    c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            if (v < 0) return false;
+            value = value << 4 | (unsigned)v;
+        }
+        *color = COLOR_RGB | value;
+    } else if (*s >= '0' && *s <= '9') {
+        unsigned value = 0;
+        for (int digits = 0; *s >= '0' && *s <= '9'; ++digits, ++s) {
+            if (digits == 3) return false;
+            value = value * 10 + (unsigned)(*s - '0');
+        }
+        if (value >= PALETTE_SIZE) return false;
+        *color = value;
+    } else {
+        for (int i = 0; ; ++i) {
+            if (i == COLOR_COUNT) return false;
+            size_t len = strlen(color_names[i]);
+            if (strncasecmp(s, color_names[i], len) == 0 &&
+                !((s[len] >= 'a' && s[len] <= 'z') || (s[len] >= 'A' && s[len] <= 'Z'))) {
+                *color = (ColorSpec)i;
+                s += len;
+                break;
+            }
+        }
+    }
+    
+    *p = s;
+    return true;
+}
+
+/**
+ * @brief Parse a style: FOREGROUND[/BACKGROUND], each as color_spec_parse() reads it
+ * @param p In/out: position in a string, advanced past the style
+ * @param id Out: interned style ID
+ * @return true if a style was parsed
+ * @details A lone index 0-7 is the base color of that index, so the color
+ * field of old text files parses unchanged.
+ */
+static bool style_parse(const char **p, StyleId *id) {
+    const char *s = *p;
+    Style style = { 0, 0 };
+    
+    if (!color_spec_parse(&s, &style.fg)) return false;
+    if (*s == '/') {
+        ++s;
+        if (!color_spec_parse(&s, &style.bg)) return false;
+    }
+    
+    *id = style_intern(style);
+    *p = s;
+    return true;
+}
+
+/**
+ * @brief Format one color as color_spec_parse() reads it
+ * @param color Color
+ * @param out Output buffer
+ * @param size Size of out
+ * @return Characters written, as snprintf()
+ */
+static int color_spec_format(ColorSpec color, char *out, size_t size) {
+    if (color & COLOR_RGB) return snprintf(out, size, "#%06x", (unsigned)(color & 0xFFFFFF));
+    return snprintf(out, size, "%u", (unsigned)color);
+}
+
+/**
+ * @brief Format a style as style_parse() reads it
+ * @param id Style ID
+ * @param out Output buffer, STYLE_TEXT_SIZE bytes
+ * @return Characters written
+ * @details The background is left out when it is the default (black), so
+ * base colors format as their index, as in old text files.
+ */
+static int style_format(StyleId id, char *out) {
+    Style style = style_of(id);
+    int n = color_spec_format(style.fg, out, STYLE_TEXT_SIZE);
+    if (style.bg != 0) {
+        out[n++] = '/';
+        n += color_spec_format(style.bg, out + n, STYLE_TEXT_SIZE - (size_t)n);
+    }
+    return n;
+}
+
+/*==============================================================================
+ * CANVAS OPERATIONS
+ *============================================================================*/
+
+/**
+ * @brief Build a cell value
+ * @param glyph Glyph ID (a Latin-1 character, or from glyph_intern())
+ * @param color Style ID (a base color, or from style_intern())
+ * @return Cell
+ */
+static inline Cell make_cell(GlyphId glyph, StyleId color) {
+    Cell cell = { glyph, color };
+    return cell;
+}
+
+/**
+ * @brief Reinterpret a cell as one 32-bit word for whole-cell comparisons
+ * @param cell Cell value
+ * @return Cell bits
+ */
+static inline uint32_t cell_bits(Cell cell) {
+    uint32_t bits;
+    memcpy(&bits, &cell, sizeof(bits));
+    return bits;
+}
+
+/**
+ * @brief Check whether a cell counts as blank for the occupancy index
+ * @param cell Cell to test
+ * @return true for space and NUL cells
+ */
+static inline bool cell_is_blank(const Cell *cell) {
+    return cell->glyph == ' ' || cell->glyph == '\0';
+}
+
+/**
+ * @brief Get a row of a buffer's cell storage
+ * @param buf Buffer
+ * @param y Row index (must be valid)
+ * @return First cell of the row
+ */
+static inline Cell* buffer_row(const CellBuffer *buf, int y) {
+    return &buf->cells[(size_t)y * (size_t)buf->stride];
+}
+
+/**
+ * @brief Note a write to a buffer row for saving and the document index
+ * @param buf Buffer
+ * @param y Row index
+ */
+static inline void buffer_touch(CellBuffer *buf, int y) {
+    if (buf->row_edit) buf->row_edit[y] = ++g_app.save.edits;
+    if (!buf->mapped) return;
+    if (y < buf->touched_top) buf->touched_top = y;
+    if (y > buf->touched_bottom) buf->touched_bottom = y;
+}
+
+/**
+ * @brief Allocate an empty cell buffer the size of the canvas
+ * @param buf Buffer to initialize
+ * @param width Width in cells
+ * @param height Height in cells
+ * @return true on success; on failure the buffer holds no memory
+ */
+static bool buffer_init(CellBuffer *buf, int width, int height) {
+    buf->cells = malloc((size_t)width * (size_t)height * sizeof(Cell));
+    buf->row_gen = calloc((size_t)height, sizeof(unsigned));
+    buf->rows = malloc((size_t)height * sizeof(RowSpan));
+    
+    if (!buf->cells || !buf->row_gen || !buf->rows) {
+        free(buf->cells);
+        free(buf->row_gen);
+        free(buf->rows);
+        memset(buf, 0, sizeof(*buf));
+        return false;
+    }
+    
+    // All rows start stale (stamp 0), so the buffer reads as empty/white
+    buf->stride = width;
+    buf->mapped = false;
+    buf->row_edit = NULL;
+    buf->gen = 1;
+    buf->blank = make_cell(' ', 7);  // Default to white
+    return true;
+}
+
+/**
+ * @brief Free a cell buffer
+ * @param buf Buffer initialized by buffer_init() (or zeroed)
+ */
+static void buffer_free(CellBuffer *buf) {
+    if (!buf->mapped) free(buf->cells);
+    free(buf->row_edit);
+    free(buf->row_gen);
+    free(buf->rows);
+    memset(buf, 0, sizeof(*buf));
+}
+
+/**
+ * @brief Blank a cell buffer in O(1)
+ * @param buf Buffer to clear
+ * @param blank Cell value every row reads as from now on
+ * @details Bumps the generation so every row becomes stale. Mapped buffers
+ * blank their occupied spans instead.
+ */
+static void buffer_clear(CellBuffer *buf, Cell blank) {
+    buf->blank = blank;
+    if (buf->row_edit) g_app.save.clear_edit = ++g_app.save.edits;
+    bool tally = buf == g_app.minimap.source;
+    
+    // Mapped rows are the document itself, so they are blanked for real
+    if (buf->mapped) {
+        for (int y = 0; y < g_app.canvas_height; ++y) {
+            RowSpan *span = &buf->rows[y];
+            Cell *row = buffer_row(buf, y);
+            for (int x = span->first; span->count > 0 && x <= span->last; ++x) {
+                if (tally && !cell_is_blank(&row[x])) minimap_count(x, y, -1);
+                row[x] = blank;
+            }
+            if (span->count > 0) buffer_touch(buf, y);
+            *span = (RowSpan){ -1, -1, 0 };
+        }
+        return;
+    }
+    
+    if (tally) minimap_clear();
+    
+    // On wraparound old stamps could collide with the new generation
+    if (++buf->gen == 0) {
+        memset(buf->row_gen, 0, (size_t)g_app.canvas_height * sizeof(unsigned));
+        buf->gen = 1;
+    }
+}
+
+/**
+ * @brief Materialize a row left stale by a lazy clear
+ * @param buf Buffer
+ * @param y Row index (must be valid)
+ * @details Rows stamped with an older generation are logically blank; the
+ * blank cells are only written out here, the first time the row is modified.
+ */
+static void buffer_freshen_row(CellBuffer *buf, int y) {
+    if (buf->row_gen[y] == buf->gen) return;
+    
+    Cell *row = buffer_row(buf, y);
+    for (int x = 0; x < g_app.canvas_width; ++x) {
+        row[x] = buf->blank;
+    }
+    buf->row_gen[y] = buf->gen;
+    buf->rows[y] = (RowSpan){ -1, -1, 0 };
+}
+
+/**
+ * @brief Read a cell of a buffer
+ * @param buf Buffer
+ * @param x X coordinate (must be valid)
+ * @param y Y coordinate (must be valid)
+ * @return Pointer to the cell, or to the buffer's blank cell for stale rows
+ */
+static inline const Cell* buffer_peek(const CellBuffer *buf, int x, int y) {
+    if (buf->row_gen[y] != buf->gen) {
+        return &buf->blank;
+    }
+    return &buffer_row(buf, y)[x];
+}
+
+/**
+ * @brief Get the occupancy summary of a buffer row
+ * @param buf Buffer
+ * @param y Row index (must be valid)
+ * @return Row span; stale rows report as empty
+ */
+static inline RowSpan buffer_occupancy(const CellBuffer *buf, int y) {
+    if (buf->row_gen[y] != buf->gen) {
+        return (RowSpan){ -1, -1, 0 };
+    }
+    return buf->rows[y];
+}
+
+/**
+ * @brief Write a cell and keep the row occupancy index up to date
+ * @param buf Buffer
+ * @param x X coordinate (must be valid)
+ * @param y Y coordinate (must be valid)
+ * @param value New cell contents (blank cells are stored as buf->blank)
+ * @return true if the stored cell actually changed
+ * 
+ * @details
+ * Count and bounds are adjusted in O(1); only erasing the first or last
+ * non-blank cell rescans toward the interior for the new bound.
+ */
+static bool buffer_put(CellBuffer *buf, int x, int y, Cell value) {
+    buffer_freshen_row(buf, y);
+    Cell *row = buffer_row(buf, y);
+    Cell *cell = &row[x];
+    
+    if (cell_is_blank(&value)) {
+        value = buf->blank;
+    }
+    if (cell_bits(*cell) == cell_bits(value)) {
+        return false;
+    }
+    
+    bool was_used = !cell_is_blank(cell);
+    bool now_used = !cell_is_blank(&value);
+    *cell = value;
+    buffer_touch(buf, y);
+    if (was_used != now_used && buf == g_app.minimap.source) {
+        minimap_count(x, y, now_used ? 1 : -1);
+    }
+    
+    RowSpan *span = &buf->rows[y];
+    if (now_used && !was_used) {
+        if (span->count++ == 0) {
+            span->first = span->last = x;
+        } else {
+            if (x < span->first) span->first = x;
+            if (x > span->last) span->last = x;
+        }
+    } else if (was_used && !now_used) {
+        if (--span->count == 0) {
+            span->first = span->last = -1;
+        } else if (x == span->first) {
+            while (cell_is_blank(&row[span->first])) span->first++;
+        } else if (x == span->last) {
+            while (cell_is_blank(&row[span->last])) span->last--;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Get a read-only pointer to a composited canvas cell
+ * @param x X coordinate
+ * @param y Y coordinate
+ * @return Pointer to Cell (the shared blank cell for stale rows) or NULL
+ *         if coordinates are invalid
+ */
+static const Cell* peek_spot(int x, int y) {
+    if (!check_if_coordinates_make_sense(x, y)) {
+        return NULL;
+    }
+    return buffer_peek(&g_app.canvas, x, y);
+}
+
+/**
+ * @brief Get the occupancy summary of a composited canvas row
+ * @param y Row index (must be valid)
+ * @return Row span; stale rows report as empty
+ */
+static RowSpan row_occupancy(int y) {
+    return buffer_occupancy(&g_app.canvas, y);
+}
+
+/**
+ * @brief Get the layer that edits apply to
+ * @return Active layer
+ */
+static inline Layer* active_layer(void) {
+    return &g_app.layers[g_app.active_layer];
+}
+
+/**
+ * @brief Check that the active layer accepts edits
+ * @return true if unlocked; otherwise reports the lock in the status bar
+ */
+static bool active_layer_writable(void) {
+    if (!active_layer()->locked) return true;
+    
+    set_status_message("Layer %d is locked (K to unlock)", g_app.active_layer + 1);
+    return false;
+}
+
+/**
+ * @brief Compute the composited value of one cell
+ * @param x X coordinate (must be valid)
+ * @param y Y coordinate (must be valid)
+ * @return Topmost non-blank cell among visible layers, or the canvas blank
+ */
+static Cell composite_at(int x, int y) {
+    for (int i = g_app.layer_count - 1; i >= 0; --i) {
+        const Layer *layer = &g_app.layers[i];
+        if (!layer->visible) continue;
+        
+        const Cell *cell = buffer_peek(&layer->buf, x, y);
+        if (!cell_is_blank(cell)) return *cell;
+    }
+    return g_app.canvas.blank;
+}
+
+/**
+ * @brief Write a cell to the active layer and update the composite
+ * @param x X coordinate
+ * @param y Y coordinate
+ * @param value New cell contents
+ * @return true if the composited (visible) cell changed
+ * @note All canvas edits go through here; locked layers are never modified
+ */
+static bool put_cell(int x, int y, Cell value) {
+    if (!check_if_coordinates_make_sense(x, y)) return false;
+    
+    Layer *layer = active_layer();
+    if (layer->locked || !buffer_put(&layer->buf, x, y, value)) {
+        return false;
+    }
+    return buffer_put(&g_app.canvas, x, y, composite_at(x, y));
+}
+
+/**
+ * @brief Recomposite part of a row and mark the cells that changed dirty
+ * @param y Row index
+ * @param x0 First column
+ * @param x1 Last column (inclusive)
+ * 
+ * @details
+ * Visible layers are laid bottom-up into a scratch row. Within each layer
+ * only its occupied span is scanned, and runs of blank cells are skipped
+ * several cells per compare by the skip_equal_cells kernel.
+ */
+static void recomposite_span(int y, int x0, int x1) {
+    Cell *out = g_app.scratch_row;
+    for (int x = x0; x <= x1; ++x) {
+        out[x] = g_app.canvas.blank;
+    }
+    
+    for (int i = 0; i < g_app.layer_count; ++i) {
+        const Layer *layer = &g_app.layers[i];
+        RowSpan span = buffer_occupancy(&layer->buf, y);
+        if (!layer->visible || span.count == 0) continue;
+        
+        int from = (span.first > x0) ? span.first : x0;
+        int to = (span.last < x1) ? span.last : x1;
+        const Cell *row = buffer_row(&layer->buf, y);
+        uint32_t blank = cell_bits(layer->buf.blank);
+        
+        for (int x = from; x <= to; ++x) {
+            x += (int)simd.skip_equal_cells(row + x, (size_t)(to - x + 1), blank);
+            if (x > to) break;
+            out[x] = row[x];
+        }
+    }
+    
+    int changed_first = -1, changed_last = -1;
+    for (int x = x0; x <= x1; ++x) {
+        if (buffer_put(&g_app.canvas, x, y, out[x])) {
+            if (changed_first < 0) changed_first = x;
+            changed_last = x;
+        }
+    }
+    if (changed_first >= 0) {
+        mark_dirty(changed_first, y, changed_last, y);
+    }
+}
+
+/**
+ * @brief Recomposite a set of dirty row spans
+ * @param spans One span per canvas row; rows with count 0 are skipped
+ */
+static void recomposite_rows(const RowSpan *spans) {
+    for (int y = 0; y < g_app.canvas_height; ++y) {
+        if (spans[y].count > 0) {
+            recomposite_span(y, spans[y].first, spans[y].last);
+        }
+    }
+}
+
+/**
+ * @brief Record a layer's occupied spans as the dirty region
+ * @param layer Layer about to change visibility or content
+ * @return g_app.scratch_spans, filled with one span per row
+ */
+static RowSpan* layer_dirty_spans(const Layer *layer) {
+    for (int y = 0; y < g_app.canvas_height; ++y) {
+        g_app.scratch_spans[y] = buffer_occupancy(&layer->buf, y);
+    }
+    return g_app.scratch_spans;
+}
+
+/**
+ * @brief Check whether any layer other than the active one is visible
+ * @return true if compositing can involve more than the active layer
+ */
+static bool other_layers_visible(void) {
+    for (int i = 0; i < g_app.layer_count; ++i) {
+        if (i != g_app.active_layer && g_app.layers[i].visible) return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Add an empty layer above the active one and make it active
+ */
+static void add_layer(void) {
+    if (g_app.layer_count == MAX_LAYERS) {
+        set_status_message("Layer limit reached (%d)", MAX_LAYERS);
+        return;
+    }
+    
+    Layer fresh = { .visible = true, .locked = false };
+    if (!buffer_init(&fresh.buf, g_app.canvas_width, g_app.canvas_height)) {
+        set_status_message("Out of memory for a new layer");
+        return;
+    }
+    
+    int at = g_app.active_layer + 1;
+    memmove(&g_app.layers[at + 1], &g_app.layers[at],
+            (size_t)(g_app.layer_count - at) * sizeof(Layer));
+    g_app.layers[at] = fresh;
+    g_app.layer_count++;
+    g_app.active_layer = at;
+}
+
+/**
+ * @brief Show or hide the active layer
+ * @details Only the layer's occupied spans are recomposited and redrawn.
+ */
+static void toggle_layer_visibility(void) {
+    Layer *layer = active_layer();
+    RowSpan *dirty = layer_dirty_spans(layer);
+    
+    layer->visible = !layer->visible;
+    recomposite_rows(dirty);
+}
+
+/**
+ * @brief Paint the current brush at the cursor position
+ * @details With symmetry on, the brush is also applied at every mirrored
+ * or rotated position; all copies add to the same dirty set, so the frame
+ * draws them together.
+ */
+static void paint_stuff(void) {
+    if (!active_layer_writable()) return;
+    
+    bool dots = g_app.subcell.mode != SUBCELL_OFF;
+    int px[SYMMETRY_MAX], py[SYMMETRY_MAX];
+    int count = symmetry_points(dots ? g_app.subcell.dot_x : g_app.cursor_x,
+                                dots ? g_app.subcell.dot_y : g_app.cursor_y, px, py);
+    Cell value = make_cell(glyph_intern(brush_chars[g_app.brush_index]),
+                           g_app.current_color);
+    
+    for (int i = 0; i < count; ++i) {
+        if (dots) {
+            subcell_paint(px[i], py[i]);
+        } else {
+            apply_brush(px[i], py[i], value);
+        }
+    }
+}
+
+/**
+ * @brief Fill the active layer with spaces
+ * @details O(1) when no other layer is visible: the layer and the composite
+ * both bump their generation and the canvas area of the screen is wiped in
+ * one call. Otherwise only the cleared layer's former spans are
+ * recomposited.
+ */
+static void start_with_blank_canvas(void) {
+    if (!active_layer_writable()) return;
+    
+    Layer *layer = active_layer();
+    Cell blank = make_cell(' ', g_app.current_color);
+    
+    if (!other_layers_visible()) {
+        buffer_clear(&layer->buf, blank);
+        buffer_clear(&g_app.canvas, blank);
+        erase_canvas_area();
+        return;
+    }
+    
+    RowSpan *dirty = layer_dirty_spans(layer);
+    buffer_clear(&layer->buf, blank);
+    if (layer->visible) {
+        recomposite_rows(dirty);
+    }
+}
+
+/**
+ * @brief Move cursor with boundary checking and optional auto-paint
+ * @param dx X movement delta
+ * @param dy Y movement delta
+ * @note Paints only at the destination; move_cursor_steps() paints the path
+ */
+static void move_brush(int dx, int dy) {
+    if (g_app.subcell.mode != SUBCELL_OFF) {
+        subcell_move(dx, dy);
+        return;
+    }
+    
+    int new_x = g_app.cursor_x + dx;
+    int new_y = g_app.cursor_y + dy;
+    
+    // Past the edge of a document viewport, scroll by half a screen
+    if (g_app.document.map &&
+        (new_x < 0 || new_x >= g_app.canvas_width || new_y < 0 || new_y >= g_app.canvas_height)) {
+        int moved_x, moved_y;
+        document_scroll(new_x < 0 ? -g_app.canvas_width / 2 :
+                        new_x >= g_app.canvas_width ? g_app.canvas_width / 2 : 0,
+                        new_y < 0 ? -g_app.canvas_height / 2 :
+                        new_y >= g_app.canvas_height ? g_app.canvas_height / 2 : 0,
+                        &moved_x, &moved_y);
+        new_x -= moved_x;
+        new_y -= moved_y;
+    }
+    
+    // Clamp to canvas boundaries
+    if (new_x < 0) new_x = 0;
+    if (new_x >= g_app.canvas_width) new_x = g_app.canvas_width - 1;
+    if (new_y < 0) new_y = 0;
+    if (new_y >= g_app.canvas_height) new_y = g_app.canvas_height - 1;
+    
+    // Only update if position actually changed
+    if (new_x != g_app.cursor_x || new_y != g_app.cursor_y) {
+        g_app.cursor_x = new_x;
+        g_app.cursor_y = new_y;
+        
+        // Auto-paint if pen is down
+        if (g_app.pen_down) {
+            paint_stuff();
+        }
+    }
+}
+
+/*==============================================================================
+ * BRUSHES
+ *============================================================================*/
+
+/**
+ * @brief Seed a generator
+ * @param rng Generator
+ * @param seed Any value; splitmix64 spreads it over the 256-bit state
+ */
+static void random_seed(Random *rng, uint64_t seed) {
+    for (int i = 0; i < 4; ++i) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        rng->s[i] = z ^ (z >> 31);
+    }
+}
+
+/**
+ * @brief Next 64 random bits (xoshiro256**)
+ * @param rng Generator
+ * @return Random word
+ */
+static inline uint64_t random_next(Random *rng) {
+    uint64_t *s = rng->s;
+    uint64_t x = s[1] * 5;
+    uint64_t result = ((x << 7) | (x >> 57)) * 9;
+    uint64_t t = s[1] << 17;
+    
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+    return result;
+}
+
+/**
+ * @brief Pick the cells of a run that one spray application paints
+ * @param n Cells in the run (at most 64)
+ * @return Bit i set if cell i is painted
+ * @details Each random word is eight bytes, one per cell, compared with the
+ * density scaled to 0-256, so a 32-cell span costs four draws.
+ */
+static uint64_t spray_hits(int n) {
+    unsigned threshold = (unsigned)(g_app.brush.density * 256 / 100);
+    uint64_t hits = 0;
+    
+    for (int i = 0; i < n; i += 8) {
+        uint64_t r = random_next(&g_app.rng);
+        for (int k = 0; k < 8 && i + k < n; ++k) {
+            if ((unsigned)(r >> (8 * k) & 0xFF) < threshold) hits |= 1ull << (i + k);
+        }
+    }
+    return hits;
+}
+
+/**
+ * @brief Take the lowest run of set bits from a spray_hits() mask
+ * @param hits In/out: remaining hits, the run is removed
+ * @param first Out: index of the run's first cell
+ * @param len Out: run length
+ * @return false when no hits remain
+ */
+static bool spray_next_run(uint64_t *hits, int *first, int *len) {
+    if (*hits == 0) return false;
+    
+    *first = __builtin_ctzll(*hits);
+    uint64_t rest = ~(*hits >> *first);
+    *len = rest ? __builtin_ctzll(rest) : 64 - *first;
+    *hits &= (*len + *first < 64) ? ~0ull << (*first + *len) : 0;
+    return true;
+}
+
+/**
+ * @brief Write a horizontal run of cells with one occupancy update
+ * @param buf Buffer
+ * @param y Row (must be valid)
+ * @param x0 First column (span must lie inside the canvas)
+ * @param n Number of cells
+ * @param src Source cells, or a single cell when fill is true
+ * @param fill Repeat src[0] across the span instead of copying
+ * 
+ * @details
+ * The row is materialized once and the bounds are adjusted once for the
+ * whole span, so fills reduce to a tight store loop with no per-cell
+ * lookups.
+ */
+static void buffer_write_span(CellBuffer *buf, int y, int x0, int n,
+                              const Cell *src, bool fill) {
+    buffer_freshen_row(buf, y);
+    buffer_touch(buf, y);
+    Cell *row = buffer_row(buf, y);
+    RowSpan *span = &buf->rows[y];
+    int first_new = -1, last_new = -1;
+    int delta = 0;
+    bool tally = buf == g_app.minimap.source;
+    
+    if (fill) {
+        Cell value = cell_is_blank(&src[0]) ? buf->blank : src[0];
+        bool used = !cell_is_blank(&value);
+        
+        for (int x = x0; x < x0 + n; ++x) {
+            bool was_used = !cell_is_blank(&row[x]);
+            delta += (used ? 1 : 0) - (was_used ? 1 : 0);
+            if (tally && used != was_used) minimap_count(x, y, used ? 1 : -1);
+        }
+        for (int x = x0; x < x0 + n; ++x) {
+            row[x] = value;
+        }
+        if (used) {
+            first_new = x0;
+            last_new = x0 + n - 1;
+        }
+    } else {
+        for (int i = 0; i < n; ++i) {
+            Cell value = cell_is_blank(&src[i]) ? buf->blank : src[i];
+            bool used = !cell_is_blank(&value);
+            bool was_used = !cell_is_blank(&row[x0 + i]);
+            
+            delta += (used ? 1 : 0) - (was_used ? 1 : 0);
+            if (tally && used != was_used) minimap_count(x0 + i, y, used ? 1 : -1);
+            row[x0 + i] = value;
+            if (used) {
+                if (first_new < 0) first_new = x0 + i;
+                last_new = x0 + i;
+            }
+        }
+    }
+    
+    span->count += delta;
+    if (span->count == 0) {
+        span->first = span->last = -1;
+        return;
+    }
+    if (first_new >= 0) {
+        if (span->first < 0 || first_new < span->first) span->first = first_new;
+        if (last_new > span->last) span->last = last_new;
+    }
+    // Erased cells may have been the bounds; rescan toward the interior
+    while (cell_is_blank(&row[span->first])) span->first++;
+    while (cell_is_blank(&row[span->last])) span->last--;
+}
+
+/**
+ * @brief Rebuild the precomputed row-span mask for a solid brush
+ * @details Square brushes cover the full box; round and spray brushes keep
+ * the cells whose centers fall inside the inscribed circle. Stamp masks are
+ * built by load_stamp_brush() instead.
+ */
+static void rebuild_brush_mask(void) {
+    BrushMask *mask = &g_app.brush;
+    if (mask->shape == BRUSH_SHAPE_STAMP) return;
+    
+    int size = mask->size;
+    
+    mask->width = mask->height = size;
+    mask->span_count = 0;
+    for (int dy = 0; dy < size; ++dy) {
+        int x0 = 0, x1 = size - 1;
+        
+        if (mask->shape != BRUSH_SHAPE_SQUARE) {
+            // Doubled coordinates keep cell centers integral
+            int oy = 2 * dy + 1 - size;
+            while (x0 <= x1) {
+                int ox = 2 * x0 + 1 - size;
+                if (ox * ox + oy * oy <= size * size) break;
+                ++x0;
+            }
+            x1 = size - 1 - x0;
+            if (x0 > x1) continue;
+        }
+        mask->spans[mask->span_count++] = (BrushSpan){ dy, x0, x1 - x0 + 1, 0 };
+    }
+}
+
+/**
+ * @brief Load a stamp brush from a saved canvas file
+ * @param filename Canvas file (NULL uses DEFAULT_STAMP_FILE)
+ * @return true on success
+ * 
+ * @details
+ * The stamp is trimmed to the bounding box of its non-blank cells, and
+ * each row is reduced to its runs of non-blank cells so blanks in the
+ * stamp stay transparent.
+ */
+static bool load_stamp_brush(const char *filename) {
+    if (!filename) filename = DEFAULT_STAMP_FILE;
+    
+    int w = 0, h = 0;
+    Cell *cells = read_canvas_file(filename, &w, &h);
+    if (!cells) return false;
+    
+    // Bounding box of the non-blank cells
+    int left = w, right = -1, top = h, bottom = -1;
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            if (cell_is_blank(&cells[y * w + x])) continue;
+            if (x < left) left = x;
+            if (x > right) right = x;
+            if (y < top) top = y;
+            if (y > bottom) bottom = y;
+        }
+    }
+    if (right < 0) {
+        free(cells);
+        return false;
+    }
+    
+    int bw = right - left + 1, bh = bottom - top + 1;
+    Cell *stamp = malloc((size_t)bw * (size_t)bh * sizeof(Cell));
+    BrushSpan *spans = malloc((size_t)bh * (size_t)((bw + 1) / 2) * sizeof(BrushSpan));
+    if (!stamp || !spans) {
+        free(stamp);
+        free(spans);
+        free(cells);
+        return false;
+    }
+    
+    int count = 0;
+    for (int dy = 0; dy < bh; ++dy) {
+        const Cell *row = &cells[(top + dy) * w + left];
+        memcpy(&stamp[dy * bw], row, (size_t)bw * sizeof(Cell));
+        
+        for (int dx = 0; dx < bw; ) {
+            if (cell_is_blank(&row[dx])) { ++dx; continue; }
+            int start = dx;
+            while (dx < bw && !cell_is_blank(&row[dx])) ++dx;
+            spans[count++] = (BrushSpan){ dy, start, dx - start, dy * bw + start };
+        }
+    }
+    free(cells);
+    
+    BrushMask *mask = &g_app.brush;
+    free(mask->stamp);
+    if (mask->spans != mask->solid_spans) free(mask->spans);
+    mask->stamp = stamp;
+    mask->spans = spans;
+    mask->span_count = count;
+    mask->width = bw;
+    mask->height = bh;
+    mask->shape = BRUSH_SHAPE_STAMP;
+    return true;
+}
+
+/**
+ * @brief Switch the brush to a solid shape, dropping any loaded stamp
+ * @param shape BRUSH_SHAPE_SQUARE, BRUSH_SHAPE_ROUND or BRUSH_SHAPE_SPRAY
+ */
+static void set_brush_shape(int shape) {
+    BrushMask *mask = &g_app.brush;
+    
+    if (mask->shape == BRUSH_SHAPE_STAMP) {
+        free(mask->stamp);
+        free(mask->spans);
+        mask->stamp = NULL;
+        mask->spans = mask->solid_spans;
+    }
+    mask->shape = shape;
+    rebuild_brush_mask();
+}
+
+/**
+ * @brief Change the solid brush size
+ * @param delta Size change in cells (clamped to 1-BRUSH_SIZE_MAX)
+ */
+static void resize_brush(int delta) {
+    BrushMask *mask = &g_app.brush;
+    
+    mask->size += delta;
+    if (mask->size < 1) mask->size = 1;
+    if (mask->size > BRUSH_SIZE_MAX) mask->size = BRUSH_SIZE_MAX;
+    rebuild_brush_mask();
+}
+
+/**
+ * @brief Stamp the brush mask onto the active layer
+ * @param cx Canvas X of the brush center
+ * @param cy Canvas Y of the brush center
+ * @param value Cell for solid brushes (stamps carry their own cells)
+ * 
+ * @details
+ * Each precomputed span is clipped to the canvas and written with
+ * buffer_write_span(), then recomposited. A spray writes only the runs of
+ * the span that spray_hits() picks. The whole application marks one dirty
+ * rectangle for the renderer.
+ */
+static void apply_brush(int cx, int cy, Cell value) {
+    const BrushMask *mask = &g_app.brush;
+    Layer *layer = active_layer();
+    int left = cx - (mask->width - 1) / 2;
+    int top = cy - (mask->height - 1) / 2;
+    
+    for (int i = 0; i < mask->span_count; ++i) {
+        const BrushSpan *span = &mask->spans[i];
+        int y = top + span->dy;
+        int x0 = left + span->dx;
+        int x1 = x0 + span->len - 1;
+        if (y < 0 || y >= g_app.canvas_height) continue;
+        
+        int skip = (x0 < 0) ? -x0 : 0;
+        if (x0 < 0) x0 = 0;
+        if (x1 >= g_app.canvas_width) x1 = g_app.canvas_width - 1;
+        if (x0 > x1) continue;
+        
+        if (mask->stamp) {
+            buffer_write_span(&layer->buf, y, x0, x1 - x0 + 1,
+                              &mask->stamp[span->src + skip], false);
+        } else if (mask->shape == BRUSH_SHAPE_SPRAY) {
+            uint64_t hits = spray_hits(x1 - x0 + 1);
+            int first, len;
+            while (spray_next_run(&hits, &first, &len)) {
+                buffer_write_span(&layer->buf, y, x0 + first, len, &value, true);
+            }
+        } else {
+            buffer_write_span(&layer->buf, y, x0, x1 - x0 + 1, &value, true);
+        }
+        recomposite_span(y, x0, x1);
+    }
+    
+    mark_dirty(left, top, left + mask->width - 1, top + mask->height - 1);
+}
+
+/*==============================================================================
+ * SUB-CELL DRAWING
+ *============================================================================*/
+
+/**
+ * @brief Glyph code bit of one dot
+ * @param mode SUBCELL_BRAILLE or SUBCELL_HALF
+ * @param col Dot column within the cell
+ * @param row Dot row within the cell
+ * @return Single-bit mask (braille follows the Unicode dot numbering)
+ */
+static unsigned subcell_dot_bit(int mode, int col, int row) {
+    if (mode == SUBCELL_HALF) return 1u << row;
+    return 1u << (row == 3 ? 6 + col : row + 3 * col);
+}
+
+/**
+ * @brief Fill the packing and unpacking lookup tables
+ * @details Runs once at startup; each byte value of a dot row is expanded
+ * into per-cell code bits for every mode and row.
+ */
+static void subcell_build_tables(void) {
+    for (int mode = SUBCELL_BRAILLE; mode < SUBCELL_MODES; ++mode) {
+        int cols = subcell_dots[mode][0], rows = subcell_dots[mode][1];
+        
+        for (int r = 0; r < rows; ++r) {
+            for (int byte = 0; byte < 256; ++byte) {
+                uint64_t lanes = 0;
+                for (int bit = 0; bit < 8; ++bit) {
+                    if (!(byte & (1 << bit))) continue;
+                    lanes |= (uint64_t)subcell_dot_bit(mode, bit % cols, r) << (8 * (bit / cols));
+                }
+                subcell_pack_lut[mode - 1][r][byte] = lanes;
+            }
+        }
+        for (int code = 0; code < 256; ++code) {
+            for (int r = 0; r < rows; ++r) {
+                uint8_t dots = 0;
+                for (int c = 0; c < cols; ++c) {
+                    if (code & subcell_dot_bit(mode, c, r)) dots |= (uint8_t)(1 << c);
+                }
+                subcell_unpack_lut[mode - 1][code][r] = dots;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Get the dot code a glyph stands for in the current mode
+ * @param glyph Glyph ID
+ * @return Dot code; glyphs that are not dot patterns read as 0 (no dots)
+ */
+static int subcell_code(GlyphId glyph) {
+    uint32_t code = glyph_code(glyph);
+    
+    if (g_app.subcell.mode == SUBCELL_BRAILLE) {
+        return (code >= BRAILLE_BASE && code <= BRAILLE_BASE + 0xFF) ? (int)(code - BRAILLE_BASE) : 0;
+    }
+    for (int i = 1; i < 4; ++i) {
+        if (code == half_block_chars[i]) return i;
+    }
+    return 0;
+}
+
+/**
+ * @brief Get the glyph drawing a dot code in the current mode
+ * @param code Dot code
+ * @return Glyph ID (a blank for no dots, so lower layers show through)
+ */
+static GlyphId subcell_glyph(int code) {
+    if (code == 0) return ' ';
+    if (g_app.subcell.mode == SUBCELL_BRAILLE) return glyph_intern(BRAILLE_BASE + (uint32_t)code);
+    return glyph_intern(half_block_chars[code]);
+}
+
+/**
+ * @brief Free the dot bitmap (the mode is kept)
+ */
+static void subcell_release(void) {
+    SubCell *sc = &g_app.subcell;
+    
+    free(sc->bits);
+    free(sc->codes);
+    free(sc->row);
+    sc->bits = NULL;
+    sc->codes = NULL;
+    sc->row = NULL;
+    sc->width = sc->height = 0;
+}
+
+/**
+ * @brief Size the dot bitmap for the current canvas
+ * @return false if out of memory
+ */
+static bool subcell_reserve(void) {
+    SubCell *sc = &g_app.subcell;
+    if (sc->bits && sc->width == g_app.canvas_width && sc->height == g_app.canvas_height) {
+        return true;
+    }
+    
+    subcell_release();
+    size_t groups = ((size_t)g_app.canvas_width + 7) / 8;
+    size_t stride = groups * (size_t)subcell_dots[sc->mode][0];
+    sc->bits = calloc(stride * (size_t)g_app.canvas_height * (size_t)subcell_dots[sc->mode][1], 1);
+    sc->codes = malloc(groups * 8);
+    sc->row = malloc((size_t)g_app.canvas_width * sizeof(Cell));
+    if (!sc->bits || !sc->codes || !sc->row) {
+        subcell_release();
+        return false;
+    }
+    sc->stride = stride;
+    sc->width = g_app.canvas_width;
+    sc->height = g_app.canvas_height;
+    return true;
+}
+
+/**
+ * @brief Get one dot row of the bitmap
+ * @param dy Dot row (must be valid)
+ * @return Row of stride bytes
+ */
+static inline uint8_t* subcell_dot_row(int dy) {
+    return g_app.subcell.bits + (size_t)dy * g_app.subcell.stride;
+}
+
+/**
+ * @brief Load the dots of a rectangle of cells from the active layer
+ * @param x0 Left column
+ * @param y0 Top row
+ * @param x1 Right column (inclusive)
+ * @param y1 Bottom row (inclusive)
+ * @details The layer stays the source of truth: whatever changed it since
+ * the last dot edit (loads, clears, frames, layer switches) is picked up.
+ */
+static void subcell_unpack(int x0, int y0, int x1, int y1) {
+    int mode = g_app.subcell.mode;
+    int cols = subcell_dots[mode][0], rows = subcell_dots[mode][1];
+    const CellBuffer *buf = &active_layer()->buf;
+    uint8_t keep_mask = (uint8_t)((1 << cols) - 1);
+    
+    for (int y = y0; y <= y1; ++y) {
+        for (int x = x0; x <= x1; ++x) {
+            const uint8_t *dots = subcell_unpack_lut[mode - 1][subcell_code(buffer_peek(buf, x, y)->glyph)];
+            int bit = (x * cols) & 7;
+            size_t byte = (size_t)(x * cols) >> 3;
+            
+            for (int r = 0; r < rows; ++r) {
+                uint8_t *row = subcell_dot_row(y * rows + r);
+                row[byte] = (uint8_t)((row[byte] & ~(keep_mask << bit)) | (dots[r] << bit));
+            }
+        }
+    }
+}
+
+/**
+ * @brief Pack one cell row of the bitmap into dot codes
+ * @param y Cell row
+ * @param g0 First group of eight cells
+ * @param g1 Last group (inclusive)
+ * 
+ * @details
+ * Each bitmap byte is looked up once per dot row and the results OR-ed
+ * into a 64-bit word holding eight cell codes, so a group costs 8 table
+ * loads in braille mode and 2 in half-block mode, with no per-dot work.
+ * The loop has no branches or cross-group dependencies and compilers
+ * vectorize the lane stores.
+ */
+static void subcell_pack_row(int y, int g0, int g1) {
+    SubCell *sc = &g_app.subcell;
+    int cols = subcell_dots[sc->mode][0], rows = subcell_dots[sc->mode][1];
+    uint64_t (*lut)[256] = subcell_pack_lut[sc->mode - 1];
+    const uint8_t *dot_rows[4];
+    for (int r = 0; r < rows; ++r) {
+        dot_rows[r] = subcell_dot_row(y * rows + r);
+    }
+    
+    for (int g = g0; g <= g1; ++g) {
+        uint64_t lanes = 0;
+        for (int r = 0; r < rows; ++r) {
+            const uint8_t *src = dot_rows[r] + (size_t)g * (size_t)cols;
+            for (int b = 0; b < cols; ++b) {
+                lanes |= lut[r][src[b]] << (b * 64 / cols);
+            }
+        }
+        uint8_t *out = sc->codes + (size_t)g * 8;
+        for (int k = 0; k < 8; ++k) {
+            out[k] = (uint8_t)(lanes >> (8 * k));
+        }
+    }
+}
+
+/**
+ * @brief Write the packed dots of a rectangle back to the active layer
+ * @param x0 Left column
+ * @param y0 Top row
+ * @param x1 Right column (inclusive)
+ * @param y1 Bottom row (inclusive)
+ * @details Only cells whose dot code changed are rewritten, in the current
+ * color; other glyphs under the rectangle are left alone. Each row is one
+ * span write and one recomposite.
+ */
+static void subcell_store(int x0, int y0, int x1, int y1) {
+    SubCell *sc = &g_app.subcell;
+    CellBuffer *buf = &active_layer()->buf;
+    
+    for (int y = y0; y <= y1; ++y) {
+        subcell_pack_row(y, x0 / 8, x1 / 8);
+        
+        int first = -1, last = -1;
+        for (int x = x0; x <= x1; ++x) {
+            const Cell *old = buffer_peek(buf, x, y);
+            if (sc->codes[x] == subcell_code(old->glyph)) {
+                sc->row[x] = *old;
+                continue;
+            }
+            sc->row[x] = make_cell(subcell_glyph(sc->codes[x]), g_app.current_color);
+            if (first < 0) first = x;
+            last = x;
+        }
+        if (first >= 0) {
+            buffer_write_span(buf, y, first, last - first + 1, &sc->row[first], false);
+            recomposite_span(y, first, last);
+        }
+    }
+}
+
+/**
+ * @brief Set or clear a run of dots in one dot row
+ * @param row Dot row
+ * @param from First dot
+ * @param to Last dot (inclusive)
+ * @param on true to set, false to clear
+ */
+static void subcell_fill_dots(uint8_t *row, int from, int to, bool on) {
+    while (from <= to) {
+        int bit = from & 7;
+        int n = (8 - bit < to - from + 1) ? 8 - bit : to - from + 1;
+        uint8_t mask = (uint8_t)(((1u << n) - 1) << bit);
+        
+        row[from >> 3] = on ? (uint8_t)(row[from >> 3] | mask) : (uint8_t)(row[from >> 3] & ~mask);
+        from += n;
+    }
+}
+
+/**
+ * @brief Paint the brush mask at a dot position
+ * @param dot_x Dot column of the brush center
+ * @param dot_y Dot row of the brush center
+ * @details The brush footprint is measured in dots. Solid and stamp masks
+ * are used as dot masks (a stamp's characters only shape it), a spray sets
+ * a random subset of its dots; the eraser clears dots. The cells under the footprint are unpacked from the layer,
+ * edited, and packed back.
+ */
+static void subcell_paint(int dot_x, int dot_y) {
+    SubCell *sc = &g_app.subcell;
+    if (!subcell_reserve()) {
+        set_status_message("Out of memory for dot drawing");
+        return;
+    }
+    
+    const BrushMask *mask = &g_app.brush;
+    int cols = subcell_dots[sc->mode][0], rows = subcell_dots[sc->mode][1];
+    int dot_w = g_app.canvas_width * cols, dot_h = g_app.canvas_height * rows;
+    int left = dot_x - (mask->width - 1) / 2;
+    int top = dot_y - (mask->height - 1) / 2;
+    int dx0 = left < 0 ? 0 : left;
+    int dy0 = top < 0 ? 0 : top;
+    int dx1 = (left + mask->width - 1 < dot_w) ? left + mask->width - 1 : dot_w - 1;
+    int dy1 = (top + mask->height - 1 < dot_h) ? top + mask->height - 1 : dot_h - 1;
+    if (dx0 > dx1 || dy0 > dy1) return;
+    
+    int x0 = dx0 / cols, y0 = dy0 / rows, x1 = dx1 / cols, y1 = dy1 / rows;
+    bool on = brush_chars[g_app.brush_index] != ' ';
+    
+    subcell_unpack(x0, y0, x1, y1);
+    for (int i = 0; i < mask->span_count; ++i) {
+        const BrushSpan *span = &mask->spans[i];
+        int y = top + span->dy;
+        int from = left + span->dx, to = from + span->len - 1;
+        if (y < dy0 || y > dy1) continue;
+        if (from < dx0) from = dx0;
+        if (to > dx1) to = dx1;
+        if (from > to) continue;
+        
+        if (mask->shape == BRUSH_SHAPE_SPRAY) {
+            uint64_t hits = spray_hits(to - from + 1);
+            int first, len;
+            while (spray_next_run(&hits, &first, &len)) {
+                subcell_fill_dots(subcell_dot_row(y), from + first, from + first + len - 1, on);
+            }
+        } else {
+            subcell_fill_dots(subcell_dot_row(y), from, to, on);
+        }
+    }
+    subcell_store(x0, y0, x1, y1);
+}
+
+/**
+ * @brief Move the dot cursor, painting if the pen is down
+ * @param dx X movement in dots
+ * @param dy Y movement in dots
+ * @details The cell cursor follows the dot cursor. Movement stops at the
+ * canvas edge (documents do not scroll in this mode).
+ */
+static void subcell_move(int dx, int dy) {
+    SubCell *sc = &g_app.subcell;
+    int cols = subcell_dots[sc->mode][0], rows = subcell_dots[sc->mode][1];
+    
+    // The cell cursor may have moved by other means; start from its cell
+    if (sc->dot_x / cols != g_app.cursor_x || sc->dot_y / rows != g_app.cursor_y) {
+        sc->dot_x = g_app.cursor_x * cols;
+        sc->dot_y = g_app.cursor_y * rows;
+    }
+    
+    int new_x = sc->dot_x + dx, new_y = sc->dot_y + dy;
+    if (new_x < 0) new_x = 0;
+    if (new_x >= g_app.canvas_width * cols) new_x = g_app.canvas_width * cols - 1;
+    if (new_y < 0) new_y = 0;
+    if (new_y >= g_app.canvas_height * rows) new_y = g_app.canvas_height * rows - 1;
+    if (new_x == sc->dot_x && new_y == sc->dot_y) return;
+    
+    sc->dot_x = new_x;
+    sc->dot_y = new_y;
+    g_app.cursor_x = new_x / cols;
+    g_app.cursor_y = new_y / rows;
+    if (g_app.pen_down) {
+        paint_stuff();
+    }
+}
+
+/**
+ * @brief Switch to the next sub-cell mode (braille, half-block, off)
+ * @details The dot cursor starts at the top-left dot of the cursor cell.
+ */
+static void subcell_cycle(void) {
+    SubCell *sc = &g_app.subcell;
+    
+    subcell_release();
+    sc->mode = (sc->mode + 1) % SUBCELL_MODES;
+    sc->dot_x = g_app.cursor_x * subcell_dots[sc->mode][0];
+    sc->dot_y = g_app.cursor_y * subcell_dots[sc->mode][1];
+    if (sc->mode == SUBCELL_OFF) {
+        set_status_message("Dot drawing off");
+    } else {
+        set_status_message("Dot drawing: %s, %dx%d dots per cell", subcell_names[sc->mode],
+                           subcell_dots[sc->mode][0], subcell_dots[sc->mode][1]);
+    }
+}
+
+/*==============================================================================
+ * SYMMETRY
+ *============================================================================*/
+
+/**
+ * @brief Cosine and sine of a fraction of a full turn
+ * @param turns Angle in turns (0-1)
+ * @param c Out: cosine
+ * @param s Out: sine
+ * @details Taylor series on the angle reduced to [-pi, pi], so the
+ * program does not need libm for a handful of rotation matrices.
+ */
+static void turn_vector(double turns, double *c, double *s) {
+    const double pi = 3.14159265358979323846;
+    double a = 2.0 * pi * (turns > 0.5 ? turns - 1.0 : turns);
+    double term_c = 1.0, term_s = a;
+    
+    *c = 0.0;
+    *s = 0.0;
+    for (int n = 0; n < 12; ++n) {
+        *c += term_c;
+        *s += term_s;
+        term_c *= -a * a / ((2 * n + 1) * (2 * n + 2));
+        term_s *= -a * a / ((2 * n + 2) * (2 * n + 3));
+    }
+}
+
+/**
+ * @brief Build the transforms for the current mode and grid
+ * @details Grid units are cells (twice as tall as wide) or, in sub-cell
+ * mode, dots (square on screen); rotations are scaled accordingly.
+ */
+static void symmetry_build(void) {
+    Symmetry *sym = &g_app.symmetry;
+    static const double mirrors[4][4] = {
+        { 1, 0, 0, 1 }, { -1, 0, 0, 1 }, { 1, 0, 0, -1 }, { -1, 0, 0, -1 },
+    };
+    double aspect = g_app.subcell.mode == SUBCELL_OFF ? 2.0 : 1.0;
+    
+    switch (sym->mode) {
+        case SYMMETRY_HORIZONTAL:
+            memcpy(sym->m[0], mirrors[0], sizeof(mirrors[0]));
+            memcpy(sym->m[1], mirrors[1], sizeof(mirrors[1]));
+            sym->count = 2;
+            break;
+        case SYMMETRY_VERTICAL:
+            memcpy(sym->m[0], mirrors[0], sizeof(mirrors[0]));
+            memcpy(sym->m[1], mirrors[2], sizeof(mirrors[2]));
+            sym->count = 2;
+            break;
+        case SYMMETRY_FOUR:
+            memcpy(sym->m, mirrors, sizeof(mirrors));
+            sym->count = 4;
+            break;
+        case SYMMETRY_RADIAL:
+            for (int k = 0; k < sym->folds; ++k) {
+                double c, s;
+                turn_vector((double)k / sym->folds, &c, &s);
+                sym->m[k][0] = c;
+                sym->m[k][1] = -s * aspect;
+                sym->m[k][2] = s / aspect;
+                sym->m[k][3] = c;
+            }
+            sym->count = sym->folds;
+            break;
+        default:
+            memcpy(sym->m[0], mirrors[0], sizeof(mirrors[0]));
+            sym->count = 1;
+            break;
+    }
+    sym->grid = g_app.subcell.mode;
+}
+
+/**
+ * @brief Compute every position a brush application is copied to
+ * @param x Cursor column in grid units (cells, or dots in sub-cell mode)
+ * @param y Cursor row in grid units
+ * @param px Out: SYMMETRY_MAX columns
+ * @param py Out: SYMMETRY_MAX rows
+ * @return Number of positions, the cursor's first; copies that land on an
+ *         earlier one (on an axis or at the center) are dropped
+ * @details The matrices are built on first use and rebuilt only when the
+ * mode or grid changed; each stroke just multiplies the cursor offset through them.
+ */
+static int symmetry_points(int x, int y, int *px, int *py) {
+    Symmetry *sym = &g_app.symmetry;
+    if (sym->count == 0 || sym->grid != g_app.subcell.mode) symmetry_build();
+    
+    // Center of the center cell, in grid units
+    int cols = subcell_dots[g_app.subcell.mode][0], rows = subcell_dots[g_app.subcell.mode][1];
+    int cx = sym->centered ? sym->center_x - g_app.document.view_x : g_app.canvas_width / 2;
+    int cy = sym->centered ? sym->center_y - g_app.document.view_y : g_app.canvas_height / 2;
+    double ox = cx * cols + (cols - 1) / 2.0, oy = cy * rows + (rows - 1) / 2.0;
+    double dx = x - ox, dy = y - oy;
+    int count = 0;
+    
+    for (int i = 0; i < sym->count; ++i) {
+        const double *m = sym->m[i];
+        double tx = ox + m[0] * dx + m[1] * dy;
+        double ty = oy + m[2] * dx + m[3] * dy;
+        int ix = (int)(tx < 0 ? tx - 0.5 : tx + 0.5);
+        int iy = (int)(ty < 0 ? ty - 0.5 : ty + 0.5);
+        
+        bool seen = false;
+        for (int j = 0; j < count && !seen; ++j) {
+            seen = px[j] == ix && py[j] == iy;
+        }
+        if (seen) continue;
+        px[count] = ix;
+        py[count] = iy;
+        count++;
+    }
+    return count;
+}
+
+/**
+ * @brief Switch symmetry mode
+ * @param mode SYMMETRY_OFF ... SYMMETRY_RADIAL
+ * @param folds Radial copies (ignored by the other modes)
+ */
+static void symmetry_set(int mode, int folds) {
+    Symmetry *sym = &g_app.symmetry;
+    
+    sym->mode = mode;
+    sym->folds = folds;
+    sym->grid = -1;
+}
+
+/**
+ * @brief Cycle symmetry modes, keeping the radial fold count
+ */
+static void symmetry_cycle(void) {
+    Symmetry *sym = &g_app.symmetry;
+    static const char *names[SYMMETRY_MODES] = {
+        "off", "horizontal", "vertical", "4-way", "radial",
+    };
+    
+    symmetry_set((sym->mode + 1) % SYMMETRY_MODES,
+                 sym->folds ? sym->folds : SYMMETRY_DEFAULT_FOLDS);
+    if (sym->mode == SYMMETRY_RADIAL) {
+        set_status_message("Symmetry: %d-fold radial", sym->folds);
+    } else {
+        set_status_message("Symmetry: %s", names[sym->mode]);
+    }
+}
+
+/*==============================================================================
+ * NAVIGATION
+ *============================================================================*/
+
+/**
+ * @brief Move the cursor several steps in one direction
+ * @param dx X direction (-1, 0, or 1)
+ * @param dy Y direction (-1, 0, or 1)
+ * @param steps Number of cells (dots in sub-cell mode)
+ * @details With the pen down every cell along the way is painted; otherwise
+ * the cursor moves in one go. Either way the frame shows only the result.
+ */
+static void move_cursor_steps(int dx, int dy, int steps) {
+    if (g_app.pen_down) {
+        for (int i = 0; i < steps; ++i) {
+            move_brush(dx, dy);
+        }
+    } else {
+        move_brush(dx * steps, dy * steps);
+    }
+}
+
+/**
+ * @brief Move for an arrow key, faster while the key is held
+ * @param key Key code (repeats are counted per key)
+ * @param dx X direction (-1, 0, or 1)
+ * @param dy Y direction (-1, 0, or 1)
+ * @details Auto-repeat delivers a held key every few tens of milliseconds.
+ * Each MOTION_RAMP_KEYS quick repeats double the step, up to
+ * MOTION_STEP_MAX; any pause or other key starts again at one cell.
+ */
+static void move_accelerated(int key, int dx, int dy) {
+    Motion *m = &g_app.motion;
+    int64_t now = now_usec();
+    
+    m->repeats = (key == m->key && now - m->last_us < MOTION_REPEAT_US) ? m->repeats + 1 : 0;
+    m->key = key;
+    m->last_us = now;
+    
+    int steps = 1;
+    for (int r = m->repeats / MOTION_RAMP_KEYS; r > 0 && steps < MOTION_STEP_MAX; --r) {
+        steps *= 2;
+    }
+    move_cursor_steps(dx, dy, steps);
+}
+
+/**
+ * @brief Find the next blank/non-blank boundary along a row
+ * @param x Starting column
+ * @param y Row
+ * @param dir +1 for right, -1 for left
+ * @return Column of the first cell whose blankness differs from the
+ *         starting cell, or the canvas edge if there is none
+ * 
+ * @details
+ * The row's occupancy span answers most cases without reading cells:
+ * empty rows and blanks outside the span go straight to the edge or to
+ * the span's end. Inside the span, blank runs to the right are skipped
+ * several cells per compare by the skip_equal_cells kernel.
+ */
+static int jump_target_x(int x, int y, int dir) {
+    int edge = dir > 0 ? g_app.canvas_width - 1 : 0;
+    RowSpan span = row_occupancy(y);
+    if (x == edge) return x;
+    if (span.count == 0) return edge;
+    
+    const Cell *row = buffer_row(&g_app.canvas, y);
+    bool blank = cell_is_blank(&row[x]);
+    int nx;
+    
+    if (dir > 0) {
+        if (blank && x > span.last) return edge;
+        if (blank && x < span.first) return span.first;
+        nx = x + 1;
+        if (blank) {
+            nx += (int)simd.skip_equal_cells(row + nx, (size_t)(span.last - nx + 1),
+                                             cell_bits(g_app.canvas.blank));
+        }
+        while (nx <= span.last && cell_is_blank(&row[nx]) == blank) ++nx;
+        return nx < edge ? nx : edge;
+    }
+    
+    if (blank && x < span.first) return edge;
+    if (blank && x > span.last) return span.last;
+    nx = x - 1;
+    while (nx >= span.first && cell_is_blank(&row[nx]) == blank) --nx;
+    return nx > edge ? nx : edge;
+}
+
+/**
+ * @brief Find the next blank/non-blank boundary along a column
+ * @param x Column
+ * @param y Starting row
+ * @param dir +1 for down, -1 for up
+ * @return Row of the first cell whose blankness differs from the starting
+ *         cell, or the canvas edge if there is none
+ * @details Rows whose occupancy span does not reach the column are known
+ * blank without reading their cells.
+ */
+static int jump_target_y(int x, int y, int dir) {
+    int edge = dir > 0 ? g_app.canvas_height - 1 : 0;
+    if (y == edge) return y;
+    
+    bool blank = cell_is_blank(peek_spot(x, y));
+    for (int ny = y + dir; ny != edge; ny += dir) {
+        RowSpan span = row_occupancy(ny);
+        bool here = span.count == 0 || x < span.first || x > span.last ||
+                    cell_is_blank(peek_spot(x, ny));
+        if (here != blank) return ny;
+    }
+    return edge;
+}
+
+/**
+ * @brief Jump the cursor to the next blank/non-blank boundary
+ * @param dx X direction (-1, 0, or 1)
+ * @param dy Y direction (-1, 0, or 1)
+ * @details Stops at the canvas edge; a plain arrow key from there scrolls
+ * a document.
+ */
+static void jump_cursor(int dx, int dy) {
+    int steps = dx ? abs(jump_target_x(g_app.cursor_x, g_app.cursor_y, dx) - g_app.cursor_x)
+                   : abs(jump_target_y(g_app.cursor_x, g_app.cursor_y, dy) - g_app.cursor_y);
+    
+    // In sub-cell mode the cursor moves in dots
+    if (g_app.subcell.mode != SUBCELL_OFF) {
+        steps *= subcell_dots[g_app.subcell.mode][dx ? 0 : 1];
+    }
+    move_cursor_steps(dx, dy, steps);
+}
+
+/**
+ * @brief Put the cursor on a canvas or document coordinate
+ * @param x Target column (clamped to the canvas or document)
+ * @param y Target row (clamped)
+ * @details A document viewport scrolls to center the target when it is
+ * not already visible. Nothing is painted.
+ */
+static void goto_position(int x, int y) {
+    Document *doc = &g_app.document;
+    int world_w = doc->map ? doc->width : g_app.canvas_width;
+    int world_h = doc->map ? doc->height : g_app.canvas_height;
+    
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    if (x >= world_w) x = world_w - 1;
+    if (y >= world_h) y = world_h - 1;
+    
+    if (doc->map && (x < doc->view_x || x >= doc->view_x + g_app.canvas_width ||
+                     y < doc->view_y || y >= doc->view_y + g_app.canvas_height)) {
+        int moved_x, moved_y;
+        document_scroll(x - g_app.canvas_width / 2 - doc->view_x,
+                        y - g_app.canvas_height / 2 - doc->view_y, &moved_x, &moved_y);
+    }
+    
+    x -= doc->view_x;
+    y -= doc->view_y;
+    g_app.cursor_x = x < 0 ? 0 : x >= g_app.canvas_width ? g_app.canvas_width - 1 : x;
+    g_app.cursor_y = y < 0 ? 0 : y >= g_app.canvas_height ? g_app.canvas_height - 1 : y;
+}
+
+/*==============================================================================
+ * FIND AND REPLACE
+ *============================================================================*/
+
+/**
+ * @brief Mark a selection corner, or clear the selection
+ * @details The first press anchors a corner at the cursor, the second
+ * selects the rectangle up to the cursor, and a third clears it. Corners
+ * are taken in document coordinates, so the viewport may scroll between
+ * the two presses.
+ */
+static void toggle_selection(void) {
+    Selection *sel = &g_app.selection;
+    int cx = g_app.cursor_x + g_app.document.view_x;
+    int cy = g_app.cursor_y + g_app.document.view_y;
+    
+    if (sel->active) {
+        sel->active = false;
+        set_status_message("Selection cleared");
+    } else if (!sel->anchored) {
+        sel->anchored = true;
+        sel->x0 = sel->x1 = cx;
+        sel->y0 = sel->y1 = cy;
+        set_status_message("Selection anchored at (%d,%d); move and press M again",
+                           sel->x0, sel->y0);
+    } else {
+        int ax = sel->x0, ay = sel->y0;
+        sel->x0 = ax < cx ? ax : cx;
+        sel->x1 = ax < cx ? cx : ax;
+        sel->y0 = ay < cy ? ay : cy;
+        sel->y1 = ay < cy ? cy : ay;
+        sel->anchored = false;
+        sel->active = true;
+        set_status_message("Selected %dx%d", sel->x1 - sel->x0 + 1, sel->y1 - sel->y0 + 1);
+    }
+}
+
+/**
+ * @brief Get the area edits apply to, in canvas coordinates
+ * @param x0 Out: left column
+ * @param y0 Out: top row
+ * @param x1 Out: right column (inclusive)
+ * @param y1 Out: bottom row (inclusive)
+ * @return false if the selection lies wholly outside the viewport
+ * @details The selection clipped to the viewport, or the whole canvas when
+ * no selection is active.
+ */
+static bool selection_view_area(int *x0, int *y0, int *x1, int *y1) {
+    const Selection *sel = &g_app.selection;
+    *x0 = 0;
+    *y0 = 0;
+    *x1 = g_app.canvas_width - 1;
+    *y1 = g_app.canvas_height - 1;
+    if (!sel->active) return true;
+    
+    int left = sel->x0 - g_app.document.view_x, right = sel->x1 - g_app.document.view_x;
+    int top = sel->y0 - g_app.document.view_y, bottom = sel->y1 - g_app.document.view_y;
+    if (left > *x0) *x0 = left;
+    if (top > *y0) *y0 = top;
+    if (right < *x1) *x1 = right;
+    if (bottom < *y1) *y1 = bottom;
+    return *x0 <= *x1 && *y0 <= *y1;
+}
+
+/**
+ * @brief Replace every matching cell of the active layer
+ * @param bits Pattern to find, compared under mask
+ * @param mask Cell bits that take part in the match
+ * @param to Replacement cell bits, applied under set_mask
+ * @param set_mask Cell bits taken from the replacement (others are kept)
+ * @return Number of cells replaced
+ * 
+ * @details
+ * Only the occupied span of each row (clipped to the visible part of the
+ * selection, if any) is scanned, several cells per compare via the
+ * find_matching_cell kernel. Rows that changed are recomposited, which
+ * queues them for redraw.
+ */
+static int replace_matching(uint32_t bits, uint32_t mask, uint32_t to, uint32_t set_mask) {
+    Layer *layer = active_layer();
+    CellBuffer *buf = &layer->buf;
+    int x0, y0, x1, y1;
+    int replaced = 0;
+    
+    if (!selection_view_area(&x0, &y0, &x1, &y1)) return 0;
+    
+    for (int y = 0; y < g_app.canvas_height; ++y) {
+        g_app.scratch_spans[y] = (RowSpan){ -1, -1, 0 };
+    }
+    
+    bits &= mask;
+    for (int y = y0; y <= y1; ++y) {
+        RowSpan occ = buffer_occupancy(buf, y);
+        if (occ.count == 0) continue;
+        
+        int from = occ.first > x0 ? occ.first : x0;
+        int upto = occ.last < x1 ? occ.last : x1;
+        const Cell *row = buffer_row(buf, y);
+        RowSpan *changed = &g_app.scratch_spans[y];
+        
+        for (int x = from; x <= upto; ++x) {
+            x += (int)simd.find_matching_cell(row + x, (size_t)(upto - x + 1), bits, mask);
+            if (x > upto) break;
+            
+            uint32_t out = (cell_bits(row[x]) & ~set_mask) | (to & set_mask);
+            Cell value;
+            memcpy(&value, &out, sizeof(value));
+            if (buffer_put(buf, x, y, value)) {
+                if (changed->count++ == 0) changed->first = x;
+                changed->last = x;
+                ++replaced;
+            }
+        }
+    }
+    
+    if (replaced > 0) {
+        recomposite_rows(g_app.scratch_spans);
+    }
+    return replaced;
+}
+
+/**
+ * @brief Replace the cell under the cursor everywhere with the current brush
+ * @details Works on the active layer, limited to the selection when one is
+ * set; matches on both character and color.
+ */
+static void replace_under_cursor(void) {
+    if (!active_layer_writable()) return;
+    
+    Cell target = *buffer_peek(&active_layer()->buf, g_app.cursor_x, g_app.cursor_y);
+    if (cell_is_blank(&target)) {
+        set_status_message("Nothing to replace: cursor is on a blank cell");
+        return;
+    }
+    
+    Cell value = make_cell(glyph_intern(brush_chars[g_app.brush_index]),
+                           g_app.current_color);
+    int count = replace_matching(cell_bits(target), UINT32_MAX, cell_bits(value), UINT32_MAX);
+    char utf8[UTF8_MAX + 1];
+    utf8[utf8_encode(glyph_code(target.glyph), utf8)] = '\0';
+    set_status_message("Replaced %d '%s' cell%s%s", count, utf8,
+                       count == 1 ? "" : "s", g_app.selection.active ? " in selection" : "");
+}
+
+/*==============================================================================
+ * TRANSFORMS
+ *============================================================================*/
+
+/**
+ * @brief Copy a rectangle of a buffer into a dense row-major array
+ * @param buf Buffer
+ * @param x0 Left column
+ * @param y0 Top row
+ * @param w Width (rectangle must lie inside the canvas)
+ * @param h Height
+ * @param out w x h cells
+ * @details Live rows are copied with memcpy(); stale rows read as blank.
+ */
+static void buffer_read_rect(const CellBuffer *buf, int x0, int y0, int w, int h, Cell *out) {
+    for (int y = 0; y < h; ++y) {
+        Cell *dst = &out[(size_t)y * (size_t)w];
+        if (buf->row_gen[y0 + y] != buf->gen) {
+            for (int x = 0; x < w; ++x) dst[x] = buf->blank;
+        } else {
+            memcpy(dst, buffer_row(buf, y0 + y) + x0, (size_t)w * sizeof(Cell));
+        }
+    }
+}
+
+/**
+ * @brief Rotate a dense array of cells clockwise
+ * @param src w x h cells
+ * @param w Source width
+ * @param h Source height
+ * @param dst Output: h x w cells for quarter turns, w x h for a half turn
+ * @param quarters Clockwise quarter turns (1, 2 or 3)
+ * 
+ * @details
+ * A half turn is one reversed linear copy. Quarter turns write each source
+ * row into a destination column, which touches a new cache line per cell;
+ * walking the source in TRANSFORM_TILE square tiles keeps both the tile's
+ * source rows and its destination lines cached until they are used up, so
+ * the copy streams at memory bandwidth instead of missing on every store.
+ */
+static void rotate_cells(const Cell *src, int w, int h, Cell *dst, int quarters) {
+    size_t n = (size_t)w * (size_t)h;
+    
+    if (quarters == 2) {
+        for (size_t i = 0; i < n; ++i) {
+            dst[n - 1 - i] = src[i];
+        }
+        return;
+    }
+    
+    for (int ty = 0; ty < h; ty += TRANSFORM_TILE) {
+        int ye = (ty + TRANSFORM_TILE < h) ? ty + TRANSFORM_TILE : h;
+        for (int tx = 0; tx < w; tx += TRANSFORM_TILE) {
+            int xe = (tx + TRANSFORM_TILE < w) ? tx + TRANSFORM_TILE : w;
+            
+            for (int y = ty; y < ye; ++y) {
+                const Cell *row = &src[(size_t)y * (size_t)w];
+                if (quarters == 1) {
+                    // (x, y) -> (h - 1 - y, x)
+                    Cell *out = &dst[(size_t)(h - 1 - y)];
+                    for (int x = tx; x < xe; ++x) out[(size_t)x * (size_t)h] = row[x];
+                } else {
+                    // (x, y) -> (y, w - 1 - x)
+                    Cell *out = &dst[(size_t)y];
+                    for (int x = tx; x < xe; ++x) out[(size_t)(w - 1 - x) * (size_t)h] = row[x];
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Mirror a dense array of cells in place
+ * @param cells w x h cells
+ * @param w Width
+ * @param h Height
+ * @param vertical true to swap top and bottom, false to swap left and right
+ */
+static void flip_cells(Cell *cells, int w, int h, bool vertical) {
+    if (vertical) {
+        for (int y = 0; y < h / 2; ++y) {
+            Cell *a = &cells[(size_t)y * (size_t)w];
+            Cell *b = &cells[(size_t)(h - 1 - y) * (size_t)w];
+            for (int x = 0; x < w; ++x) {
+                Cell t = a[x];
+                a[x] = b[x];
+                b[x] = t;
+            }
+        }
+        return;
+    }
+    
+    for (int y = 0; y < h; ++y) {
+        Cell *row = &cells[(size_t)y * (size_t)w];
+        for (int l = 0, r = w - 1; l < r; ++l, --r) {
+            Cell t = row[l];
+            row[l] = row[r];
+            row[r] = t;
+        }
+    }
+}
+
+/**
+ * @brief Resample a dense array of cells by nearest neighbour
+ * @param src w x h cells
+ * @param w Source width
+ * @param h Source height
+ * @param dst Output: out_w x out_h cells
+ * @param dw Full scaled width
+ * @param dh Full scaled height
+ * @param out_w Columns of the scaled image to produce (<= dw, the rest is clipped)
+ * @param out_h Rows to produce (<= dh)
+ * @details Source columns are looked up once per output column; output
+ * rows that sample the same source row are copied from the previous one.
+ */
+static bool scale_cells(const Cell *src, int w, int h, Cell *dst,
+                        int dw, int dh, int out_w, int out_h) {
+    int *columns = malloc((size_t)out_w * sizeof(int));
+    if (!columns) return false;
+    
+    for (int x = 0; x < out_w; ++x) {
+        columns[x] = (int)((int64_t)x * w / dw);
+    }
+    int last_sy = -1;
+    for (int y = 0; y < out_h; ++y) {
+        int sy = (int)((int64_t)y * h / dh);
+        Cell *out = &dst[(size_t)y * (size_t)out_w];
+        if (sy == last_sy) {
+            memcpy(out, out - out_w, (size_t)out_w * sizeof(Cell));
+            continue;
+        }
+        const Cell *row = &src[(size_t)sy * (size_t)w];
+        for (int x = 0; x < out_w; ++x) out[x] = row[columns[x]];
+        last_sy = sy;
+    }
+    free(columns);
+    return true;
+}
+
+/**
+ * @brief Pick the area a transform applies to and copy it out
+ * @param x0 Out: left column
+ * @param y0 Out: top row
+ * @param w Out: width
+ * @param h Out: height
+ * @return Copy of the area from the active layer (caller frees), or NULL
+ *         with the reason in the status bar
+ * @details The area is the part of the selection inside the viewport when
+ * one is active, else the canvas.
+ */
+static Cell* transform_begin(int *x0, int *y0, int *w, int *h) {
+    if (!active_layer_writable()) return NULL;
+    
+    int x1, y1;
+    if (!selection_view_area(x0, y0, &x1, &y1)) {
+        set_status_message("The selection is outside the view");
+        return NULL;
+    }
+    *w = x1 - *x0 + 1;
+    *h = y1 - *y0 + 1;
+    
+    Cell *cells = malloc((size_t)*w * (size_t)*h * sizeof(Cell));
+    if (!cells) {
+        set_status_message("Out of memory for the transform");
+        return NULL;
+    }
+    buffer_read_rect(&active_layer()->buf, *x0, *y0, *w, *h, cells);
+    return cells;
+}
+
+/**
+ * @brief Replace an area of the active layer with transformed cells
+ * @param x0 Left column of the original area
+ * @param y0 Top row of the original area
+ * @param w Original width
+ * @param h Original height
+ * @param cells Transformed cells (dw x dh, row-major)
+ * @param dx0 Left column to place them at (may lie off the canvas)
+ * @param dy0 Top row to place them at
+ * @param dw Transformed width
+ * @param dh Transformed height
+ * 
+ * @details
+ * The original area is blanked and the result written over it, clipped to
+ * the canvas, one span write and one recomposite per affected row. An
+ * active selection moves to the result so transforms can be chained.
+ */
+static void transform_finish(int x0, int y0, int w, int h,
+                             const Cell *cells, int dx0, int dy0, int dw, int dh) {
+    CellBuffer *buf = &active_layer()->buf;
+    int left = dx0 < x0 ? dx0 : x0, right = (dx0 + dw > x0 + w) ? dx0 + dw - 1 : x0 + w - 1;
+    int top = dy0 < y0 ? dy0 : y0, bottom = (dy0 + dh > y0 + h) ? dy0 + dh - 1 : y0 + h - 1;
+    if (left < 0) left = 0;
+    if (top < 0) top = 0;
+    if (right >= g_app.canvas_width) right = g_app.canvas_width - 1;
+    if (bottom >= g_app.canvas_height) bottom = g_app.canvas_height - 1;
+    
+    Cell *row = malloc((size_t)(right - left + 1) * sizeof(Cell));
+    if (!row) {
+        set_status_message("Out of memory for the transform");
+        return;
+    }
+    
+    for (int y = top; y <= bottom; ++y) {
+        buffer_read_rect(buf, left, y, right - left + 1, 1, row);
+        if (y >= y0 && y < y0 + h) {
+            for (int x = x0; x < x0 + w; ++x) row[x - left] = buf->blank;
+        }
+        if (y >= dy0 && y < dy0 + dh) {
+            const Cell *src = &cells[(size_t)(y - dy0) * (size_t)dw];
+            for (int x = (dx0 > left ? dx0 : left); x < dx0 + dw && x <= right; ++x) {
+                row[x - left] = src[x - dx0];
+            }
+        }
+        buffer_write_span(buf, y, left, right - left + 1, row, false);
+        recomposite_span(y, left, right);
+    }
+    free(row);
+    
+    Selection *sel = &g_app.selection;
+    if (sel->active) {
+        sel->x0 = dx0 > 0 ? dx0 : 0;
+        sel->y0 = dy0 > 0 ? dy0 : 0;
+        sel->x1 = dx0 + dw - 1 < g_app.canvas_width ? dx0 + dw - 1 : g_app.canvas_width - 1;
+        sel->y1 = dy0 + dh - 1 < g_app.canvas_height ? dy0 + dh - 1 : g_app.canvas_height - 1;
+        sel->active = sel->x0 <= sel->x1 && sel->y0 <= sel->y1;
+        sel->x0 += g_app.document.view_x;
+        sel->x1 += g_app.document.view_x;
+        sel->y0 += g_app.document.view_y;
+        sel->y1 += g_app.document.view_y;
+    }
+}
+
+/**
+ * @brief Rotate the selection (or the active layer) clockwise
+ * @param quarters Quarter turns (1, 2 or 3)
+ * @details Quarter turns swap the area's width and height; the result is
+ * centered on the original area and clipped to the canvas.
+ */
+static void transform_rotate(int quarters) {
+    int x0, y0, w, h;
+    Cell *src = transform_begin(&x0, &y0, &w, &h);
+    if (!src) return;
+    
+    Cell *dst = malloc((size_t)w * (size_t)h * sizeof(Cell));
+    if (!dst) {
+        free(src);
+        set_status_message("Out of memory for the transform");
+        return;
+    }
+    rotate_cells(src, w, h, dst, quarters);
+    
+    int dw = (quarters == 2) ? w : h, dh = (quarters == 2) ? h : w;
+    transform_finish(x0, y0, w, h, dst, x0 + (w - dw) / 2, y0 + (h - dh) / 2, dw, dh);
+    free(dst);
+    free(src);
+}
+
+/**
+ * @brief Mirror the selection (or the active layer) in place
+ * @param vertical true to flip top/bottom, false for left/right
+ */
+static void transform_flip(bool vertical) {
+    int x0, y0, w, h;
+    Cell *cells = transform_begin(&x0, &y0, &w, &h);
+    if (!cells) return;
+    
+    flip_cells(cells, w, h, vertical);
+    transform_finish(x0, y0, w, h, cells, x0, y0, w, h);
+    free(cells);
+}
+
+/**
+ * @brief Scale the selection (or the active layer) by num/den
+ * @param num Scale numerator
+ * @param den Scale denominator
+ * @details The result keeps the area's top-left corner; only the part
+ * that lands on the canvas is computed.
+ */
+static void transform_scale(int num, int den) {
+    int x0, y0, w, h;
+    Cell *src = transform_begin(&x0, &y0, &w, &h);
+    if (!src) return;
+    
+    int dw = (int)((int64_t)w * num / den), dh = (int)((int64_t)h * num / den);
+    if (dw < 1) dw = 1;
+    if (dh < 1) dh = 1;
+    int out_w = (x0 + dw <= g_app.canvas_width) ? dw : g_app.canvas_width - x0;
+    int out_h = (y0 + dh <= g_app.canvas_height) ? dh : g_app.canvas_height - y0;
+    
+    Cell *dst = malloc((size_t)out_w * (size_t)out_h * sizeof(Cell));
+    if (!dst || !scale_cells(src, w, h, dst, dw, dh, out_w, out_h)) {
+        set_status_message("Out of memory for the transform");
+    } else {
+        transform_finish(x0, y0, w, h, dst, x0, y0, out_w, out_h);
+    }
+    free(dst);
+    free(src);
+}
+
+/*==============================================================================
+ * DITHERING
+ *============================================================================*/
+
+/**
+ * @var bayer8
+ * @brief 8x8 Bayer threshold matrix (each of 0-63 once)
+ */
+static const uint8_t bayer8[8][8] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 },
+};
+
+/**
+ * @brief Ordered-dither the selection (or the active layer) between two cells
+ * @param a Cell at 0%
+ * @param b Cell at 100%
+ * @param percent Share of b cells, or -1 for a left-to-right gradient
+ * 
+ * @details
+ * A cell becomes b where its Bayer threshold is below the level (0-64) for
+ * its column, so any level spreads b evenly with no randomness. The
+ * pattern is anchored to document coordinates, so fills made through
+ * different viewports line up. Each row is built once, then written and
+ * recomposited as one span.
+ */
+static void dither_area(Cell a, Cell b, int percent) {
+    if (!active_layer_writable()) return;
+    
+    int x0, y0, x1, y1;
+    if (!selection_view_area(&x0, &y0, &x1, &y1)) {
+        set_status_message("The selection is outside the view");
+        return;
+    }
+    int w = x1 - x0 + 1;
+    
+    Cell *row = malloc((size_t)w * sizeof(Cell));
+    uint8_t *levels = malloc((size_t)w);
+    if (!row || !levels) {
+        free(row);
+        free(levels);
+        set_status_message("Out of memory for the dither");
+        return;
+    }
+    
+    for (int i = 0; i < w; ++i) {
+        if (percent >= 0) {
+            levels[i] = (uint8_t)((percent * 64 + 50) / 100);
+        } else {
+            levels[i] = (uint8_t)(w > 1 ? (i * 64 + (w - 1) / 2) / (w - 1) : 32);
+        }
+    }
+    
+    for (int y = y0; y <= y1; ++y) {
+        const uint8_t *thresholds = bayer8[(y + g_app.document.view_y) & 7];
+        for (int i = 0; i < w; ++i) {
+            int x = x0 + i + g_app.document.view_x;
+            row[i] = thresholds[x & 7] < levels[i] ? b : a;
+        }
+        buffer_write_span(&active_layer()->buf, y, x0, w, row, false);
+        recomposite_span(y, x0, x1);
+    }
+    
+    free(levels);
+    free(row);
+}
+
+/*==============================================================================
+ * ANIMATION TIMELINE
+ *============================================================================*/
+
+/**
+ * @brief Free the storage of one frame delta
+ * @param delta Delta to free (left empty)
+ */
+static void delta_free(FrameDelta *delta) {
+    free(delta->runs);
+    free(delta->cells);
+    memset(delta, 0, sizeof(*delta));
+}
+
+/**
+ * @brief Encode the changes between two full frames as runs of cells
+ * @param from Previous frame contents (canvas_width x canvas_height)
+ * @param to Next frame contents
+ * @param out Delta to fill; any previous contents are freed
+ * @return true on success
+ * 
+ * @details
+ * Unchanged rows are skipped with one memcmp(); changed rows are split into
+ * runs of differing cells. A first pass sizes the arrays so each delta is
+ * exactly two allocations.
+ */
+static bool delta_encode(const Cell *from, const Cell *to, FrameDelta *out) {
+    int width = g_app.canvas_width;
+    size_t row_bytes = (size_t)width * sizeof(Cell);
+    int run_count = 0, cell_count = 0;
+    
+    delta_free(out);
+    for (int pass = 0; pass < 2; ++pass) {
+        run_count = cell_count = 0;
+        
+        for (int y = 0; y < g_app.canvas_height; ++y) {
+            const Cell *a = &from[(size_t)y * width];
+            const Cell *b = &to[(size_t)y * width];
+            if (memcmp(a, b, row_bytes) == 0) continue;
+            
+            for (int x = 0; x < width; ) {
+                if (cell_bits(a[x]) == cell_bits(b[x])) { ++x; continue; }
+                int start = x;
+                while (x < width && cell_bits(a[x]) != cell_bits(b[x])) ++x;
+                
+                if (pass == 1) {
+                    out->runs[run_count] = (DeltaRun){ (uint16_t)start, (uint16_t)y,
+                                                       (uint16_t)(x - start) };
+                    memcpy(&out->cells[cell_count], &b[start],
+                           (size_t)(x - start) * sizeof(Cell));
+                }
+                ++run_count;
+                cell_count += x - start;
+            }
+        }
+        
+        if (pass == 0) {
+            if (run_count == 0) return true;
+            out->runs = malloc((size_t)run_count * sizeof(DeltaRun));
+            out->cells = malloc((size_t)cell_count * sizeof(Cell));
+            if (!out->runs || !out->cells) {
+                delta_free(out);
+                return false;
+            }
+        }
+    }
+    out->run_count = run_count;
+    out->cell_count = cell_count;
+    return true;
+}
+
+/**
+ * @brief Apply a frame delta to full frame contents
+ * @param delta Delta to apply
+ * @param grid Frame contents, updated in place
+ */
+static void delta_apply(const FrameDelta *delta, Cell *grid) {
+    const Cell *src = delta->cells;
+    
+    for (int i = 0; i < delta->run_count; ++i) {
+        const DeltaRun *run = &delta->runs[i];
+        memcpy(&grid[(size_t)run->y * g_app.canvas_width + run->x], src,
+               (size_t)run->len * sizeof(Cell));
+        src += run->len;
+    }
+}
+
+/**
+ * @brief Fill a frame grid with blank cells of the animated layer
+ * @param grid Frame contents (canvas_width x canvas_height)
+ */
+static void timeline_blank(Cell *grid) {
+    Cell blank = g_app.layers[g_app.timeline.layer].buf.blank;
+    size_t n = (size_t)g_app.canvas_width * (size_t)g_app.canvas_height;
+    
+    for (size_t i = 0; i < n; ++i) {
+        grid[i] = blank;
+    }
+}
+
+/**
+ * @brief Rebuild a frame by replaying deltas from the first frame
+ * @param index Frame index
+ * @param grid Out: frame contents
+ */
+static void timeline_reconstruct(int index, Cell *grid) {
+    timeline_blank(grid);
+    for (int i = 0; i <= index; ++i) {
+        delta_apply(&g_app.timeline.frames[i], grid);
+    }
+}
+
+/**
+ * @brief Copy the animated layer into a frame grid
+ * @param grid Out: layer contents
+ */
+static void timeline_snapshot(Cell *grid) {
+    const CellBuffer *buf = &g_app.layers[g_app.timeline.layer].buf;
+    int width = g_app.canvas_width;
+    
+    for (int y = 0; y < g_app.canvas_height; ++y) {
+        Cell *row = &grid[(size_t)y * width];
+        if (buffer_occupancy(buf, y).count == 0) {
+            for (int x = 0; x < width; ++x) row[x] = buf->blank;
+        } else {
+            memcpy(row, buffer_peek(buf, 0, y), (size_t)width * sizeof(Cell));
+        }
+    }
+}
+
+/**
+ * @brief Make the animated layer match a frame grid
+ * @param grid Frame contents
+ * @details Only cells that differ from the layer are written, and only the
+ * changed spans are recomposited and queued for redraw.
+ */
+static void timeline_show(const Cell *grid) {
+    CellBuffer *buf = &g_app.layers[g_app.timeline.layer].buf;
+    int width = g_app.canvas_width;
+    
+    for (int y = 0; y < g_app.canvas_height; ++y) {
+        const Cell *row = &grid[(size_t)y * width];
+        RowSpan *changed = &g_app.scratch_spans[y];
+        
+        *changed = (RowSpan){ -1, -1, 0 };
+        for (int x = 0; x < width; ++x) {
+            if (buffer_put(buf, x, y, row[x])) {
+                if (changed->count++ == 0) changed->first = x;
+                changed->last = x;
+            }
+        }
+    }
+    recomposite_rows(g_app.scratch_spans);
+}
+
+/**
+ * @brief Apply one frame delta straight to the animated layer
+ * @param delta Delta from the frame on display to the next one
+ * @details Each run is one span write and one recomposite, so playback
+ * touches exactly the cells that change between frames.
+ */
+static void timeline_show_delta(const FrameDelta *delta) {
+    CellBuffer *buf = &g_app.layers[g_app.timeline.layer].buf;
+    const Cell *src = delta->cells;
+    
+    for (int i = 0; i < delta->run_count; ++i) {
+        const DeltaRun *run = &delta->runs[i];
+        buffer_write_span(buf, run->y, run->x, run->len, src, false);
+        recomposite_span(run->y, run->x, run->x + run->len - 1);
+        src += run->len;
+    }
+}
+
+/**
+ * @brief Store edits made to the animated layer into the current frame
+ * @return true on success (including when nothing changed)
+ * 
+ * @details
+ * Re-encodes the current frame's delta against the previous frame and the
+ * next frame's delta against the edited contents, so the rest of the
+ * chain stays valid.
+ */
+static bool timeline_commit(void) {
+    Timeline *tl = &g_app.timeline;
+    size_t bytes = (size_t)g_app.canvas_width * (size_t)g_app.canvas_height * sizeof(Cell);
+    
+    timeline_snapshot(tl->scratch);
+    if (memcmp(tl->scratch, tl->shown, bytes) == 0) return true;
+    
+    // tl->shown becomes the next frame, re-based on the edited contents
+    if (tl->current + 1 < tl->count) {
+        delta_apply(&tl->frames[tl->current + 1], tl->shown);
+        if (!delta_encode(tl->scratch, tl->shown, &tl->frames[tl->current + 1])) return false;
+    }
+    if (!delta_encode(tl->onion, tl->scratch, &tl->frames[tl->current])) return false;
+    
+    memcpy(tl->shown, tl->scratch, bytes);
+    return true;
+}
+
+/**
+ * @brief Check whether the onion skin should be drawn
+ * @return true when the previous frame is shown under the current one
+ */
+static inline bool onion_visible(void) {
+    const Timeline *tl = &g_app.timeline;
+    return tl->count > 0 && tl->onion_skin && !tl->playing &&
+           g_app.layers[tl->layer].visible;
+}
+
+/**
+ * @brief Get the onion skin cell at a position
+ * @param x Canvas X coordinate (must be valid)
+ * @param y Canvas Y coordinate (must be valid)
+ * @return Previous frame's cell, or NULL when nothing should be drawn
+ */
+static const Cell* onion_cell(int x, int y) {
+    if (!onion_visible()) return NULL;
+    
+    const Cell *cell = &g_app.timeline.onion[(size_t)y * g_app.canvas_width + x];
+    return cell_is_blank(cell) ? NULL : cell;
+}
+
+/**
+ * @brief Rebuild and display a frame from the start of the timeline
+ * @param index Frame index (must be valid)
+ */
+static void timeline_load(int index) {
+    Timeline *tl = &g_app.timeline;
+    size_t bytes = (size_t)g_app.canvas_width * (size_t)g_app.canvas_height * sizeof(Cell);
+    
+    if (index > 0) {
+        timeline_reconstruct(index - 1, tl->onion);
+    } else {
+        timeline_blank(tl->onion);
+    }
+    memcpy(tl->shown, tl->onion, bytes);
+    delta_apply(&tl->frames[index], tl->shown);
+    timeline_show(tl->shown);
+    tl->current = index;
+}
+
+/**
+ * @brief Display a frame of the timeline
+ * @param index Frame index (must be valid)
+ * @details Stepping to the next frame applies its delta directly; any
+ * other jump rebuilds the previous frame for the onion skin and shows the
+ * target through timeline_show().
+ */
+static void timeline_goto(int index) {
+    Timeline *tl = &g_app.timeline;
+    size_t bytes = (size_t)g_app.canvas_width * (size_t)g_app.canvas_height * sizeof(Cell);
+    
+    if (index == tl->current + 1) {
+        memcpy(tl->onion, tl->shown, bytes);
+        delta_apply(&tl->frames[index], tl->shown);
+        timeline_show_delta(&tl->frames[index]);
+        tl->current = index;
+    } else {
+        timeline_load(index);
+    }
+    
+    if (onion_visible()) {
+        mark_dirty(0, 0, g_app.canvas_width - 1, g_app.canvas_height - 1);
+    }
+}
+
+/**
+ * @brief Make sure the frame array can hold one more frame
+ * @return true on success
+ */
+static bool timeline_reserve(void) {
+    Timeline *tl = &g_app.timeline;
+    if (tl->count < tl->capacity) return true;
+    
+    int capacity = tl->capacity ? tl->capacity * 2 : 16;
+    FrameDelta *frames = realloc(tl->frames, (size_t)capacity * sizeof(FrameDelta));
+    if (!frames) return false;
+    
+    tl->frames = frames;
+    tl->capacity = capacity;
+    return true;
+}
+
+/**
+ * @brief Start a timeline on the active layer, its contents as frame 1
+ * @return true on success
+ */
+static bool timeline_start(void) {
+    Timeline *tl = &g_app.timeline;
+    size_t cells = (size_t)g_app.canvas_width * (size_t)g_app.canvas_height;
+    
+    tl->layer = g_app.active_layer;
+    tl->shown = malloc(cells * sizeof(Cell));
+    tl->onion = malloc(cells * sizeof(Cell));
+    tl->scratch = malloc(cells * sizeof(Cell));
+    if (!tl->shown || !tl->onion || !tl->scratch || !timeline_reserve()) {
+        timeline_free();
+        return false;
+    }
+    
+    timeline_blank(tl->onion);
+    timeline_snapshot(tl->shown);
+    memset(&tl->frames[0], 0, sizeof(FrameDelta));
+    tl->count = 1;
+    tl->current = 0;
+    if (!delta_encode(tl->onion, tl->shown, &tl->frames[0])) {
+        timeline_free();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Free the timeline and all of its frames
+ */
+static void timeline_free(void) {
+    Timeline *tl = &g_app.timeline;
+    
+    for (int i = 0; i < tl->count; ++i) {
+        delta_free(&tl->frames[i]);
+    }
+    free(tl->frames);
+    free(tl->shown);
+    free(tl->onion);
+    free(tl->scratch);
+    
+    int fps = tl->fps;
+    memset(tl, 0, sizeof(*tl));
+    tl->fps = fps;
+}
+
+/**
+ * @brief Insert a copy of the current frame after it and move to the copy
+ * @details The copy starts with an empty delta, and the following frame's
+ * delta stays valid since the contents it was encoded against are the same.
+ */
+static void timeline_add_frame(void) {
+    Timeline *tl = &g_app.timeline;
+    
+    if (tl->count == 0 && !timeline_start()) {
+        set_status_message("Cannot start animation: out of memory");
+        return;
+    }
+    if (!timeline_commit() || !timeline_reserve()) {
+        set_status_message("Cannot add frame: out of memory");
+        return;
+    }
+    
+    int at = tl->current + 1;
+    memmove(&tl->frames[at + 1], &tl->frames[at],
+            (size_t)(tl->count - at) * sizeof(FrameDelta));
+    memset(&tl->frames[at], 0, sizeof(FrameDelta));
+    tl->count++;
+    timeline_goto(at);
+    set_status_message("Added frame %d of %d", at + 1, tl->count);
+}
+
+/**
+ * @brief Remove the current frame
+ * @details The next frame's delta is re-encoded against the previous frame.
+ * Deleting the only frame ends the animation and leaves the layer as is.
+ */
+static void timeline_delete_frame(void) {
+    Timeline *tl = &g_app.timeline;
+    if (tl->count == 0) return;
+    
+    if (tl->count == 1) {
+        timeline_free();
+        mark_dirty(0, 0, g_app.canvas_width - 1, g_app.canvas_height - 1);
+        set_status_message("Animation removed");
+        return;
+    }
+    if (!timeline_commit()) {
+        set_status_message("Cannot delete frame: out of memory");
+        return;
+    }
+    
+    int at = tl->current;
+    if (at + 1 < tl->count) {
+        delta_apply(&tl->frames[at + 1], tl->shown);
+        if (!delta_encode(tl->onion, tl->shown, &tl->frames[at + 1])) {
+            set_status_message("Cannot delete frame: out of memory");
+            return;
+        }
+    }
+    delta_free(&tl->frames[at]);
+    memmove(&tl->frames[at], &tl->frames[at + 1],
+            (size_t)(tl->count - at - 1) * sizeof(FrameDelta));
+    tl->count--;
+    
+    timeline_load(at < tl->count ? at : tl->count - 1);
+    if (onion_visible()) {
+        mark_dirty(0, 0, g_app.canvas_width - 1, g_app.canvas_height - 1);
+    }
+    set_status_message("Deleted frame %d", at + 1);
+}
+
+/**
+ * @brief Move to a neighbouring frame
+ * @param step +1 for the next frame, -1 for the previous one (wraps around)
+ */
+static void timeline_step(int step) {
+    Timeline *tl = &g_app.timeline;
+    if (tl->count == 0) {
+        set_status_message("No animation: press A to add a frame");
+        return;
+    }
+    if (!timeline_commit()) {
+        set_status_message("Cannot store frame: out of memory");
+        return;
+    }
+    timeline_goto((tl->current + step + tl->count) % tl->count);
+}
+
+/**
+ * @brief Toggle the onion skin (previous frame drawn dimmed)
+ */
+static void timeline_toggle_onion(void) {
+    g_app.timeline.onion_skin = !g_app.timeline.onion_skin;
+    mark_dirty(0, 0, g_app.canvas_width - 1, g_app.canvas_height - 1);
+}
+
+/**
+ * @brief Start or stop playback
+ */
+static void timeline_toggle_play(void) {
+    Timeline *tl = &g_app.timeline;
+    
+    if (tl->playing) {
+        tl->playing = false;
+    } else if (tl->count < 2) {
+        set_status_message("Nothing to play: add frames with A");
+        return;
+    } else if (!timeline_commit()) {
+        set_status_message("Cannot store frame: out of memory");
+        return;
+    } else {
+        tl->playing = true;
+        tl->next_us = now_usec();
+    }
+    
+    // Onion skin is hidden during playback
+    if (tl->onion_skin) {
+        mark_dirty(0, 0, g_app.canvas_width - 1, g_app.canvas_height - 1);
+    }
+}
+
+/**
+ * @brief Time until the next playback frame is due
+ * @return Milliseconds, or -1 when not playing
+ */
+static int timeline_wait_ms(void) {
+    const Timeline *tl = &g_app.timeline;
+    if (!tl->playing) return -1;
+    
+    int64_t remaining = tl->next_us - now_usec();
+    if (remaining <= 0) return 0;
+    return (int)((remaining + 999) / 1000);
+}
+
+/**
+ * @brief Advance playback if the next frame is due
+ * @return true if the canvas changed
+ * @details Playback follows the animation's own rate; the frame scheduler
+ * still decides when the changes reach the terminal. A late frame resets
+ * the schedule instead of bursting to catch up.
+ */
+static bool timeline_tick(void) {
+    Timeline *tl = &g_app.timeline;
+    if (!tl->playing) return false;
+    
+    int64_t now = now_usec();
+    if (now < tl->next_us) return false;
+    
+    // Frames are only read during playback, so nothing needs committing
+    timeline_goto((tl->current + 1) % tl->count);
+    
+    int64_t interval = 1000000 / tl->fps;
+    tl->next_us += interval;
+    if (tl->next_us <= now) tl->next_us = now + interval;
+    return true;
+}
+
+/*==============================================================================
+ * MEMORY-MAPPED DOCUMENTS
+ *============================================================================*/
+
+/**
+ * @brief Create an empty binary canvas document
+ * @param filename New file (must not exist)
+ * @param width Document width in cells
+ * @param height Document height in cells
+ * @return true on success
+ * @details The cell section is left to ftruncate(), so it occupies no disk
+ * space until written; zero cells read as blank.
+ */
+static bool document_create(const char *filename, int width, int height) {
+    BinaryHeader header = binary_header(width, height, make_cell(' ', 7));
+    
+    int fd = open(filename, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if (fd < 0) return false;
+    
+    RowSpan *rows = malloc((size_t)height * sizeof(RowSpan));
+    bool ok = rows != NULL;
+    for (int y = 0; ok && y < height; ++y) {
+        rows[y] = (RowSpan){ -1, -1, 0 };
+    }
+    
+    size_t rows_size = (size_t)height * sizeof(RowSpan);
+    off_t size = (off_t)header.cells_offset + (off_t)width * height * (off_t)sizeof(Cell);
+    ok = ok && pwrite(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+         pwrite(fd, rows, rows_size, header.rows_offset) == (ssize_t)rows_size &&
+         ftruncate(fd, size) == 0;
+    
+    free(rows);
+    if (close(fd) != 0) ok = false;
+    if (!ok) unlink(filename);
+    return ok;
+}
+
+/**
+ * @brief Map a binary canvas document for reading and writing
+ * @param doc Document to fill
+ * @param filename Binary canvas file
+ * @param err Out: reason on failure
+ * @param err_size Size of err
+ * @return true on success
+ * 
+ * @details
+ * Only the header is read and checked; cells are paged in by the kernel
+ * as the viewport touches them, so opening costs the same for any size.
+ */
+static bool document_map(Document *doc, const char *filename, char *err, size_t err_size) {
+    memset(doc, 0, sizeof(*doc));
+    
+    int fd = open(filename, O_RDWR);
+    if (fd < 0) {
+        report_error(err, err_size, "%s", strerror(errno));
+        return false;
+    }
+    
+    BinaryHeader header;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+        report_error(err, err_size, "truncated header");
+        close(fd);
+        return false;
+    }
+    if (!binary_header_valid(&header, (uint64_t)st.st_size, err, err_size)) {
+        close(fd);
+        return false;
+    }
+    
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        report_error(err, err_size, "mmap: %s", strerror(errno));
+        close(fd);
+        return false;
+    }
+    
+    doc->fd = fd;
+    doc->map = map;
+    doc->map_size = (size_t)st.st_size;
+    doc->header = map;
+    doc->rows = (RowSpan *)((char *)map + header.rows_offset);
+    doc->cells = (Cell *)((char *)map + header.cells_offset);
+    doc->width = (int)header.width;
+    doc->height = (int)header.height;
+    doc->dirty_top = doc->height;
+    doc->dirty_bottom = -1;
+    snprintf(doc->name, sizeof(doc->name), "%s", filename);
+    return true;
+}
+
+/**
+ * @brief Rebuild the stored occupancy index of one document row
+ * @param doc Document
+ * @param y Document row
+ */
+static void document_index_row(Document *doc, int y) {
+    const Cell *row = &doc->cells[(size_t)y * doc->width];
+    RowSpan span = { -1, -1, 0 };
+    
+    for (int x = 0; x < doc->width; ++x) {
+        if (cell_is_blank(&row[x])) continue;
+        if (span.count++ == 0) span.first = x;
+        span.last = x;
+    }
+    doc->rows[y] = span;
+}
+
+/**
+ * @brief Fold rows written through the viewport into the stored index
+ * @details Called before the viewport moves and when syncing, so the stored
+ * index is current for every row outside the viewport.
+ */
+static void document_fold_touched(void) {
+    Document *doc = &g_app.document;
+    CellBuffer *buf = &g_app.layers[0].buf;
+    
+    for (int y = buf->touched_top; y <= buf->touched_bottom; ++y) {
+        document_index_row(doc, doc->view_y + y);
+    }
+    if (buf->touched_top <= buf->touched_bottom) {
+        int top = doc->view_y + buf->touched_top;
+        int bottom = doc->view_y + buf->touched_bottom;
+        if (top < doc->dirty_top) doc->dirty_top = top;
+        if (bottom > doc->dirty_bottom) doc->dirty_bottom = bottom;
+    }
+    buf->touched_top = g_app.canvas_height;
+    buf->touched_bottom = -1;
+}
+
+/**
+ * @brief Point the base layer at the document window under the viewport
+ * @details The layer's cells alias the mapping with the document width as
+ * row stride. Viewport occupancy comes from the stored index; only rows it
+ * marks as used are scanned, and only within the viewport's columns. The
+ * composite is then rebuilt, queueing just the cells that changed.
+ */
+static void document_attach_view(void) {
+    Document *doc = &g_app.document;
+    CellBuffer *buf = &g_app.layers[0].buf;
+    int width = g_app.canvas_width;
+    
+    buf->cells = &doc->cells[(size_t)doc->view_y * doc->width + doc->view_x];
+    buf->stride = doc->width;
+    buf->mapped = true;
+    buf->blank = doc->header->blank;
+    buf->touched_top = g_app.canvas_height;
+    buf->touched_bottom = -1;
+    
+    for (int y = 0; y < g_app.canvas_height; ++y) {
+        RowSpan stored = doc->rows[doc->view_y + y];
+        RowSpan span = { -1, -1, 0 };
+        
+        if (stored.count > 0) {
+            int from = stored.first > doc->view_x ? stored.first - doc->view_x : 0;
+            int to = stored.last - doc->view_x < width - 1 ? stored.last - doc->view_x : width - 1;
+            const Cell *row = buffer_row(buf, y);
+            
+            for (int x = from; x <= to; ++x) {
+                if (cell_is_blank(&row[x])) continue;
+                if (span.count++ == 0) span.first = x;
+                span.last = x;
+            }
+        }
+        buf->rows[y] = span;
+        buf->row_gen[y] = buf->gen;
+        g_app.scratch_spans[y] = (RowSpan){ 0, width - 1, 1 };
+    }
+    recomposite_rows(g_app.scratch_spans);
+}
+
+/**
+ * @brief Move the viewport across the document
+ * @param dx Requested columns to scroll
+ * @param dy Requested rows to scroll
+ * @param moved_x Out: columns actually scrolled (clamped to the document)
+ * @param moved_y Out: rows actually scrolled
+ */
+static void document_scroll(int dx, int dy, int *moved_x, int *moved_y) {
+    Document *doc = &g_app.document;
+    *moved_x = *moved_y = 0;
+    
+    // Frames are stored in viewport coordinates
+    if (g_app.timeline.count > 0 && g_app.timeline.layer == 0) {
+        set_status_message("Cannot scroll while the document layer is animated");
+        return;
+    }
+    
+    int x = doc->view_x + dx, y = doc->view_y + dy;
+    if (x > doc->width - g_app.canvas_width) x = doc->width - g_app.canvas_width;
+    if (y > doc->height - g_app.canvas_height) y = doc->height - g_app.canvas_height;
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    if (x == doc->view_x && y == doc->view_y) return;
+    
+    document_fold_touched();
+    *moved_x = x - doc->view_x;
+    *moved_y = y - doc->view_y;
+    doc->view_x = x;
+    doc->view_y = y;
+    document_attach_view();
+}
+
+/**
+ * @brief Flush document edits to disk
+ * @return true on success
+ * @details Brings the stored index up to date, then msync()s only the
+ * index entries and cell pages of rows written since the last sync.
+ */
+static bool document_sync(void) {
+    Document *doc = &g_app.document;
+    
+    document_fold_touched();
+    doc->header->blank = g_app.layers[0].buf.blank;
+    
+    // New glyphs and styles extend the tables at the end of the file, past the mapping
+    bool grew = (uint32_t)g_app.glyphs.count > doc->header->glyph_count ||
+                (uint32_t)g_app.styles.count > doc->header->style_count;
+    if (grew && !binary_append_tables(doc->fd, doc->width, doc->height,
+                                      (int)doc->header->glyph_count,
+                                      (int)doc->header->style_count)) {
+        return false;
+    }
+    
+    bool dirty = doc->dirty_top <= doc->dirty_bottom;
+    g_app.save.skipped = !dirty && !grew;
+    if (g_app.save.skipped) return true;
+    
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    size_t row_bytes = (size_t)doc->width * sizeof(Cell);
+    struct { const void *from, *to; } ranges[] = {
+        { doc->header, doc->header + 1 },
+        { &doc->rows[doc->dirty_top], &doc->rows[doc->dirty_bottom + 1] },
+        { (const char *)doc->cells + (size_t)doc->dirty_top * row_bytes,
+          (const char *)doc->cells + (size_t)(doc->dirty_bottom + 1) * row_bytes },
+    };
+    
+    bool ok = true;
+    for (size_t i = 0; i < (dirty ? sizeof(ranges) / sizeof(ranges[0]) : 1); ++i) {
+        uintptr_t from = (uintptr_t)ranges[i].from & ~(page - 1);
+        uintptr_t to = (uintptr_t)ranges[i].to;
+        if (msync((void *)from, to - from, MS_SYNC) != 0) ok = false;
+    }
+    
+    if (ok) {
+        doc->dirty_top = doc->height;
+        doc->dirty_bottom = -1;
+    }
+    return ok;
+}
+
+/**
+ * @brief Sync and unmap the open document, if any
+ * @details The base layer must still be attached so pending rows can be
+ * folded into the index; canvas_release() calls this before freeing it.
+ */
+static void document_close(void) {
+    Document *doc = &g_app.document;
+    if (!doc->map) return;
+    
+    document_sync();
+    minimap_free();
+    munmap(doc->map, doc->map_size);
+    close(doc->fd);
+    
+    CellBuffer *buf = &g_app.layers[0].buf;
+    buf->cells = NULL;
+    buf->mapped = false;
+    memset(doc, 0, sizeof(*doc));
+}
+
+/**
+ * @brief Make the glyph table match a document's, so its cells need no remapping
+ * @param doc Mapped document
+ * @return false if the document's table is invalid or has duplicates
+ * @note Only safe once no cell refers to an interned ID (after canvas_release())
+ */
+static bool document_load_glyphs(const Document *doc) {
+    const uint32_t *codes = (const uint32_t *)((const char *)doc->map +
+                                               binary_glyphs_offset(doc->width, doc->height));
+    glyph_table_free();
+    for (uint32_t i = 0; i < doc->header->glyph_count; ++i) {
+        if (codes[i] < GLYPH_DIRECT || glyph_intern(codes[i]) != GLYPH_DIRECT + i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Make the style table match a document's, so its cells need no remapping
+ * @param doc Mapped document
+ * @return false if the document's table is invalid or has duplicates
+ * @note Only safe once no cell refers to an interned ID (after canvas_release())
+ */
+static bool document_load_styles(const Document *doc) {
+    const Style *styles = (const Style *)((const char *)doc->map +
+                                          binary_styles_offset(doc->width, doc->height,
+                                                               doc->header->glyph_count));
+    style_table_free();
+    for (uint32_t i = 0; i < doc->header->style_count; ++i) {
+        if (!color_spec_valid(styles[i].fg) || !color_spec_valid(styles[i].bg) ||
+            style_intern(styles[i]) != STYLE_DIRECT + i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Open a document as the base layer, sized to the terminal
+ * @param filename Binary canvas file
+ * @return true on success
+ */
+static bool open_document(const char *filename) {
+    Document doc;
+    char err[BATCH_MESSAGE_SIZE];
+    if (!document_map(&doc, filename, err, sizeof(err))) {
+        set_status_message("Cannot open '%s': %s", filename, err);
+        return false;
+    }
+    
+    int avail_width = COLS;
+    int avail_height = LINES - (STATUS_LINES_TOP + STATUS_LINES_BOTTOM);
+    Style current = style_of(g_app.current_color);
+    canvas_release();
+    bool glyphs_ok = document_load_glyphs(&doc);
+    bool styles_ok = glyphs_ok && document_load_styles(&doc);
+    if (!styles_ok ||
+        !canvas_allocate(doc.width < avail_width ? doc.width : avail_width,
+                         doc.height < avail_height ? doc.height : avail_height)) {
+        munmap(doc.map, doc.map_size);
+        close(doc.fd);
+        glyph_table_free();
+        style_table_free();
+        g_app.current_color = style_intern(current);
+        canvas_fit();
+        set_status_message("Cannot open '%s': %s", filename,
+                           !glyphs_ok ? "bad glyph table" :
+                           !styles_ok ? "bad style table" : "out of memory");
+        return false;
+    }
+    
+    // The current colors keep their meaning under the document's style IDs
+    g_app.current_color = style_intern(current);
+    
+    // The base layer's own cells are replaced by the mapping
+    free(g_app.layers[0].buf.cells);
+    g_app.document = doc;
+    document_attach_view();
+    
+    g_app.cursor_x = g_app.canvas_width / 2;
+    g_app.cursor_y = g_app.canvas_height / 2;
+    erase();
+    paint_entire_canvas();
+    return true;
+}
+
+/*==============================================================================
+ * COLOR PAIRS
+ *============================================================================*/
+
+/**
+ * @brief Get the terminal color number that shows a color best
+ * @param color Palette index or RGB color
+ * @return Color number for init_extended_pair()
+ * @details Direct-color terminals take RGB values as color numbers (below
+ * 8 they are the ANSI colors); others get the nearest entry of the
+ * palette they have.
+ */
+static int terminal_color(ColorSpec color) {
+    int colors = g_app.pairs.colors;
+    unsigned char rgb[3];
+    
+    if (colors >= (int)COLOR_RGB) {
+        if (color < COLOR_COUNT) return (int)color;
+        palette_rgb(color, rgb);
+        int value = rgb[0] << 16 | rgb[1] << 8 | rgb[2];
+        return value < COLOR_COUNT ? COLOR_BLACK : value;
+    }
+    if (color < (ColorSpec)colors) return (int)color;
+    
+    palette_rgb(color, rgb);
+    return nearest_palette(rgb, colors >= PALETTE_SIZE ? PALETTE_SIZE :
+                                colors >= ANSI_COLOR_COUNT ? ANSI_COLOR_COUNT : COLOR_COUNT);
+}
+
+/**
+ * @brief Remove a pair from an LRU list
+ * @param list List holding the pair
+ * @param pair Pair number
+ */
+static void pair_list_unlink(PairList *list, int pair) {
+    PairSlot *slots = g_app.pairs.slots;
+    PairSlot *slot = &slots[pair];
+    
+    if (slot->prev) slots[slot->prev].next = slot->next; else list->head = slot->next;
+    if (slot->next) slots[slot->next].prev = slot->prev; else list->tail = slot->prev;
+    slot->prev = slot->next = 0;
+}
+
+/**
+ * @brief Insert a pair at the head (most recently used end) of an LRU list
+ * @param list List
+ * @param pair Pair number, not on any list
+ */
+static void pair_list_push(PairList *list, int pair) {
+    PairSlot *slots = g_app.pairs.slots;
+    
+    slots[pair].prev = 0;
+    slots[pair].next = list->head;
+    if (list->head) slots[list->head].prev = pair; else list->tail = pair;
+    list->head = pair;
+}
+
+/**
+ * @brief Set up the pair cache after the base pairs are initialized
+ * @details Every pair above the base ones starts unbound on the idle list.
+ * Without the memory for the lookup arrays, extended styles are drawn in
+ * their nearest base color.
+ */
+static void pair_cache_init(void) {
+    PairCache *pc = &g_app.pairs;
+    int last = COLOR_PAIRS - 1 < PAIR_LIMIT ? COLOR_PAIRS - 1 : PAIR_LIMIT;
+    
+    pc->colors = COLORS;
+    pc->first = COLOR_COUNT + 1;
+    pc->last = pc->first - 1;
+    pc->pair_of = calloc(STYLE_MAX, sizeof(uint16_t));
+    pc->repair = calloc(STYLE_MAX, sizeof(uint8_t));
+    pc->slots = last >= pc->first ? calloc((size_t)last + 1, sizeof(PairSlot)) : NULL;
+    if (!pc->pair_of || !pc->repair || !pc->slots) return;
+    
+    pc->last = last;
+    for (int pair = pc->first; pair <= pc->last; ++pair) {
+        pair_list_push(&pc->idle, pair);
+    }
+}
+
+/**
+ * @brief Release the pair cache
+ */
+static void pair_cache_free(void) {
+    PairCache *pc = &g_app.pairs;
+    free(pc->pair_of);
+    free(pc->repair);
+    free(pc->slots);
+    free(pc->screen);
+    memset(pc, 0, sizeof(*pc));
+}
+
+/**
+ * @brief Unbind every pair from its style
+ * @details For when style IDs are reassigned (style_table_free()). The
+ * screen must be repainted afterwards.
+ */
+static void pair_cache_forget(void) {
+    PairCache *pc = &g_app.pairs;
+    if (!pc->pair_of) return;
+    
+    memset(pc->pair_of, 0, STYLE_MAX * sizeof(uint16_t));
+    memset(pc->repair, 0, STYLE_MAX * sizeof(uint8_t));
+    for (int pair = pc->first; pair <= pc->last; ++pair) {
+        pc->slots[pair].bound = false;
+    }
+}
+
+/**
+ * @brief Record that the whole canvas area was wiped with one pair
+ * @param pair Pair of the blank cells now on screen
+ * @details Called when the canvas area is cleared; every managed pair
+ * loses its cells except the blank one, which now covers the area.
+ */
+static void pair_cache_reset_screen(int pair) {
+    PairCache *pc = &g_app.pairs;
+    if (pc->last < pc->first) return;
+    
+    int width = g_app.canvas_width, height = g_app.canvas_height;
+    if (pc->screen_width != width || pc->screen_height != height) {
+        free(pc->screen);
+        pc->screen = malloc((size_t)width * (size_t)height * sizeof(uint16_t));
+        pc->screen_width = pc->screen ? width : 0;
+        pc->screen_height = pc->screen ? height : 0;
+    }
+    
+    while (pc->shown.tail) {
+        int p = pc->shown.tail;
+        pair_list_unlink(&pc->shown, p);
+        pair_list_push(&pc->idle, p);
+        pc->slots[p].shown = 0;
+    }
+    if (!pc->screen) return;
+    
+    for (size_t i = 0; i < (size_t)width * (size_t)height; ++i) {
+        pc->screen[i] = (uint16_t)pair;
+    }
+    if (pair >= pc->first) {
+        PairSlot *slot = &pc->slots[pair];
+        pair_list_unlink(&pc->idle, pair);
+        pair_list_push(&pc->shown, pair);
+        slot->shown = width * height;
+        slot->x0 = slot->y0 = 0;
+        slot->x1 = width - 1;
+        slot->y1 = height - 1;
+    }
+}
+
+/**
+ * @brief Note which pair a canvas cell was just drawn with
+ * @param pair Pair number
+ * @param x Canvas X coordinate
+ * @param y Canvas Y coordinate
+ * @details Keeps each managed pair's count and bounding box of on-screen
+ * cells, and moves it to the head of the shown list. Constant time.
+ */
+static void pair_cache_track(int pair, int x, int y) {
+    PairCache *pc = &g_app.pairs;
+    if (x < 0 || y < 0 || x >= pc->screen_width || y >= pc->screen_height) return;
+    
+    uint16_t *at = &pc->screen[(size_t)y * pc->screen_width + x];
+    int old = *at;
+    if (old != pair && old >= pc->first) {
+        PairSlot *slot = &pc->slots[old];
+        if (--slot->shown == 0) {
+            pair_list_unlink(&pc->shown, old);
+            pair_list_push(&pc->idle, old);
+        }
+    }
+    *at = (uint16_t)pair;
+    if (pair < pc->first) return;
+    
+    PairSlot *slot = &pc->slots[pair];
+    pair_list_unlink(slot->shown > 0 ? &pc->shown : &pc->idle, pair);
+    pair_list_push(&pc->shown, pair);
+    if (old == pair) return;
+    
+    if (slot->shown++ == 0) {
+        slot->x0 = slot->x1 = x;
+        slot->y0 = slot->y1 = y;
+    } else {
+        if (x < slot->x0) slot->x0 = x;
+        if (x > slot->x1) slot->x1 = x;
+        if (y < slot->y0) slot->y0 = y;
+        if (y > slot->y1) slot->y1 = y;
+    }
+}
+
+/**
+ * @brief Bind a pair to a style that has none
+ * @param id Style ID
+ * @return Pair number to draw the style with
+ * 
+ * @details
+ * Styles the terminal shows as a base color on black use that base pair.
+ * Otherwise the least recently used idle pair is rebound; failing that,
+ * the least recently drawn shown pair is, and the cells still drawn with
+ * it are marked dirty so they are redrawn in their own colors. A style
+ * that lost its pair that way does not take another shown pair when it is
+ * redrawn (it falls back to the nearest base color until a pair goes
+ * idle), so more styles on screen than pairs cannot cascade into endless
+ * redraws.
+ */
+static int pair_bind(StyleId id) {
+    PairCache *pc = &g_app.pairs;
+    Style style = style_of(id);
+    int fg = terminal_color(style.fg), bg = terminal_color(style.bg);
+    
+    if (bg == COLOR_BLACK && fg < COLOR_COUNT) {
+        pc->pair_of[id] = (uint16_t)(fg + 1);
+        return fg + 1;
+    }
+    
+    int pair = pc->idle.tail;
+    if (!pair && pc->shown.tail && !pc->repair[id]) {
+        pair = pc->shown.tail;
+        PairSlot *victim = &pc->slots[pair];
+        if (victim->bound) pc->repair[victim->style] = 1;
+        mark_dirty(victim->x0, victim->y0, victim->x1, victim->y1);
+        pc->evictions++;
+    }
+    
+    bool ok = pair != 0;
+#if defined(NCURSES_EXT_COLORS)
+    ok = ok && init_extended_pair(pair, fg, bg) != ERR;
+#else
+    ok = ok && fg <= SHRT_MAX && bg <= SHRT_MAX && init_pair((short)pair, (short)fg, (short)bg) != ERR;
+#endif
+    if (!ok) {
+        unsigned char rgb[3];
+        palette_rgb(style.fg, rgb);
+        return nearest_palette(rgb, COLOR_COUNT) + 1;
+    }
+    
+    PairSlot *slot = &pc->slots[pair];
+    if (slot->bound) pc->pair_of[slot->style] = 0;
+    slot->style = id;
+    slot->bound = true;
+    pc->pair_of[id] = (uint16_t)pair;
+    pc->repair[id] = 0;
+    return pair;
+}
+
+/**
+ * @brief Get the color pair to draw a canvas cell's style with
+ * @param id Style ID
+ * @param x Canvas X coordinate of the cell (-1 for none)
+ * @param y Canvas Y coordinate of the cell
+ * @return Pair number
+ * @details An array lookup when the style already has a pair; binding a
+ * new one is also constant time.
+ */
+static int style_pair(StyleId id, int x, int y) {
+    PairCache *pc = &g_app.pairs;
+    if (id < STYLE_DIRECT || pc->last < pc->first) {
+        if (id >= STYLE_DIRECT) {
+            unsigned char rgb[3];
+            palette_rgb(style_of(id).fg, rgb);
+            id = (StyleId)nearest_palette(rgb, COLOR_COUNT);
+        }
+        pair_cache_track(id + 1, x, y);
+        return id + 1;
+    }
+    
+    int pair = pc->pair_of[id];
+    if (pair == 0) pair = pair_bind(id);
+    pair_cache_track(pair, x, y);
+    return pair;
+}
+
+/*==============================================================================
+ * RENDERING SYSTEM
+ *============================================================================*/
+
+/**
+ * @brief Draw one glyph at a screen position with the current attributes
+ * @param screen_y Screen row
+ * @param screen_x Screen column
+ * @param glyph Glyph ID
+ * @details ASCII takes the narrow mvaddch() path. Anything else goes
+ * through the wide-character API; glyphs that are not exactly one column
+ * wide in the current locale (wide, combining or unprintable) show as '?'
+ * so they cannot shift the rest of the row.
+ */
+static void draw_glyph(int screen_y, int screen_x, GlyphId glyph) {
+    uint32_t code = glyph_code(glyph);
+    if (code < 0x80) {
+        mvaddch(screen_y, screen_x, code ? (chtype)code : ' ');
+        return;
+    }
+    
+    wchar_t wide[2] = { (wchar_t)code, L'\0' };
+    if (wcwidth(wide[0]) != 1) wide[0] = L'?';
+    cchar_t cc;
+    setcchar(&cc, wide, A_NORMAL, 0, NULL);
+    mvadd_wch(screen_y, screen_x, &cc);
+}
+
+/**
+ * @brief Render a single canvas cell to the screen
+ * @param x Canvas X coordinate
+ * @param y Canvas Y coordinate
+ */
+static void render_stuff(int x, int y) {
+    const Cell *cell = peek_spot(x, y);
+    if (!cell) return;
+    
+    int screen_y = canvas_to_screen_y(y);
+    int screen_x = canvas_to_screen_x(x);
+    
+    // Onion skin shows through blank cells, dimmed
+    const Cell *ghost = cell_is_blank(cell) ? onion_cell(x, y) : NULL;
+    if (ghost) {
+        attr_set(A_DIM, (short)style_pair(ghost->color, x, y), NULL);
+        draw_glyph(screen_y, screen_x, ghost->glyph);
+        attrset(A_NORMAL);
+        return;
+    }
+    
+    // Set color attributes
+    attr_set(A_NORMAL, (short)style_pair(cell->color, x, y), NULL);
+    draw_glyph(screen_y, screen_x, cell->glyph);
+    attrset(A_NORMAL);
+}
+
+/**
+ * @brief Blank the canvas area of the screen with a single clrtobot()
+ * @note Also wipes the bottom status line, which refresh_view() redraws
+ */
+static void erase_canvas_area(void) {
+    cchar_t old_bkgd, bkgd;
+    int pair = style_pair(g_app.canvas.blank.color, -1, -1);
+    
+    getbkgrnd(&old_bkgd);
+    setcchar(&bkgd, L" ", A_NORMAL, (short)pair, NULL);
+    bkgrndset(&bkgd);
+    move(canvas_to_screen_y(0), canvas_to_screen_x(0));
+    clrtobot();
+    bkgrndset(&old_bkgd);
+    pair_cache_reset_screen(pair);
+}
+
+/**
+ * @brief Render the entire canvas to the screen
+ * @details The canvas area is wiped first, so only the occupied span of
+ * each row needs drawing; empty and stale rows are skipped entirely.
+ */
+static void paint_entire_canvas(void) {
+    erase_canvas_area();
+    
+    for (int y = 0; y < g_app.canvas_height; ++y) {
+        RowSpan span = row_occupancy(y);
+        for (int x = span.first; span.count > 0 && x <= span.last; ++x) {
+            render_stuff(x, y);
+        }
+    }
+    
+    if (g_app.timeline.onion_skin) {
+        mark_dirty(0, 0, g_app.canvas_width - 1, g_app.canvas_height - 1);
+    }
+}
+
+/**
+ * @brief Mark a rectangle of the canvas for redraw at the next frame
+ * @param x0 Left column
+ * @param y0 Top row
+ * @param x1 Right column (inclusive)
+ * @param y1 Bottom row (inclusive)
+ * @details The rectangle is clipped to the canvas and merged into the
+ * per-row dirty spans.
+ */
+static void mark_dirty(int x0, int y0, int x1, int y1) {
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 >= g_app.canvas_width) x1 = g_app.canvas_width - 1;
+    if (y1 >= g_app.canvas_height) y1 = g_app.canvas_height - 1;
+    if (x0 > x1 || y0 > y1) return;
+    
+    for (int y = y0; y <= y1; ++y) {
+        RowSpan *span = &g_app.dirty_rows[y];
+        if (span->count == 0) {
+            *span = (RowSpan){ x0, x1, 1 };
+        } else {
+            if (x0 < span->first) span->first = x0;
+            if (x1 > span->last) span->last = x1;
+        }
+    }
+    if (y0 < g_app.dirty_top) g_app.dirty_top = y0;
+    if (y1 > g_app.dirty_bottom) g_app.dirty_bottom = y1;
+}
+
+/**
+ * @brief Redraw every dirty span and reset the dirty set
+ */
+static void flush_dirty(void) {
+    for (int y = g_app.dirty_top; y <= g_app.dirty_bottom; ++y) {
+        RowSpan *span = &g_app.dirty_rows[y];
+        if (span->count == 0) continue;
+        
+        for (int x = span->first; x <= span->last; ++x) {
+            render_stuff(x, y);
+        }
+        span->count = 0;
+    }
+    g_app.dirty_top = g_app.canvas_height;
+    g_app.dirty_bottom = -1;
+}
+
+/**
+ * @brief Render or hide the cursor highlight
+ * @param show true to show cursor, false to hide
+ */
+static void show_or_hide_cursor(bool show) {
+    const Cell *cell = peek_spot(g_app.cursor_x, g_app.cursor_y);
+    if (!cell) return;
+    
+    int screen_y = canvas_to_screen_y(g_app.cursor_y);
+    int screen_x = canvas_to_screen_x(g_app.cursor_x);
+    
+    if (show) {
+        // Highlight cursor with reverse video
+        attr_set(A_REVERSE, (short)style_pair(cell->color, g_app.cursor_x, g_app.cursor_y), NULL);
+        draw_glyph(screen_y, screen_x, cell->glyph);
+        attrset(A_NORMAL);
+    } else {
+        // Render normally
+        render_stuff(g_app.cursor_x, g_app.cursor_y);
+    }
+}
+
+/**
+ * @brief Append formatted text to a status line being built
+ * @param line Line buffer (NUL-terminated)
+ * @param size Size of line; text that does not fit is cut off
+ * @param fmt Printf-style format
+ */
+static void status_append(char *line, size_t size, const char *fmt, ...) {
+    size_t len = strlen(line);
+    if (len + 1 >= size) return;
+    
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(line + len, size - len, fmt, args);
+    va_end(args);
+}
+
+/**
+ * @brief Draw a status line clipped to the terminal width
+ * @param row Screen row
+ * @param line Text
+ * @details Status text never wraps onto the next row, where it would cover
+ * canvas cells that are not redrawn every frame.
+ */
+static void status_draw(int row, const char *line) {
+    move(row, 0);
+    clrtoeol();
+    mvaddnstr(row, 0, line, COLS);
+}
+
+/**
+ * @brief Render the status bars and help information
+ */
+static void show_status_info(void) {
+    char line[STATUS_LINE_SIZE] = "";
+    
+    // Top status line
+    static const char *shape_names[] = { "square", "round", "stamp", "spray" };
+    char brush_utf8[UTF8_MAX + 1];
+    brush_utf8[utf8_encode(brush_chars[g_app.brush_index], brush_utf8)] = '\0';
+    char color_text[STYLE_TEXT_SIZE];
+    if (g_app.current_color < STYLE_DIRECT) {
+        snprintf(color_text, sizeof(color_text), "%s", color_names[g_app.current_color]);
+    } else {
+        style_format(g_app.current_color, color_text);
+    }
+    status_append(line, sizeof(line),
+                  "Terminal Paint :D  |  Brush: '%s' %s %d  |  Color: %s  |  Pen: %s  |  "
+                  "Canvas: %dx%d  |  Layer: %d/%d%s%s",
+                  brush_utf8,
+                  shape_names[g_app.brush.shape],
+                  g_app.brush.shape == BRUSH_SHAPE_STAMP ? g_app.brush.width : g_app.brush.size,
+                  color_text,
+                  g_app.pen_down ? "DOWN" : "UP",
+                  g_app.canvas_width,
+                  g_app.canvas_height,
+                  g_app.active_layer + 1,
+                  g_app.layer_count,
+                  active_layer()->visible ? "" : " hidden",
+                  active_layer()->locked ? " locked" : "");
+    if (g_app.selection.active) {
+        status_append(line, sizeof(line), "  |  Sel: %dx%d at (%d,%d)",
+                      g_app.selection.x1 - g_app.selection.x0 + 1,
+                      g_app.selection.y1 - g_app.selection.y0 + 1,
+                      g_app.selection.x0, g_app.selection.y0);
+    }
+    if (g_app.symmetry.mode == SYMMETRY_RADIAL) {
+        status_append(line, sizeof(line), "  |  Sym: %d-fold", g_app.symmetry.folds);
+    } else if (g_app.symmetry.mode != SYMMETRY_OFF) {
+        static const char *sym_names[SYMMETRY_MODES] = { "", "horizontal", "vertical", "4-way", "" };
+        status_append(line, sizeof(line), "  |  Sym: %s", sym_names[g_app.symmetry.mode]);
+    }
+    if (g_app.subcell.mode != SUBCELL_OFF) {
+        status_append(line, sizeof(line), "  |  Dots: %s (%d,%d)", subcell_names[g_app.subcell.mode],
+                      g_app.subcell.dot_x + g_app.document.view_x * subcell_dots[g_app.subcell.mode][0],
+                      g_app.subcell.dot_y + g_app.document.view_y * subcell_dots[g_app.subcell.mode][1]);
+    }
+    if (g_app.text.active) {
+        status_append(line, sizeof(line), "  |  Text");
+    }
+    if (g_app.document.map) {
+        status_append(line, sizeof(line), "  |  Doc: %s %dx%d", g_app.document.name,
+                      g_app.document.width, g_app.document.height);
+    }
+    if (g_app.timeline.count > 0) {
+        status_append(line, sizeof(line), "  |  Frame: %d/%d%s%s",
+                      g_app.timeline.current + 1, g_app.timeline.count,
+                      g_app.timeline.onion_skin ? " onion" : "",
+                      g_app.timeline.playing ? " playing" : "");
+    }
+    attrset(A_BOLD);
+    status_draw(0, line);
+    attrset(A_NORMAL);
+
+    // Second status line with the main controls (the README lists every key)
+    line[0] = '\0';
+    status_append(line, sizeof(line),
+                  "Position: (%d,%d)  |  Movement: Arrow keys  |  Paint: Space  |  Pen: Enter  |  "
+                  "Tools: B/C/E/X  |  Colors: 0-7  |  Commands: :  |  File: S/L  |  Quit: Q",
+                  g_app.cursor_x + g_app.document.view_x, g_app.cursor_y + g_app.document.view_y);
+    status_draw(1, line);
+
+    // Bottom help line (or the latest status message)
+    line[0] = '\0';
+    if (g_app.prompt.active) {
+        status_append(line, sizeof(line), ":%s_", g_app.prompt.text);
+        attrset(A_BOLD);
+    } else if (g_app.status_msg[0]) {
+        status_append(line, sizeof(line), "%s", g_app.status_msg);
+        attrset(A_BOLD);
+    } else if (g_app.show_stats) {
+        status_append(line, sizeof(line),
+                      "Queue: %zu (max %zu)  |  Batch: %zu  |  Keys: %lu  |  "
+                      "FPS: %d/%d%s  |  Write: %.1fms (avg %.1fms)  |  Frames: %lu  |  "
+                      "Pairs: %d, %lu evicted",
+                      g_app.stats.queue_depth, g_app.stats.queue_high_water,
+                      g_app.stats.last_batch, g_app.stats.keys_total,
+                      g_app.frames.fps, g_app.frames.max_fps,
+                      g_app.frames.adaptive ? " adaptive" : "",
+                      g_app.frames.last_write_us / 1000.0, g_app.frames.write_avg_us / 1000.0,
+                      g_app.frames.frame_count,
+                      g_app.pairs.last - g_app.pairs.first + 1, g_app.pairs.evictions);
+    } else {
+        status_append(line, sizeof(line),
+                      "Tips: Enter toggles pen mode for continuous painting. "
+                      "Files save to '%s'. Use 0-7 for quick color selection.",
+                      g_app.save.path);
+    }
+    status_draw(LINES - 1, line);
+    attrset(A_NORMAL);
+}
+
+/**
+ * @brief Render the complete frame (status + canvas + cursor)
+ */
+static void refresh_view(void) {
+    show_status_info();
+    if (g_app.minimap.mode == MINIMAP_FULL) {
+        minimap_draw();
+    } else {
+        flush_dirty();
+        show_or_hide_cursor(true);
+        minimap_draw();
+    }
+    refresh();
+}
+
+/*==============================================================================
+ * MINIMAP
+ *============================================================================*/
+
+/**
+ * @brief Get the size of the world the minimap covers
+ * @param width Out: width in cells (the document's when one is open)
+ * @param height Out: height in cells
+ */
+static void minimap_world(int *width, int *height) {
+    *width = g_app.document.map ? g_app.document.width : g_app.canvas_width;
+    *height = g_app.document.map ? g_app.document.height : g_app.canvas_height;
+}
+
+/**
+ * @brief Free the pyramid; it is rebuilt the next time the minimap is drawn
+ * @details Called whenever the counted buffer goes away (canvas released,
+ * document closed). The mode is kept.
+ */
+static void minimap_free(void) {
+    MiniMap *mm = &g_app.minimap;
+    
+    for (int k = 0; k < mm->levels; ++k) {
+        free(mm->count[k]);
+        mm->count[k] = NULL;
+    }
+    mm->levels = 0;
+    mm->source = NULL;
+}
+
+/**
+ * @brief Adjust the counts of the blocks containing one cell
+ * @param x Column in the source buffer
+ * @param y Row in the source buffer
+ * @param delta +1 when the cell became non-blank, -1 when it became blank
+ * @details One block per level; mapped document windows are offset by the
+ * viewport position.
+ */
+static void minimap_count(int x, int y, int delta) {
+    MiniMap *mm = &g_app.minimap;
+    if (mm->source->mapped) {
+        x += g_app.document.view_x;
+        y += g_app.document.view_y;
+    }
+    
+    for (int k = 0; k < mm->levels; ++k) {
+        int s = mm->shift + k;
+        mm->count[k][(size_t)(y >> s) * (size_t)mm->width[k] + (size_t)(x >> s)] += (uint32_t)delta;
+    }
+}
+
+/**
+ * @brief Zero every count (the source was cleared)
+ */
+static void minimap_clear(void) {
+    MiniMap *mm = &g_app.minimap;
+    
+    for (int k = 0; k < mm->levels; ++k) {
+        memset(mm->count[k], 0, (size_t)mm->width[k] * (size_t)mm->height[k] * sizeof(uint32_t));
+    }
+}
+
+/**
+ * @brief Build the pyramid from the current contents
+ * @return false if out of memory
+ * 
+ * @details
+ * Runs once after the source changes; afterwards the counts follow every
+ * write. Only occupied row spans are read: the composite's occupancy index,
+ * or the document's stored index (brought up to date first), so empty parts
+ * of a document are never faulted in. Upper levels are summed 2x2 from the
+ * level below.
+ */
+static bool minimap_build(void) {
+    MiniMap *mm = &g_app.minimap;
+    int world_w, world_h;
+    minimap_world(&world_w, &world_h);
+    
+    mm->shift = 0;
+    while ((size_t)((world_w + (1 << mm->shift) - 1) >> mm->shift) *
+           (size_t)((world_h + (1 << mm->shift) - 1) >> mm->shift) > MINIMAP_BASE_BLOCKS) {
+        mm->shift++;
+    }
+    
+    int w = (world_w + (1 << mm->shift) - 1) >> mm->shift;
+    int h = (world_h + (1 << mm->shift) - 1) >> mm->shift;
+    for (mm->levels = 0; mm->levels < MINIMAP_LEVELS_MAX; ) {
+        int k = mm->levels;
+        mm->count[k] = calloc((size_t)w * (size_t)h, sizeof(uint32_t));
+        if (!mm->count[k]) {
+            minimap_free();
+            return false;
+        }
+        mm->width[k] = w;
+        mm->height[k] = h;
+        mm->levels++;
+        if (w == 1 && h == 1) break;
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+    }
+    
+    uint32_t *base = mm->count[0];
+    if (g_app.document.map) {
+        Document *doc = &g_app.document;
+        document_fold_touched();
+        for (int y = 0; y < doc->height; ++y) {
+            RowSpan span = doc->rows[y];
+            const Cell *row = &doc->cells[(size_t)y * doc->width];
+            uint32_t *out = &base[(size_t)(y >> mm->shift) * (size_t)mm->width[0]];
+            for (int x = span.first; span.count > 0 && x <= span.last; ++x) {
+                if (!cell_is_blank(&row[x])) out[x >> mm->shift]++;
+            }
+        }
+        mm->source = &g_app.layers[0].buf;
+    } else {
+        for (int y = 0; y < g_app.canvas_height; ++y) {
+            RowSpan span = row_occupancy(y);
+            uint32_t *out = &base[(size_t)(y >> mm->shift) * (size_t)mm->width[0]];
+            for (int x = span.first; span.count > 0 && x <= span.last; ++x) {
+                if (!cell_is_blank(buffer_peek(&g_app.canvas, x, y))) out[x >> mm->shift]++;
+            }
+        }
+        mm->source = &g_app.canvas;
+    }
+    
+    for (int k = 1; k < mm->levels; ++k) {
+        const uint32_t *below = mm->count[k - 1];
+        int bw = mm->width[k - 1], bh = mm->height[k - 1];
+        for (int y = 0; y < bh; ++y) {
+            for (int x = 0; x < bw; ++x) {
+                mm->count[k][(size_t)(y / 2) * (size_t)mm->width[k] + (size_t)(x / 2)] +=
+                    below[(size_t)y * (size_t)bw + (size_t)x];
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Drop pending canvas redraws while the overview covers the canvas
+ * @details minimap_cycle() repaints the whole canvas when it closes.
+ */
+static void minimap_discard_dirty(void) {
+    for (int y = g_app.dirty_top; y <= g_app.dirty_bottom; ++y) {
+        g_app.dirty_rows[y].count = 0;
+    }
+    g_app.dirty_top = g_app.canvas_height;
+    g_app.dirty_bottom = -1;
+}
+
+/**
+ * @brief Draw the minimap over the canvas area
+ * 
+ * @details
+ * Picks the finest level whose blocks fit the target box (a third of the
+ * canvas width and half its height in the corner, the whole canvas area in
+ * full-screen mode) and shades each block by the fraction of its cells
+ * that are non-blank. The cursor's block is shown in reverse video; with a
+ * document open the viewport's blocks are reversed instead, and the
+ * cursor's block stands out within them.
+ */
+static void minimap_draw(void) {
+    static const char ramp[] = " .:-=+*#%@";
+    MiniMap *mm = &g_app.minimap;
+    if (mm->mode == MINIMAP_OFF) return;
+    
+    bool full = mm->mode == MINIMAP_FULL;
+    if (full) {
+        minimap_discard_dirty();
+        for (int y = 0; y < g_app.canvas_height; ++y) {
+            move(canvas_to_screen_y(y), canvas_to_screen_x(0));
+            clrtoeol();
+        }
+    }
+    if (!mm->source && !minimap_build()) {
+        mm->mode = MINIMAP_OFF;
+        set_status_message("Out of memory for the minimap");
+        return;
+    }
+    
+    int target_w = (full ? g_app.canvas_width : g_app.canvas_width / 3) - 2;
+    int target_h = (full ? g_app.canvas_height : g_app.canvas_height / 2) - 2;
+    int k = 0;
+    while (k < mm->levels - 1 && (mm->width[k] > target_w || mm->height[k] > target_h)) ++k;
+    if (mm->width[k] > target_w || mm->height[k] > target_h) return;
+    
+    // Box in canvas coordinates, border included
+    int x0 = full ? 0 : g_app.canvas_width - mm->width[k] - 2;
+    int y0 = 0;
+    int x1 = x0 + mm->width[k] + 1, y1 = y0 + mm->height[k] + 1;
+    if (!full && (x0 != mm->x0 || y0 != mm->y0 || x1 != mm->x1 || y1 != mm->y1)) {
+        mark_dirty(mm->x0, mm->y0, mm->x1, mm->y1);
+        mm->x0 = x0;
+        mm->y0 = y0;
+        mm->x1 = x1;
+        mm->y1 = y1;
+    }
+    
+    int sx = canvas_to_screen_x(x0), sy = canvas_to_screen_y(y0);
+    int sx1 = canvas_to_screen_x(x1), sy1 = canvas_to_screen_y(y1);
+    attrset(A_NORMAL);
+    mvaddch(sy, sx, ACS_ULCORNER);
+    mvhline(sy, sx + 1, ACS_HLINE, mm->width[k]);
+    mvaddch(sy, sx1, ACS_URCORNER);
+    mvvline(sy + 1, sx, ACS_VLINE, mm->height[k]);
+    mvvline(sy + 1, sx1, ACS_VLINE, mm->height[k]);
+    mvaddch(sy1, sx, ACS_LLCORNER);
+    mvhline(sy1, sx + 1, ACS_HLINE, mm->width[k]);
+    mvaddch(sy1, sx1, ACS_LRCORNER);
+    
+    int world_w, world_h;
+    minimap_world(&world_w, &world_h);
+    int s = mm->shift + k, size = 1 << s;
+    const Document *doc = &g_app.document;
+    int view_x = doc->view_x, view_y = doc->view_y;
+    bool show_view = doc->map && (g_app.canvas_width < world_w || g_app.canvas_height < world_h);
+    int cursor_bx = (g_app.cursor_x + view_x) >> s, cursor_by = (g_app.cursor_y + view_y) >> s;
+    
+    for (int by = 0; by < mm->height[k]; ++by) {
+        const uint32_t *counts = &mm->count[k][(size_t)by * (size_t)mm->width[k]];
+        int cell_h = (world_h - (by << s) < size) ? world_h - (by << s) : size;
+        bool view_row = show_view && (by << s) < view_y + g_app.canvas_height &&
+                        ((by + 1) << s) > view_y;
+        
+        move(sy + 1 + by, sx + 1);
+        for (int bx = 0; bx < mm->width[k]; ++bx) {
+            int cell_w = (world_w - (bx << s) < size) ? world_w - (bx << s) : size;
+            uint64_t area = (uint64_t)cell_w * (uint64_t)cell_h;
+            int level = (int)(((uint64_t)counts[bx] * 9 + area - 1) / area);
+            if (level > 9) level = 9;
+            bool in_view = view_row && (bx << s) < view_x + g_app.canvas_width &&
+                           ((bx + 1) << s) > view_x;
+            bool at_cursor = bx == cursor_bx && by == cursor_by;
+            
+            addch((chtype)ramp[level] | (in_view != at_cursor ? A_REVERSE : A_NORMAL));
+        }
+    }
+}
+
+/**
+ * @brief Switch to the next minimap mode (corner, full screen, off)
+ */
+static void minimap_cycle(void) {
+    MiniMap *mm = &g_app.minimap;
+    
+    mm->mode = (mm->mode + 1) % MINIMAP_MODES;
+    mm->x0 = mm->y0 = 0;
+    mm->x1 = mm->y1 = -1;
+    if (mm->mode == MINIMAP_OFF) {
+        paint_entire_canvas();
+    }
+}
+
+/*==============================================================================
+ * FILE I/O OPERATIONS
+ *============================================================================*/
+
+/**
+ * @brief Mix a 64-bit value into a running hash
+ * @param h Hash so far
+ * @param v Value
+ * @return Updated hash
+ */
+static inline uint64_t hash_mix(uint64_t h, uint64_t v) {
+    h = (h ^ v) * HASH_MULTIPLIER;
+    return h ^ (h >> 29);
+}
+
+/**
+ * @brief Hash the composite's content
+ * @return Hash of the size, the blank cell and every occupied row span
+ * @details Blank rows cost one index lookup, so the time taken is
+ * proportional to the drawn area rather than the canvas size.
+ */
+static uint64_t canvas_hash(void) {
+    uint64_t h = hash_mix(0, (uint64_t)g_app.canvas_width << 32 | (uint32_t)g_app.canvas_height);
+    h = hash_mix(h, cell_bits(g_app.canvas.blank));
+    
+    for (int y = 0; y < g_app.canvas_height; ++y) {
+        RowSpan span = row_occupancy(y);
+        if (span.count == 0) continue;
+        
+        const Cell *row = peek_spot(0, y);
+        h = hash_mix(h, (uint64_t)y << 32 | (uint32_t)span.first);
+        for (int x = span.first; x <= span.last; ++x) {
+            h = hash_mix(h, cell_bits(row[x]));
+        }
+    }
+    return h;
+}
+
+/**
+ * @brief Check that a file is unchanged since the last save wrote it
+ * @param filename File about to be saved
+ * @return true if it is that file, with the same inode, size and mtime
+ */
+static bool save_baseline_current(const char *filename) {
+    const SaveState *save = &g_app.save;
+    const struct stat *old = &save->baseline_stat;
+    struct stat st;
+    
+    return save->baseline[0] && strcmp(save->baseline, filename) == 0 &&
+           stat(filename, &st) == 0 &&
+           st.st_dev == old->st_dev && st.st_ino == old->st_ino &&
+           st.st_size == old->st_size &&
+           st.st_mtim.tv_sec == old->st_mtim.tv_sec &&
+           st.st_mtim.tv_nsec == old->st_mtim.tv_nsec;
+}
+
+/**
+ * @brief Save the current canvas unless the file already holds it
+ * @param filename Target filename (NULL uses the --save file); .bin saves
+ *        in the binary format, anything else as text
+ * @return true if the file holds the canvas afterwards
+ * 
+ * @details
+ * No edits since the last save to the same, untouched file means there is
+ * nothing to write. Edits that cancel out (paint, then erase) are caught by
+ * comparing canvas_hash() with the hash of the last save. Either way the
+ * write is skipped and g_app.save.skipped is set.
+ */
+static bool save_masterpiece(const char *filename) {
+    if (!filename) filename = g_app.save.path;
+    SaveState *save = &g_app.save;
+    
+    bool known = save_baseline_current(filename);
+    save->skipped = known && save->edits == save->baseline_edit;
+    if (save->skipped) return true;
+    
+    uint64_t hash = canvas_hash();
+    save->skipped = known && hash == save->baseline_hash;
+    if (save->skipped) {
+        save->baseline_edit = save->edits;
+        return true;
+    }
+    
+    bool ok = has_extension(filename, ".bin") ? save_binary_incremental(filename)
+                                              : save_text(filename);
+    
+    // A failed or partial write leaves the file unknown: next save is full
+    save->baseline[0] = '\0';
+    if (!ok || stat(filename, &save->baseline_stat) != 0 ||
+        strlen(filename) >= sizeof(save->baseline)) {
+        return ok;
+    }
+    strcpy(save->baseline, filename);
+    save->baseline_edit = save->edits;
+    save->baseline_hash = hash;
+    save->baseline_glyphs = g_app.glyphs.count;
+    save->baseline_styles = g_app.styles.count;
+    return true;
+}
+
+/**
+ * @brief Save the current canvas to a file in custom text format
+ * @param filename Target filename
+ * @return true if the file was written completely
+ * 
+ * @details
+ * File format specification:
+ * - Line 1: "width height" (canvas dimensions)
+ * - Subsequent lines: "color,code color,code ..." (space-separated pairs)
+ * - Each row on separate line
+ * - color: FG or FG/BG, each a palette index 0-255 or #rrggbb; 0-7 are the
+ *   base colors and a missing background is black, as in old files
+ * - code: Unicode code point (32 = space; 0-255 are the old byte values)
+ * 
+ * Blank margins and blank rows are copied from a preformatted row of blank
+ * tokens, so only the occupied span of each row is formatted cell by cell.
+ * 
+ */
+static bool save_text(const char *filename) {
+    
+    // Every blank token is "color,32"; a full row of them is "tok tok ... tok"
+    char blank_tok[STYLE_TEXT_SIZE + 16];
+    int tok_len = style_format(g_app.canvas.blank.color, blank_tok);
+    tok_len += snprintf(blank_tok + tok_len, sizeof(blank_tok) - (size_t)tok_len, ",%u",
+                        (unsigned)glyph_code(g_app.canvas.blank.glyph));
+    size_t stride = (size_t)tok_len + 1;
+    size_t row_len = stride * (size_t)g_app.canvas_width - 1;
+    char *blank_row = malloc(row_len + 1);
+    if (!blank_row) return false;
+    for (int x = 0; x < g_app.canvas_width; ++x) {
+        memcpy(blank_row + (size_t)x * stride, blank_tok, (size_t)tok_len);
+        blank_row[(size_t)x * stride + (size_t)tok_len] = ' ';
+    }
+    
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        free(blank_row);
+        return false;
+    }
+    
+    // Write header
+    fprintf(f, "%d %d\n", g_app.canvas_width, g_app.canvas_height);
+    
+    // Write canvas data
+    for (int y = 0; y < g_app.canvas_height; ++y) {
+        RowSpan span = row_occupancy(y);
+        if (span.count == 0) {
+            fwrite(blank_row, 1, row_len, f);
+            fputc('\n', f);
+            continue;
+        }
+        
+        // Leading blanks: "tok " repeated, a prefix of the blank row
+        fwrite(blank_row, 1, stride * (size_t)span.first, f);
+        
+        for (int x = span.first; x <= span.last; ++x) {
+            const Cell *cell = peek_spot(x, y);
+            char style[STYLE_TEXT_SIZE];
+            
+            if (cell->color < STYLE_DIRECT) {
+                fprintf(f, "%d,%u", (int)cell->color, (unsigned)glyph_code(cell->glyph));
+            } else {
+                style[style_format(cell->color, style)] = '\0';
+                fprintf(f, "%s,%u", style, (unsigned)glyph_code(cell->glyph));
+            }
+            if (x < span.last) {
+                fputc(' ', f);
+            }
+        }
+        
+        // Trailing blanks: " tok" repeated, a suffix of the blank row
+        size_t trailing = stride * (size_t)(g_app.canvas_width - 1 - span.last);
+        fwrite(blank_row + row_len - trailing, 1, trailing, f);
+        fputc('\n', f);
+    }
+    
+    bool ok = !ferror(f);
+    if (fclose(f) != 0) ok = false;
+    free(blank_row);
+    return ok;
+}
+
+/**
+ * @brief Parse a canvas file in custom text format
+ * @param filename Source filename
+ * @param width Out: width of the stored canvas
+ * @param height Out: height of the stored canvas
+ * @return Newly allocated row-major cell array (caller frees), or NULL on
+ *         open, format or allocation errors
+ */
+static Cell* read_canvas_file(const char *filename, int *width, int *height) {
+    FILE *f = fopen(filename, "r");
+    if (!f) return NULL;
+    
+    int file_width = 0, file_height = 0;
+    if (fscanf(f, "%d %d", &file_width, &file_height) != 2 ||
+        file_width <= 0 || file_height <= 0 ||
+        file_width > MAX_CANVAS_WIDTH || file_height > MAX_CANVAS_HEIGHT) {
+        fclose(f);
+        return NULL;
+    }
+    
+    // Allocate temporary storage
+    size_t temp_size = (size_t)file_width * (size_t)file_height;
+    Cell *temp_canvas = malloc(temp_size * sizeof(Cell));
+    if (!temp_canvas) {
+        fclose(f);
+        return NULL;
+    }
+    
+    // Consume rest of header line
+    int ch;
+    do { 
+        ch = fgetc(f); 
+    } while (ch != '\n' && ch != EOF);
+    
+    // Read canvas data
+    bool read_success = true;
+    for (int y = 0; y < file_height && read_success; ++y) {
+        for (int x = 0; x < file_width && read_success; ++x) {
+            char color_text[STYLE_TEXT_SIZE];
+            unsigned code_val = ' ';
+            
+            if (fscanf(f, " %23[^, \t\n],%u", color_text, &code_val) != 2) {
+                read_success = false;
+                break;
+            }
+            
+            // Validate and store data
+            StyleId color;
+            if (!parse_color(color_text, &color)) color = 7;
+            temp_canvas[y * file_width + x] = make_cell(
+                glyph_code_valid(code_val) ? glyph_intern(code_val) : ' ', color);
+            
+            // Skip whitespace
+            sneak_peek_at_file(f);
+        }
+        
+        // Skip to end of line
+        do { 
+            ch = fgetc(f); 
+        } while (ch != '\n' && ch != EOF);
+    }
+    
+    fclose(f);
+    
+    if (!read_success) {
+        free(temp_canvas);
+        return NULL;
+    }
+    
+    *width = file_width;
+    *height = file_height;
+    return temp_canvas;
+}
+
+/**
+ * @brief Load a canvas from a file and overlay onto current canvas
+ * @param filename Source filename (NULL uses the --save file)
+ * 
+ * @details
+ * Loading behavior:
+ * - Reads canvas data from file in custom text or binary format
+ * - Overlays loaded data onto the active layer (preserving canvas size)
+ * - If loaded canvas is smaller: only overlapping region is affected
+ * - If loaded canvas is larger: clipped to current canvas boundaries
+ * - Invalid files or read errors are silently ignored
+ * - Canvas is automatically re-rendered after successful load
+ * 
+ * @note Memory allocation failures result in graceful abort
+ */
+static void load_masterpiece(const char *filename) {
+    if (!filename) filename = g_app.save.path;
+    if (!active_layer_writable()) return;
+    
+    int file_width = 0, file_height = 0;
+    Cell *temp_canvas = read_any_canvas(filename, &file_width, &file_height);
+    if (!temp_canvas) return;
+    
+    // Copy overlapping region to main canvas
+    int copy_width = (file_width < g_app.canvas_width) ? file_width : g_app.canvas_width;
+    int copy_height = (file_height < g_app.canvas_height) ? file_height : g_app.canvas_height;
+    
+    for (int y = 0; y < copy_height; ++y) {
+        for (int x = 0; x < copy_width; ++x) {
+            put_cell(x, y, temp_canvas[y * file_width + x]);
+        }
+    }
+    
+    free(temp_canvas);
+    paint_entire_canvas();
+}
+
+/*==============================================================================
+ * EXPORT
+ *============================================================================*/
+
+/**
+ * @brief Open a streaming writer on a file
+ * @param filename Target filename
+ * @return Writer or NULL if the file or buffer could not be created
+ * @note stdio buffering is disabled; the writer's own buffer is the only copy
+ */
+static StreamWriter* sw_open(const char *filename) {
+    StreamWriter *w = malloc(sizeof(StreamWriter));
+    if (!w) return NULL;
+    
+    w->f = fopen(filename, "wb");
+    if (!w->f) {
+        free(w);
+        return NULL;
+    }
+    setvbuf(w->f, NULL, _IONBF, 0);
+    w->len = 0;
+    w->failed = false;
+    return w;
+}
+
+/**
+ * @brief Write out everything buffered so far
+ * @param w Writer
+ */
+static void sw_flush(StreamWriter *w) {
+    if (w->len > 0 && fwrite(w->buf, 1, w->len, w->f) != w->len) {
+        w->failed = true;
+    }
+    w->len = 0;
+}
+
+/**
+ * @brief Append raw bytes to the writer
+ * @param w Writer
+ * @param data Bytes to append
+ * @param n Number of bytes
+ */
+static void sw_write(StreamWriter *w, const char *data, size_t n) {
+    if (w->len + n > EXPORT_BUFFER_SIZE) {
+        sw_flush(w);
+        if (n > EXPORT_BUFFER_SIZE) {
+            if (fwrite(data, 1, n, w->f) != n) w->failed = true;
+            return;
+        }
+    }
+    memcpy(w->buf + w->len, data, n);
+    w->len += n;
+}
+
+/**
+ * @brief Append a single byte to the writer
+ * @param w Writer
+ * @param c Byte to append
+ */
+static inline void sw_putc(StreamWriter *w, char c) {
+    if (w->len == EXPORT_BUFFER_SIZE) sw_flush(w);
+    w->buf[w->len++] = c;
+}
+
+/**
+ * @brief Append a NUL-terminated string to the writer
+ * @param w Writer
+ * @param s String to append
+ */
+static inline void sw_puts(StreamWriter *w, const char *s) {
+    sw_write(w, s, strlen(s));
+}
+
+/**
+ * @brief Append a non-negative decimal integer to the writer
+ * @param w Writer
+ * @param value Value to format
+ */
+static void sw_put_uint(StreamWriter *w, unsigned long value) {
+    char digits[24];
+    int n = 0;
+    
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    
+    while (n > 0) sw_putc(w, digits[--n]);
+}
+
+/**
+ * @brief Flush, close and free the writer
+ * @param w Writer
+ * @return true if every byte reached the file
+ */
+static bool sw_close(StreamWriter *w) {
+    sw_flush(w);
+    bool ok = !w->failed;
+    if (fclose(w->f) != 0) ok = false;
+    free(w);
+    return ok;
+}
+
+/**
+ * @brief Append the SGR parameters that select a color
+ * @param w Writer
+ * @param color Color
+ * @param background true for the background, false for the foreground
+ * @details The 16 ANSI colors use their short codes, so base colors export
+ * as before; other palette entries and RGB use the 256-color and
+ * truecolor forms.
+ */
+static void sw_put_sgr_color(StreamWriter *w, ColorSpec color, bool background) {
+    unsigned base = background ? 40u : 30u;
+    
+    if (color & COLOR_RGB) {
+        sw_put_uint(w, base + 8);
+        sw_puts(w, ";2;");
+        sw_put_uint(w, (color >> 16) & 0xFF);
+        sw_putc(w, ';');
+        sw_put_uint(w, (color >> 8) & 0xFF);
+        sw_putc(w, ';');
+        sw_put_uint(w, color & 0xFF);
+    } else if (color < COLOR_COUNT) {
+        sw_put_uint(w, base + color);
+    } else if (color < ANSI_COLOR_COUNT) {
+        sw_put_uint(w, base + 60 + color - COLOR_COUNT);
+    } else {
+        sw_put_uint(w, base + 8);
+        sw_puts(w, ";5;");
+        sw_put_uint(w, color);
+    }
+}
+
+/**
+ * @brief Reset the background if the last SGR emitted set one
+ * @param w Writer
+ * @param sgr_color In/out: style of the last SGR emitted (-1 if none or unknown)
+ * @param json true to escape the output for a JSON string (asciicast)
+ */
+static void export_ansi_reset_background(StreamWriter *w, int *sgr_color, bool json) {
+    if (*sgr_color < 0 || style_of((StyleId)*sgr_color).bg == 0) return;
+    sw_puts(w, json ? "\\u001b[49m" : "\x1b[49m");
+    *sgr_color = -1;
+}
+
+/**
+ * @brief Emit one cell as SGR-colored text
+ * @param w Writer
+ * @param cell Cell to emit
+ * @param sgr_color In/out: style of the last SGR emitted (-1 if none yet)
+ * @param json true to escape the output for a JSON string (asciicast)
+ */
+static void export_ansi_cell(StreamWriter *w, const Cell *cell, int *sgr_color, bool json) {
+    uint32_t code = glyph_code(cell->glyph);
+    
+    if (cell_is_blank(cell)) {
+        export_ansi_reset_background(w, sgr_color, json);
+        sw_putc(w, ' ');
+        return;
+    }
+    if (cell->color != *sgr_color) {
+        Style style = style_of(cell->color);
+        bool had_background = *sgr_color >= 0 && style_of((StyleId)*sgr_color).bg != 0;
+        
+        sw_puts(w, json ? "\\u001b[" : "\x1b[");
+        sw_put_sgr_color(w, style.fg, false);
+        if (style.bg != 0) {
+            sw_putc(w, ';');
+            sw_put_sgr_color(w, style.bg, true);
+        } else if (had_background) {
+            sw_puts(w, ";49");
+        }
+        sw_putc(w, 'm');
+        *sgr_color = cell->color;
+    }
+    
+    if (code < 0x20 || (code >= 0x7f && code < 0xA0)) {
+        sw_putc(w, '?');  // Never pass control characters through
+    } else if (json && (code == '"' || code == '\\')) {
+        sw_putc(w, '\\');
+        sw_putc(w, (char)code);
+    } else {
+        char utf8[UTF8_MAX];
+        sw_write(w, utf8, (size_t)utf8_encode(code, utf8));
+    }
+}
+
+/**
+ * @brief Emit one canvas row as SGR-colored text
+ * @param w Writer
+ * @param y Canvas row
+ * @param sgr_color In/out: style of the last SGR emitted (-1 if none yet)
+ * @param json true to escape the output for a JSON string (asciicast)
+ * 
+ * @details
+ * Trailing blanks are dropped using the occupancy index. Blank cells only
+ * trigger an SGR change to drop a background, which is also dropped at the
+ * end of the row so it cannot spill into the next one.
+ */
+static void export_ansi_row(StreamWriter *w, int y, int *sgr_color, bool json) {
+    RowSpan span = row_occupancy(y);
+    
+    for (int x = 0; span.count > 0 && x <= span.last; ++x) {
+        export_ansi_cell(w, peek_spot(x, y), sgr_color, json);
+    }
+    export_ansi_reset_background(w, sgr_color, json);
+}
+
+/**
+ * @brief Export the canvas as ANSI escape art
+ * @param filename Target filename (NULL uses DEFAULT_ANSI_FILE)
+ * @return true on success
+ * 
+ * @details
+ * Streams the canvas row by row as plain text with SGR foreground colors,
+ * emitting an SGR sequence only when the color changes. Attributes are
+ * reset once at the end of the document.
+ */
+static bool export_ansi(const char *filename) {
+    if (!filename) filename = DEFAULT_ANSI_FILE;
+    
+    StreamWriter *w = sw_open(filename);
+    if (!w) return false;
+    
+    int sgr_color = -1;
+    for (int y = 0; y < g_app.canvas_height; ++y) {
+        export_ansi_row(w, y, &sgr_color, false);
+        sw_putc(w, '\n');
+    }
+    sw_puts(w, "\x1b[0m");
+    
+    return sw_close(w);
+}
+
+/**
+ * @brief Write the asciicast header and the screen-clearing first event
+ * @param w Writer
+ */
+static void export_cast_header(StreamWriter *w) {
+    sw_puts(w, "{\"version\": 2, \"width\": ");
+    sw_put_uint(w, (unsigned long)g_app.canvas_width);
+    sw_puts(w, ", \"height\": ");
+    sw_put_uint(w, (unsigned long)g_app.canvas_height);
+    sw_puts(w, ", \"timestamp\": ");
+    sw_put_uint(w, (unsigned long)time(NULL));
+    sw_puts(w, ", \"title\": \"Terminal Paint\"}\n");
+    sw_puts(w, "[0.0, \"o\", \"\\u001b[0m\\u001b[2J\\u001b[H\"]\n");
+}
+
+/**
+ * @brief Export the canvas as an asciinema v2 cast file
+ * @param filename Target filename (NULL uses DEFAULT_CAST_FILE)
+ * @return true on success
+ * 
+ * @details
+ * File layout:
+ * - Line 1: JSON header with version, terminal size and timestamp
+ * - Then one output event per canvas row: [0.0, "o", "<row>\r\n"]
+ * 
+ * The first event clears the screen and homes the cursor so the cast
+ * replays the artwork at the top-left of the player.
+ */
+static bool export_asciicast(const char *filename) {
+    if (!filename) filename = DEFAULT_CAST_FILE;
+    
+    StreamWriter *w = sw_open(filename);
+    if (!w) return false;
+    
+    export_cast_header(w);
+    
+    int sgr_color = -1;
+    for (int y = 0; y < g_app.canvas_height; ++y) {
+        sw_puts(w, "[0.0, \"o\", \"");
+        export_ansi_row(w, y, &sgr_color, true);
+        if (y < g_app.canvas_height - 1) {
+            sw_puts(w, "\\r\\n");
+        } else {
+            sw_puts(w, "\\u001b[0m");
+        }
+        sw_puts(w, "\"]\n");
+    }
+    
+    return sw_close(w);
+}
+
+/**
+ * @brief Append one cell character to an HTML document
+ * @param w Writer
+ * @param code Code point of the cell's glyph
+ */
+static void sw_put_html_char(StreamWriter *w, uint32_t code) {
+    switch (code) {
+        case '&': sw_puts(w, "&amp;"); return;
+        case '<': sw_puts(w, "&lt;"); return;
+        case '>': sw_puts(w, "&gt;"); return;
+        default: break;
+    }
+    
+    if (code < 0x20 || code == 0x7f) {
+        sw_putc(w, '?');
+    } else if (code >= 0x80) {
+        sw_puts(w, "&#");
+        sw_put_uint(w, code);
+        sw_putc(w, ';');
+    } else {
+        sw_putc(w, (char)code);
+    }
+}
+
+/**
+ * @brief Open the <span> of a non-blank run in one style
+ * @param w Writer
+ * @param id Style ID
+ * @details Base colors use the stylesheet classes; other styles carry
+ * their colors inline.
+ */
+static void sw_put_html_span(StreamWriter *w, StyleId id) {
+    if (id < STYLE_DIRECT) {
+        sw_puts(w, "<span class=\"c");
+        sw_put_uint(w, (unsigned long)id);
+        sw_puts(w, "\">");
+        return;
+    }
+    
+    Style style = style_of(id);
+    unsigned char fg[3], bg[3];
+    char attr[80];
+    palette_rgb(style.fg, fg);
+    palette_rgb(style.bg, bg);
+    int n = snprintf(attr, sizeof(attr), "<span style=\"color: #%02x%02x%02x", fg[0], fg[1], fg[2]);
+    if (style.bg != 0) {
+        snprintf(attr + n, sizeof(attr) - (size_t)n, "; background: #%02x%02x%02x", bg[0], bg[1], bg[2]);
+    }
+    sw_puts(w, attr);
+    sw_puts(w, "\">");
+}
+
+/**
+ * @brief Export the canvas as a standalone HTML page
+ * @param filename Target filename (NULL uses DEFAULT_HTML_FILE)
+ * @return true on success
+ * 
+ * @details
+ * The canvas becomes a single <pre> block. Consecutive cells of one style
+ * share a <span>, and blanks only break a run that has a background, so
+ * output size scales with color changes rather than cells.
+ */
+static bool export_html(const char *filename) {
+    if (!filename) filename = DEFAULT_HTML_FILE;
+    
+    StreamWriter *w = sw_open(filename);
+    if (!w) return false;
+    
+    sw_puts(w, "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n"
+               "<title>Terminal Paint</title>\n<style>\n"
+               "pre { background: #000; font-family: monospace; line-height: 1.2; }\n");
+    for (int i = 0; i < COLOR_COUNT; ++i) {
+        char rule[48];
+        snprintf(rule, sizeof(rule), ".c%d { color: #%02x%02x%02x; }\n", i,
+                 export_rgb[i][0], export_rgb[i][1], export_rgb[i][2]);
+        sw_puts(w, rule);
+    }
+    sw_puts(w, "</style>\n</head>\n<body>\n<pre>");
+    
+    for (int y = 0; y < g_app.canvas_height; ++y) {
+        RowSpan span = row_occupancy(y);
+        int open_color = -1;
+        
+        for (int x = 0; span.count > 0 && x <= span.last; ++x) {
+            const Cell *cell = peek_spot(x, y);
+            
+            if (cell_is_blank(cell)) {
+                if (open_color >= 0 && style_of((StyleId)open_color).bg != 0) {
+                    sw_puts(w, "</span>");
+                    open_color = -1;
+                }
+            } else if (cell->color != open_color) {
+                if (open_color >= 0) sw_puts(w, "</span>");
+                sw_put_html_span(w, cell->color);
+                open_color = cell->color;
+            }
+            sw_put_html_char(w, cell_is_blank(cell) ? ' ' : glyph_code(cell->glyph));
+        }
+        if (open_color >= 0) sw_puts(w, "</span>");
+        sw_putc(w, '\n');
+    }
+    sw_puts(w, "</pre>\n</body>\n</html>\n");
+    
+    return sw_close(w);
+}
+
+/**
+ * @brief Export the canvas as a binary PPM (P6) image
+ * @param filename Target filename (NULL uses DEFAULT_PPM_FILE)
+ * @return true on success
+ * 
+ * @details
+ * Each cell is rasterized through the built-in 5x7 font into a
+ * PPM_CELL_WIDTH x PPM_CELL_HEIGHT block, filled with the cell's
+ * background (black by default). One pixel row is assembled at a time,
+ * and only the occupied span of each canvas row is drawn into it.
+ */
+static bool export_ppm(const char *filename) {
+    if (!filename) filename = DEFAULT_PPM_FILE;
+    
+    size_t line_bytes = (size_t)g_app.canvas_width * PPM_CELL_WIDTH * 3;
+    unsigned char *line = malloc(line_bytes);
+    if (!line) return false;
+    
+    StreamWriter *w = sw_open(filename);
+    if (!w) {
+        free(line);
+        return false;
+    }
+    
+    sw_puts(w, "P6\n");
+    sw_put_uint(w, (unsigned long)g_app.canvas_width * PPM_CELL_WIDTH);
+    sw_putc(w, ' ');
+    sw_put_uint(w, (unsigned long)g_app.canvas_height * PPM_CELL_HEIGHT);
+    sw_puts(w, "\n255\n");
+    
+    for (int y = 0; y < g_app.canvas_height; ++y) {
+        RowSpan span = row_occupancy(y);
+        
+        for (int py = 0; py < PPM_CELL_HEIGHT; ++py) {
+            memset(line, 0, line_bytes);
+            
+            for (int x = span.first; span.count > 0 && x <= span.last; ++x) {
+                const Cell *cell = peek_spot(x, y);
+                if (cell_is_blank(cell)) continue;
+                
+                Style style = style_of(cell->color);
+                unsigned char rgb[3];
+                unsigned char *px = line + (size_t)x * PPM_CELL_WIDTH * 3;
+                if (style.bg != 0) {
+                    palette_rgb(style.bg, rgb);
+                    for (int gx = 0; gx < PPM_CELL_WIDTH; ++gx) {
+                        memcpy(px + gx * 3, rgb, 3);
+                    }
+                }
+                if (py >= FONT_GLYPH_HEIGHT) continue;
+                
+                uint32_t code = glyph_code(cell->glyph);
+                if (code < 0x20 || code > 0x7e) code = '?';
+                const unsigned char *glyph = font_5x7[code - 0x20];
+                palette_rgb(style.fg, rgb);
+                
+                for (int gx = 0; gx < FONT_GLYPH_WIDTH; ++gx, px += 3) {
+                    if (glyph[gx] & (1u << py)) {
+                        memcpy(px, rgb, 3);
+                    }
+                }
+            }
+            sw_write(w, (const char *)line, line_bytes);
+        }
+    }
+    
+    free(line);
+    return sw_close(w);
+}
+
+/**
+ * @brief Export the canvas to a file, picking the format by extension
+ * @param filename Target filename ending in .ans, .cast, .html/.htm or .ppm
+ * @return true on success, false on write failure or unknown extension
+ */
+static bool export_by_extension(const char *filename) {
+    static const struct {
+        const char *ext;
+        bool (*write)(const char *filename);
+    } formats[] = {
+        { ".ans",  export_ansi },
+        { ".cast", export_asciicast },
+        { ".html", export_html },
+        { ".htm",  export_html },
+        { ".ppm",  export_ppm },
+    };
+    
+    const char *dot = strrchr(filename, '.');
+    if (!dot) return false;
+    
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i) {
+        if (strcmp(dot, formats[i].ext) == 0) {
+            return formats[i].write(filename);
+        }
+    }
+    errno = EINVAL;
+    return false;
+}
+
+/**
+ * @brief Export the animation timeline as an asciinema v2 cast file
+ * @param filename Target filename (NULL uses DEFAULT_CAST_FILE)
+ * @return true on success
+ * 
+ * @details
+ * One output event per frame, timed at the playback rate. Each event
+ * carries only the composite cells that changed since the previous frame,
+ * every changed run prefixed by a cursor move. The frame on display is
+ * restored afterwards.
+ */
+static bool export_animation_cast(const char *filename) {
+    if (!filename) filename = DEFAULT_CAST_FILE;
+    
+    Timeline *tl = &g_app.timeline;
+    int width = g_app.canvas_width;
+    Cell *prev = malloc((size_t)width * (size_t)g_app.canvas_height * sizeof(Cell));
+    if (!prev || !timeline_commit()) {
+        free(prev);
+        return false;
+    }
+    
+    StreamWriter *w = sw_open(filename);
+    if (!w) {
+        free(prev);
+        return false;
+    }
+    export_cast_header(w);
+    
+    for (size_t i = 0; i < (size_t)width * (size_t)g_app.canvas_height; ++i) {
+        prev[i] = g_app.canvas.blank;
+    }
+    
+    int shown = tl->current;
+    int sgr_color = -1;
+    for (int k = 0; k < tl->count; ++k) {
+        timeline_goto(k);
+        
+        int64_t at_us = (int64_t)k * 1000000 / tl->fps;
+        sw_putc(w, '[');
+        sw_put_uint(w, (unsigned long)(at_us / 1000000));
+        sw_putc(w, '.');
+        for (int64_t digit = 100000; digit > 0; digit /= 10) {
+            sw_putc(w, (char)('0' + at_us / digit % 10));
+        }
+        sw_puts(w, ", \"o\", \"");
+        
+        for (int y = 0; y < g_app.canvas_height; ++y) {
+            Cell *old = &prev[(size_t)y * width];
+            for (int x = 0; x < width; ) {
+                const Cell *cell = peek_spot(x, y);
+                if (cell_bits(*cell) == cell_bits(old[x])) { ++x; continue; }
+                
+                sw_puts(w, "\\u001b[");
+                sw_put_uint(w, (unsigned long)(y + 1));
+                sw_putc(w, ';');
+                sw_put_uint(w, (unsigned long)(x + 1));
+                sw_putc(w, 'H');
+                while (x < width && cell_bits(*(cell = peek_spot(x, y))) != cell_bits(old[x])) {
+                    export_ansi_cell(w, cell, &sgr_color, true);
+                    old[x++] = *cell;
+                }
+            }
+        }
+        sw_puts(w, k == tl->count - 1 ? "\\u001b[0m\"]\n" : "\"]\n");
+    }
+    
+    timeline_goto(shown);
+    free(prev);
+    return sw_close(w);
+}
+
+/**
+ * @brief Export the canvas in every publishing format
+ * @details Writes the default .ans, .cast, .html and .ppm files and reports
+ * the outcome in the status bar.
+ */
+static void publish_masterpiece(void) {
+    bool ok = export_ansi(NULL);
+    if (g_app.timeline.count > 1) {
+        ok = export_animation_cast(NULL) && ok;
+    } else {
+        ok = export_asciicast(NULL) && ok;
+    }
+    ok = export_html(NULL) && ok;
+    ok = export_ppm(NULL) && ok;
+    
+    if (ok) {
+        set_status_message("Exported paint_save.ans/.cast/.html/.ppm");
+    } else {
+        set_status_message("Export failed: %s", strerror(errno));
+    }
+}
+
+/*==============================================================================
+ * BINARY FORMAT
+ *============================================================================*/
+
+/**
+ * @brief Offset of the cell section in a binary canvas file
+ * @param height Canvas height
+ * @return Header plus row index, rounded up to BINARY_ALIGN
+ */
+static inline uint32_t binary_cells_offset(int height) {
+    size_t used = sizeof(BinaryHeader) + (size_t)height * sizeof(RowSpan);
+    return (uint32_t)((used + BINARY_ALIGN - 1) / BINARY_ALIGN * BINARY_ALIGN);
+}
+
+/**
+ * @brief Offset of the glyph table in a binary canvas file
+ * @param width Canvas width
+ * @param height Canvas height
+ * @return End of the cell section
+ */
+static inline uint64_t binary_glyphs_offset(int width, int height) {
+    return binary_cells_offset(height) + (uint64_t)width * (uint64_t)height * sizeof(Cell);
+}
+
+/**
+ * @brief Offset of the style table in a binary canvas file
+ * @param width Canvas width
+ * @param height Canvas height
+ * @param glyph_count Entries in the glyph table
+ * @return End of the glyph table
+ */
+static inline uint64_t binary_styles_offset(int width, int height, uint32_t glyph_count) {
+    return binary_glyphs_offset(width, height) + (uint64_t)glyph_count * sizeof(uint32_t);
+}
+
+/**
+ * @brief Build the header of a binary canvas file
+ * @param width Canvas width
+ * @param height Canvas height
+ * @param blank Cell value of blank cells
+ * @return Header with the standard section offsets and no glyph table
+ */
+static BinaryHeader binary_header(int width, int height, Cell blank) {
+    return (BinaryHeader){
+        .magic = BINARY_MAGIC,
+        .byte_order = BINARY_BYTE_ORDER,
+        .version = BINARY_VERSION,
+        .width = (uint32_t)width,
+        .height = (uint32_t)height,
+        .rows_offset = sizeof(BinaryHeader),
+        .cells_offset = binary_cells_offset(height),
+        .blank = blank,
+    };
+}
+
+/**
+ * @brief Format an error message into an optional buffer
+ * @param err Buffer, or NULL to discard the message
+ * @param err_size Buffer size
+ * @param fmt printf-style format
+ */
+static void report_error(char *err, size_t err_size, const char *fmt, ...) {
+    if (!err || err_size == 0) return;
+    
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(err, err_size, fmt, args);
+    va_end(args);
+}
+
+/**
+ * @brief Save the current canvas in the binary format
+ * @param filename Target filename
+ * @return true if the file was written completely
+ * 
+ * @details
+ * Layout (native byte order, see BinaryHeader):
+ * - BinaryHeader
+ * - One RowSpan per row: the occupancy index, so readers need no scan
+ * - width x height cells, row-major, at cells_offset
+ * - glyph_count code points: the glyph table, for IDs from GLYPH_DIRECT up
+ * - style_count Styles: the style table, for IDs from STYLE_DIRECT up
+ */
+static bool save_binary(const char *filename) {
+    int width = g_app.canvas_width, height = g_app.canvas_height;
+    const GlyphTable *glyphs = &g_app.glyphs;
+    const StyleTable *styles = &g_app.styles;
+    BinaryHeader header = binary_header(width, height, g_app.canvas.blank);
+    header.glyph_count = (uint32_t)glyphs->count;
+    header.style_count = (uint32_t)styles->count;
+    
+    StreamWriter *w = sw_open(filename);
+    if (!w) return false;
+    
+    sw_write(w, (const char *)&header, sizeof(header));
+    for (int y = 0; y < height; ++y) {
+        RowSpan span = row_occupancy(y);
+        sw_write(w, (const char *)&span, sizeof(span));
+    }
+    
+    static const char zeros[BINARY_ALIGN] = { 0 };
+    size_t used = header.rows_offset + (size_t)height * sizeof(RowSpan);
+    sw_write(w, zeros, header.cells_offset - used);
+    
+    for (int y = 0; y < height; ++y) {
+        if (row_occupancy(y).count == 0) {
+            for (int x = 0; x < width; ++x) {
+                sw_write(w, (const char *)&g_app.canvas.blank, sizeof(Cell));
+            }
+        } else {
+            sw_write(w, (const char *)peek_spot(0, y), (size_t)width * sizeof(Cell));
+        }
+    }
+    sw_write(w, (const char *)glyphs->code, (size_t)glyphs->count * sizeof(uint32_t));
+    sw_write(w, (const char *)styles->style, (size_t)styles->count * sizeof(Style));
+    return sw_close(w);
+}
+
+/**
+ * @brief Extend the tables of a binary file with glyphs and styles interned since it was written
+ * @param fd File open for writing
+ * @param width Canvas width
+ * @param height Canvas height
+ * @param glyphs Glyph table entries the file holds
+ * @param styles Style table entries the file holds
+ * @return true if the tables and the header counts were written
+ * @details New glyphs go where the style table starts, so when there are
+ * any the whole style table is rewritten after them; it is at most a few
+ * hundred kilobytes. Tables only grow, so nothing needs truncating.
+ */
+static bool binary_append_tables(int fd, int width, int height, int glyphs, int styles) {
+    const GlyphTable *gt = &g_app.glyphs;
+    const StyleTable *st = &g_app.styles;
+    if (gt->count == glyphs && st->count == styles) return true;
+    
+    bool ok = true;
+    if (gt->count > glyphs) {
+        size_t bytes = (size_t)(gt->count - glyphs) * sizeof(uint32_t);
+        off_t at = (off_t)binary_glyphs_offset(width, height) + (off_t)glyphs * (off_t)sizeof(uint32_t);
+        ok = pwrite(fd, &gt->code[glyphs], bytes, at) == (ssize_t)bytes;
+        styles = 0;
+    }
+    if (ok && st->count > styles) {
+        size_t bytes = (size_t)(st->count - styles) * sizeof(Style);
+        off_t at = (off_t)binary_styles_offset(width, height, (uint32_t)gt->count) +
+                   (off_t)styles * (off_t)sizeof(Style);
+        ok = pwrite(fd, &st->style[styles], bytes, at) == (ssize_t)bytes;
+    }
+    
+    uint32_t counts[2] = { (uint32_t)gt->count, (uint32_t)st->count };
+    return ok && pwrite(fd, counts, sizeof(counts), offsetof(BinaryHeader, glyph_count)) ==
+                     (ssize_t)sizeof(counts);
+}
+
+/**
+ * @brief Rewrite the index entry and cells of every row edited since the baseline
+ * and append glyphs and styles interned since then
+ * @param filename File last written by a binary save of this canvas
+ * @param changed Number of rows to patch
+ * @return true if every row was written
+ */
+static bool patch_binary_rows(const char *filename, int changed) {
+    int fd = open(filename, O_WRONLY);
+    if (fd < 0) return false;
+    
+    int width = g_app.canvas_width;
+    size_t row_bytes = (size_t)width * sizeof(Cell);
+    off_t cells_offset = binary_cells_offset(g_app.canvas_height);
+    Cell *blank_row = g_app.scratch_row;
+    for (int x = 0; x < width; ++x) {
+        blank_row[x] = g_app.canvas.blank;
+    }
+    
+    bool ok = true;
+    for (int y = 0; ok && changed > 0 && y < g_app.canvas_height; ++y) {
+        if (g_app.canvas.row_edit[y] <= g_app.save.baseline_edit) continue;
+        --changed;
+        
+        RowSpan span = row_occupancy(y);
+        const Cell *src = span.count > 0 ? peek_spot(0, y) : blank_row;
+        off_t span_at = (off_t)sizeof(BinaryHeader) + (off_t)y * (off_t)sizeof(RowSpan);
+        ok = pwrite(fd, &span, sizeof(span), span_at) == (ssize_t)sizeof(span) &&
+             pwrite(fd, src, row_bytes, cells_offset + (off_t)y * (off_t)row_bytes) ==
+                 (ssize_t)row_bytes;
+    }
+    
+    ok = ok && binary_append_tables(fd, width, g_app.canvas_height,
+                                    g_app.save.baseline_glyphs, g_app.save.baseline_styles);
+    if (close(fd) != 0) ok = false;
+    return ok;
+}
+
+/**
+ * @brief Save the current canvas in the binary format, writing only changes
+ * @param filename Target filename
+ * @return true if the file holds the canvas afterwards
+ * 
+ * @details
+ * The composite stamps each row with the sequence number of its latest
+ * edit. If the target is the file the previous save wrote, untouched since
+ * (see save_baseline_current()) and no clear happened in between, only rows
+ * stamped after that save are rewritten in place: the index entry and the
+ * cell row both live at fixed offsets. Otherwise, or when more than
+ * BINARY_PATCH_PERCENT of the rows changed, the whole file is rewritten.
+ * g_app.save.patched_rows reports which path was taken.
+ */
+static bool save_binary_incremental(const char *filename) {
+    SaveState *save = &g_app.save;
+    int changed = -1;
+    
+    if (save_baseline_current(filename) && save->clear_edit <= save->baseline_edit) {
+        changed = 0;
+        for (int y = 0; y < g_app.canvas_height; ++y) {
+            if (g_app.canvas.row_edit[y] > save->baseline_edit) ++changed;
+        }
+        if ((int64_t)changed * 100 > (int64_t)g_app.canvas_height * BINARY_PATCH_PERCENT) {
+            changed = -1;
+        }
+    }
+    
+    save->patched_rows = changed;
+    return changed >= 0 ? patch_binary_rows(filename, changed) : save_binary(filename);
+}
+
+/**
+ * @brief Check a binary header against the format and the file size
+ * @param header Header read from the file
+ * @param file_size Size of the file in bytes
+ * @param err Out: reason on failure (may be NULL)
+ * @param err_size Size of err
+ * @return true if the header describes a complete, supported file
+ */
+static bool binary_header_valid(const BinaryHeader *header, uint64_t file_size,
+                                char *err, size_t err_size) {
+    if (memcmp(header->magic, BINARY_MAGIC, sizeof(header->magic)) != 0) {
+        report_error(err, err_size, "not a binary canvas (bad magic)");
+        return false;
+    }
+    if (header->byte_order != BINARY_BYTE_ORDER) {
+        report_error(err, err_size, "written on a host with a different byte order");
+        return false;
+    }
+    if (header->version < 1 || header->version > BINARY_VERSION) {
+        report_error(err, err_size, "unsupported version %u", header->version);
+        return false;
+    }
+    if (header->width == 0 || header->height == 0 ||
+        header->width > MAX_DOCUMENT_SIDE || header->height > MAX_DOCUMENT_SIDE) {
+        report_error(err, err_size, "bad size %ux%u", header->width, header->height);
+        return false;
+    }
+    if (header->rows_offset != sizeof(BinaryHeader) ||
+        header->cells_offset != binary_cells_offset((int)header->height)) {
+        report_error(err, err_size, "bad section offsets");
+        return false;
+    }
+    
+    if (header->glyph_count > GLYPH_MAX - GLYPH_DIRECT) {
+        report_error(err, err_size, "bad glyph count %u", header->glyph_count);
+        return false;
+    }
+    if (header->style_count > STYLE_MAX - STYLE_DIRECT) {
+        report_error(err, err_size, "bad style count %u", header->style_count);
+        return false;
+    }
+    
+    uint64_t expected = binary_styles_offset((int)header->width, (int)header->height,
+                                             header->glyph_count) +
+                        (uint64_t)header->style_count * sizeof(Style);
+    if (file_size != expected) {
+        report_error(err, err_size, "file is %llu bytes, expected %llu",
+                     (unsigned long long)file_size, (unsigned long long)expected);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Read a canvas file in the binary format
+ * @param filename Source filename
+ * @param width Out: width of the stored canvas
+ * @param height Out: height of the stored canvas
+ * @param err Out: reason on failure (may be NULL)
+ * @param err_size Size of err
+ * @return Newly allocated row-major cell array (caller frees), or NULL
+ * 
+ * @details
+ * Every cell must be in range and the stored occupancy index must match
+ * the cells, so a file that reads successfully is safe to use as is.
+ */
+static Cell* read_binary_canvas(const char *filename, int *width, int *height,
+                                char *err, size_t err_size) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        report_error(err, err_size, "%s", strerror(errno));
+        return NULL;
+    }
+    
+    BinaryHeader header;
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0 || fread(&header, sizeof(header), 1, f) != 1) {
+        report_error(err, err_size, "truncated header");
+        fclose(f);
+        return NULL;
+    }
+    if (!binary_header_valid(&header, (uint64_t)st.st_size, err, err_size)) {
+        fclose(f);
+        return NULL;
+    }
+    
+    int w = (int)header.width, h = (int)header.height;
+    size_t glyph_count = header.glyph_count, style_count = header.style_count;
+    RowSpan *spans = malloc((size_t)h * sizeof(RowSpan));
+    Cell *cells = malloc((size_t)w * (size_t)h * sizeof(Cell));
+    uint32_t *codes = malloc((glyph_count + 1) * sizeof(uint32_t));
+    GlyphId *remap = malloc((glyph_count + 1) * sizeof(GlyphId));
+    Style *styles = malloc((style_count + 1) * sizeof(Style));
+    StyleId *style_remap = malloc((style_count + 1) * sizeof(StyleId));
+    bool allocated = spans && cells && codes && remap && styles && style_remap;
+    bool ok = allocated &&
+              fread(spans, sizeof(RowSpan), (size_t)h, f) == (size_t)h &&
+              fseek(f, (long)header.cells_offset, SEEK_SET) == 0 &&
+              fread(cells, sizeof(Cell), (size_t)w * (size_t)h, f) == (size_t)w * (size_t)h &&
+              fread(codes, sizeof(uint32_t), glyph_count, f) == glyph_count &&
+              fread(styles, sizeof(Style), style_count, f) == style_count;
+    fclose(f);
+    if (!ok) {
+        report_error(err, err_size, allocated ? "read error" : "out of memory");
+    }
+    
+    // The file's glyph and style IDs become this thread's IDs for the same values
+    for (size_t i = 0; ok && i < glyph_count; ++i) {
+        if (codes[i] < GLYPH_DIRECT || !glyph_code_valid(codes[i])) {
+            report_error(err, err_size, "glyph table entry %zu: bad code point", i + 1);
+            ok = false;
+        }
+        remap[i] = ok ? glyph_intern(codes[i]) : 0;
+    }
+    for (size_t i = 0; ok && i < style_count; ++i) {
+        if (!color_spec_valid(styles[i].fg) || !color_spec_valid(styles[i].bg)) {
+            report_error(err, err_size, "style table entry %zu: bad color", i + 1);
+            ok = false;
+        }
+        style_remap[i] = ok ? style_intern(styles[i]) : 0;
+    }
+    
+    for (int y = 0; ok && y < h; ++y) {
+        RowSpan found = { -1, -1, 0 };
+        for (int x = 0; x < w; ++x) {
+            Cell *cell = &cells[(size_t)y * w + x];
+            if (cell->color >= STYLE_DIRECT + style_count ||
+                cell->glyph >= GLYPH_DIRECT + glyph_count) {
+                report_error(err, err_size, "row %d, column %d: bad cell", y + 1, x + 1);
+                ok = false;
+                break;
+            }
+            if (cell->glyph >= GLYPH_DIRECT) cell->glyph = remap[cell->glyph - GLYPH_DIRECT];
+            if (cell->color >= STYLE_DIRECT) cell->color = style_remap[cell->color - STYLE_DIRECT];
+            if (cell_is_blank(cell)) continue;
+            if (found.count++ == 0) found.first = x;
+            found.last = x;
+        }
+        if (ok && memcmp(&found, &spans[y], sizeof(found)) != 0) {
+            report_error(err, err_size, "row %d: occupancy index does not match cells", y + 1);
+            ok = false;
+        }
+    }
+    
+    free(spans);
+    free(codes);
+    free(remap);
+    free(styles);
+    free(style_remap);
+    if (!ok) {
+        free(cells);
+        return NULL;
+    }
+    *width = w;
+    *height = h;
+    return cells;
+}
+
+/**
+ * @brief Check whether a filename has a given extension
+ * @param filename File name
+ * @param ext Extension including the dot
+ * @return true on a match
+ */
+static bool has_extension(const char *filename, const char *ext) {
+    const char *dot = strrchr(filename, '.');
+    return dot && strcmp(dot, ext) == 0;
+}
+
+/**
+ * @brief Read a canvas file in either format, picked by extension
+ * @param filename Source filename; .bin is binary, anything else is text
+ * @param width Out: width of the stored canvas
+ * @param height Out: height of the stored canvas
+ * @return Newly allocated row-major cell array (caller frees), or NULL
+ */
+static Cell* read_any_canvas(const char *filename, int *width, int *height) {
+    if (has_extension(filename, ".bin")) {
+        return read_binary_canvas(filename, width, height, NULL, 0);
+    }
+    return read_canvas_file(filename, width, height);
+}
+
+/**
+ * @brief Strictly parse canvas text held in memory
+ * @param text NUL-terminated file contents
+ * @param width Out: width of the stored canvas
+ * @param height Out: height of the stored canvas
+ * @param err Out: reason and line on failure (may be NULL)
+ * @param err_size Size of err
+ * @return Newly allocated row-major cell array (caller frees), or NULL
+ */
+static Cell* parse_canvas_text(const char *text, int *width, int *height,
+                               char *err, size_t err_size) {
+    char *end;
+    long w = strtol(text, &end, 10);
+    long h = strtol(end, &end, 10);
+    const char *p = end;
+    
+    // Header: "width height"
+    while (*p == ' ' || *p == '\t' || *p == '\r') ++p;
+    if (w <= 0 || h <= 0 || w > MAX_CANVAS_WIDTH || h > MAX_CANVAS_HEIGHT || *p != '\n') {
+        report_error(err, err_size, "line 1: bad header");
+        return NULL;
+    }
+    ++p;
+    
+    Cell *cells = malloc((size_t)w * (size_t)h * sizeof(Cell));
+    if (!cells) {
+        report_error(err, err_size, "out of memory");
+        return NULL;
+    }
+    
+    int line = 1;
+    for (long y = 0; y < h; ++y) {
+        ++line;
+        for (long x = 0; x < w; ++x) {
+            unsigned code = 0;
+            int digits = 0;
+            StyleId color = 0;
+            
+            while (*p == ' ' || *p == '\t') ++p;
+            if (*p == '\n' || *p == '\r') {
+                report_error(err, err_size, "line %d: %ld cells, expected %ld", line, x, w);
+                free(cells);
+                return NULL;
+            }
+            if (!style_parse(&p, &color) || *p != ',') {
+                report_error(err, err_size, *p ? "line %d: bad token at cell %ld"
+                                               : "line %d: file ends at cell %ld", line, x + 1);
+                free(cells);
+                return NULL;
+            }
+            ++p;
+            for (digits = 0; *p >= '0' && *p <= '9' && digits < 8; ++digits) {
+                code = code * 10 + (unsigned)(*p++ - '0');
+            }
+            if (digits == 0 || !glyph_code_valid(code)) {
+                report_error(err, err_size, "line %d: cell %ld out of range", line, x + 1);
+                free(cells);
+                return NULL;
+            }
+            cells[y * w + x] = make_cell(glyph_intern(code), color);
+        }
+        
+        while (*p == ' ' || *p == '\t' || *p == '\r') ++p;
+        if (*p != '\n' && *p != '\0') {
+            report_error(err, err_size, "line %d: more than %ld cells", line, w);
+            free(cells);
+            return NULL;
+        }
+        if (*p) ++p;
+    }
+    
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') ++p;
+    if (*p) {
+        report_error(err, err_size, "line %d: data after the last row", line + 1);
+        free(cells);
+        return NULL;
+    }
+    
+    *width = (int)w;
+    *height = (int)h;
+    return cells;
+}
+
+/**
+ * @brief Strictly parse a canvas file in custom text format
+ * @param filename Source filename
+ * @param width Out: width of the stored canvas
+ * @param height Out: height of the stored canvas
+ * @param err Out: reason and line on failure (may be NULL)
+ * @param err_size Size of err
+ * @return Newly allocated row-major cell array (caller frees), or NULL
+ * 
+ * @details
+ * Unlike read_canvas_file(), which clamps bad values so damaged files
+ * still load, every row must hold exactly width "color,code" tokens with
+ * values in range, and nothing but whitespace may follow the last row.
+ * The whole file is read at once and parsed in memory.
+ */
+static Cell* parse_canvas_strict(const char *filename, int *width, int *height,
+                                 char *err, size_t err_size) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        report_error(err, err_size, "%s", strerror(errno));
+        return NULL;
+    }
+    
+    struct stat st;
+    char *text = NULL;
+    size_t size = 0;
+    if (fstat(fileno(f), &st) == 0) {
+        size = (size_t)st.st_size;
+        text = malloc(size + 1);
+    }
+    bool ok = text && fread(text, 1, size, f) == size;
+    fclose(f);
+    if (!ok) {
+        report_error(err, err_size, text ? "read error" : "out of memory");
+        free(text);
+        return NULL;
+    }
+    text[size] = '\0';
+    
+    Cell *cells = parse_canvas_text(text, width, height, err, err_size);
+    free(text);
+    return cells;
+}
+
+/**
+ * @brief Read and verify a canvas file in either format
+ * @param filename Source filename; .bin is binary, anything else is text
+ * @param width Out: width of the stored canvas
+ * @param height Out: height of the stored canvas
+ * @param err Out: reason on failure (may be NULL)
+ * @param err_size Size of err
+ * @return Newly allocated row-major cell array (caller frees), or NULL
+ */
+static Cell* read_canvas_strict(const char *filename, int *width, int *height,
+                                char *err, size_t err_size) {
+    if (has_extension(filename, ".bin")) {
+        return read_binary_canvas(filename, width, height, err, err_size);
+    }
+    return parse_canvas_strict(filename, width, height, err, err_size);
+}
+
+/*==============================================================================
+ * AUTOSAVE
+ *============================================================================*/
+
+/**
+ * @brief Copy the composite for the autosave thread
+ * @return Snapshot (free with snapshot_free()), or NULL if out of memory
+ * @details Only occupied rows are copied; blank rows are described by their
+ * index entry alone. This copy is all an autosave costs the main loop.
+ */
+static CanvasSnapshot* snapshot_canvas(void) {
+    int width = g_app.canvas_width, height = g_app.canvas_height;
+    CanvasSnapshot *snap = malloc(sizeof(CanvasSnapshot));
+    if (!snap) return NULL;
+    
+    snap->width = width;
+    snap->height = height;
+    snap->blank = g_app.canvas.blank;
+    snap->rows = malloc((size_t)height * sizeof(RowSpan));
+    snap->cells = malloc((size_t)width * (size_t)height * sizeof(Cell));
+    snap->glyph_count = g_app.glyphs.count;
+    snap->glyphs = malloc(((size_t)snap->glyph_count + 1) * sizeof(uint32_t));
+    snap->style_count = g_app.styles.count;
+    snap->styles = malloc(((size_t)snap->style_count + 1) * sizeof(Style));
+    if (!snap->rows || !snap->cells || !snap->glyphs || !snap->styles) {
+        snapshot_free(snap);
+        return NULL;
+    }
+    
+    // The writer thread has its own (empty) tables, so it gets copies
+    if (snap->glyph_count > 0) {
+        memcpy(snap->glyphs, g_app.glyphs.code, (size_t)snap->glyph_count * sizeof(uint32_t));
+    }
+    if (snap->style_count > 0) {
+        memcpy(snap->styles, g_app.styles.style, (size_t)snap->style_count * sizeof(Style));
+    }
+    
+    for (int y = 0; y < height; ++y) {
+        snap->rows[y] = row_occupancy(y);
+        if (snap->rows[y].count > 0) {
+            memcpy(&snap->cells[(size_t)y * width], peek_spot(0, y), (size_t)width * sizeof(Cell));
+        }
+    }
+    return snap;
+}
+
+/**
+ * @brief Free a snapshot
+ * @param snap Snapshot from snapshot_canvas() (or NULL)
+ */
+static void snapshot_free(CanvasSnapshot *snap) {
+    if (!snap) return;
+    free(snap->rows);
+    free(snap->cells);
+    free(snap->glyphs);
+    free(snap->styles);
+    free(snap);
+}
+
+/**
+ * @brief Write a snapshot in the binary format
+ * @param filename Target filename
+ * @param snap Snapshot
+ * @return true if the file was written completely
+ */
+static bool save_snapshot(const char *filename, const CanvasSnapshot *snap) {
+    BinaryHeader header = binary_header(snap->width, snap->height, snap->blank);
+    header.glyph_count = (uint32_t)snap->glyph_count;
+    header.style_count = (uint32_t)snap->style_count;
+    Cell *blank_row = malloc((size_t)snap->width * sizeof(Cell));
+    if (!blank_row) return false;
+    for (int x = 0; x < snap->width; ++x) {
+        blank_row[x] = snap->blank;
+    }
+    
+    StreamWriter *w = sw_open(filename);
+    if (!w) {
+        free(blank_row);
+        return false;
+    }
+    
+    sw_write(w, (const char *)&header, sizeof(header));
+    sw_write(w, (const char *)snap->rows, (size_t)snap->height * sizeof(RowSpan));
+    
+    static const char zeros[BINARY_ALIGN] = { 0 };
+    size_t used = header.rows_offset + (size_t)snap->height * sizeof(RowSpan);
+    sw_write(w, zeros, header.cells_offset - used);
+    
+    size_t row_bytes = (size_t)snap->width * sizeof(Cell);
+    for (int y = 0; y < snap->height; ++y) {
+        const Cell *row = snap->rows[y].count > 0 ? &snap->cells[(size_t)y * snap->width]
+                                                  : blank_row;
+        sw_write(w, (const char *)row, row_bytes);
+    }
+    sw_write(w, (const char *)snap->glyphs, (size_t)snap->glyph_count * sizeof(uint32_t));
+    sw_write(w, (const char *)snap->styles, (size_t)snap->style_count * sizeof(Style));
+    
+    free(blank_row);
+    return sw_close(w);
+}
+
+/**
+ * @brief Format the name of a numbered backup
+ * @param out Output buffer
+ * @param size Size of out
+ * @param as Autosave state (for the stem)
+ * @param n Backup number (1 is the newest)
+ */
+static void backup_name(char *out, size_t size, const Autosave *as, int n) {
+    snprintf(out, size, "%s.%d.bin", as->stem, n);
+}
+
+/**
+ * @brief Write a snapshot as backup 1, shifting older backups up by one
+ * @param as Autosave state
+ * @param snap Snapshot
+ * @return 0 on success, else the errno of the step that failed
+ * 
+ * @details The snapshot is written to a temporary file first and renamed
+ * into place, so a crash mid-write never leaves a truncated backup.
+ * Backup number as->backups is the oldest kept and is dropped. If a step
+ * fails, the temporary file is removed and the backups already shifted
+ * are moved back; only the dropped oldest backup is not restored.
+ */
+static int write_backup(const Autosave *as, const CanvasSnapshot *snap) {
+    char from[PATH_MAX + 16], to[PATH_MAX + 16], older[PATH_MAX + 16];
+    snprintf(from, sizeof(from), "%s.autosave.tmp", as->stem);
+    if (!save_snapshot(from, snap)) {
+        int err = errno ? errno : EIO;  // unlink() below may change errno
+        unlink(from);
+        return err;
+    }
+    
+    // Shift n to n + 1, oldest first; renaming onto as->backups drops it
+    bool moved[AUTOSAVE_MAX_BACKUPS + 1] = { false };
+    int err = 0, n;
+    for (n = as->backups - 1; n >= 1; --n) {
+        backup_name(older, sizeof(older), as, n);
+        backup_name(to, sizeof(to), as, n + 1);
+        if (rename(older, to) == 0) {
+            moved[n] = true;
+        } else if (errno != ENOENT) {
+            err = errno;
+            break;
+        }
+    }
+    if (!err) {
+        backup_name(to, sizeof(to), as, 1);
+        if (rename(from, to) == 0) return 0;
+        err = errno;
+    }
+    
+    // Undo the shifts, lowest first so each target slot is free again
+    for (int k = n + 1; k < as->backups; ++k) {
+        if (!moved[k]) continue;
+        backup_name(older, sizeof(older), as, k + 1);
+        backup_name(to, sizeof(to), as, k);
+        if (rename(older, to) != 0) { /* leave it shifted; nothing is lost */ }
+    }
+    unlink(from);
+    return err;
+}
+
+/**
+ * @brief Autosave thread: write snapshots as they are handed over
+ * @param arg Autosave state (owned by the main thread's g_app)
+ * @return NULL
+ * @details A pending snapshot is still written when asked to stop, so the
+ * last autosave before quitting is not lost. Each outcome is reported back
+ * to autosave_tick(): an errno on failure, the written hash on success.
+ */
+static void* autosave_main(void *arg) {
+    Autosave *as = arg;
+    
+    pthread_mutex_lock(&as->lock);
+    for (;;) {
+        while (!as->pending && !as->stop) {
+            pthread_cond_wait(&as->wake, &as->lock);
+        }
+        if (!as->pending) break;
+        
+        CanvasSnapshot *snap = as->pending;
+        uint64_t hash = as->pending_hash, edit = as->pending_edit;
+        as->pending = NULL;
+        pthread_mutex_unlock(&as->lock);
+        
+        int err = write_backup(as, snap);
+        snapshot_free(snap);
+        
+        pthread_mutex_lock(&as->lock);
+        if (err) {
+            atomic_store(&as->error, err);
+        } else {
+            as->written_hash = hash;
+            as->written_edit = edit;
+            atomic_store(&as->written, true);
+        }
+    }
+    pthread_mutex_unlock(&as->lock);
+    return NULL;
+}
+
+/**
+ * @brief Start autosaving if an interval or edit count was configured
+ * @return false if the writer thread could not be started
+ * @details Backups are named after the --save file with its extension
+ * replaced: paint_save.txt autosaves to paint_save.1.bin, paint_save.2.bin...
+ */
+static bool autosave_start(void) {
+    Autosave *as = &g_app.autosave;
+    if (as->interval_s == 0 && as->every_edits == 0) return true;
+    
+    // Stem: the save path up to its extension
+    const char *path = g_app.save.path;
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    size_t len = (dot && (!slash || dot > slash)) ? (size_t)(dot - path) : strlen(path);
+    if (len >= sizeof(as->stem)) return false;
+    memcpy(as->stem, path, len);
+    as->stem[len] = '\0';
+    
+    // The canvas as it starts out needs no backup
+    as->saved_edit = g_app.save.edits;
+    as->saved_hash = as->queued_hash = canvas_hash();
+    as->next_us = now_usec() + (int64_t)as->interval_s * 1000000;
+    as->retry_us = 0;
+    as->pending = NULL;
+    as->stop = false;
+    atomic_store(&as->error, 0);
+    atomic_store(&as->written, false);
+    
+    if (pthread_mutex_init(&as->lock, NULL) != 0) return false;
+    if (pthread_cond_init(&as->wake, NULL) != 0) {
+        pthread_mutex_destroy(&as->lock);
+        return false;
+    }
+    if (pthread_create(&as->thread, NULL, autosave_main, as) != 0) {
+        pthread_cond_destroy(&as->wake);
+        pthread_mutex_destroy(&as->lock);
+        return false;
+    }
+    as->running = true;
+    return true;
+}
+
+/**
+ * @brief Stop the autosave thread after it writes any pending snapshot
+ */
+static void autosave_stop(void) {
+    Autosave *as = &g_app.autosave;
+    if (!as->running) return;
+    
+    pthread_mutex_lock(&as->lock);
+    as->stop = true;
+    pthread_cond_signal(&as->wake);
+    pthread_mutex_unlock(&as->lock);
+    
+    pthread_join(as->thread, NULL);
+    pthread_cond_destroy(&as->wake);
+    pthread_mutex_destroy(&as->lock);
+    as->running = false;
+}
+
+/**
+ * @brief Time until the autosave interval is next due
+ * @return Milliseconds, or -1 when there is no interval
+ */
+static int autosave_wait_ms(void) {
+    const Autosave *as = &g_app.autosave;
+    if (!as->running || as->interval_s == 0) return -1;
+    
+    int64_t remaining = as->next_us - now_usec();
+    if (remaining <= 0) return 0;
+    return (int)((remaining + 999) / 1000);
+}
+
+/**
+ * @brief Hand a snapshot to the autosave thread if one is due
+ * 
+ * @details
+ * An autosave is due when the interval has elapsed or the composite has
+ * taken every_edits row edits since the last backup. Nothing is written
+ * when the edit counter has not moved or the content hash matches the last
+ * backup, or the snapshot already handed over. The last backup only
+ * advances when the writer reports success, so a failed backup is tried
+ * again, no sooner than AUTOSAVE_RETRY_MS later. The main loop only pays
+ * for the hash and snapshot_canvas(); a snapshot not yet picked up is
+ * replaced by the newer one.
+ */
+static void autosave_tick(void) {
+    Autosave *as = &g_app.autosave;
+    if (!as->running) return;
+    
+    int64_t now = now_usec();
+    int err = atomic_exchange(&as->error, 0);
+    if (err) {
+        set_status_message("Autosave failed: %s", strerror(err));
+        as->queued_hash = as->saved_hash;
+        as->retry_us = now + (int64_t)AUTOSAVE_RETRY_MS * 1000;
+    }
+    if (atomic_load(&as->written)) {
+        pthread_mutex_lock(&as->lock);
+        as->saved_hash = as->written_hash;
+        as->saved_edit = as->written_edit;
+        atomic_store(&as->written, false);
+        pthread_mutex_unlock(&as->lock);
+    }
+    
+    uint64_t edits = g_app.save.edits;
+    bool due = (as->interval_s > 0 && now >= as->next_us) ||
+               (as->every_edits > 0 && edits - as->saved_edit >= (uint64_t)as->every_edits);
+    if (!due || now < as->retry_us) return;
+    if (as->interval_s > 0) {
+        as->next_us = now + (int64_t)as->interval_s * 1000000;
+    }
+    
+    // Playback and mapped documents only show part of the picture
+    if (edits == as->saved_edit || g_app.timeline.playing || g_app.document.map) return;
+    
+    uint64_t hash = canvas_hash();
+    if (hash == as->saved_hash) {
+        as->saved_edit = edits;  // Back to the content of the last backup
+    } else if (hash != as->queued_hash) {
+        CanvasSnapshot *snap = snapshot_canvas();
+        if (!snap) return;
+        
+        pthread_mutex_lock(&as->lock);
+        snapshot_free(as->pending);
+        as->pending = snap;
+        as->pending_hash = hash;
+        as->pending_edit = edits;
+        pthread_cond_signal(&as->wake);
+        pthread_mutex_unlock(&as->lock);
+        as->queued_hash = hash;
+    }
+}
+
+/*==============================================================================
+ * SIMD KERNELS
+ *============================================================================*/
+
+/**
+ * @brief Add a row of bytes into 32-bit accumulators (scalar reference)
+ * @param acc Accumulators, one per byte
+ * @param src Source bytes
+ * @param n Number of bytes
+ */
+static void accumulate_bytes_scalar(uint32_t *acc, const uint8_t *src, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        acc[i] += src[i];
+    }
+}
+
+/**
+ * @brief Compute luminance and palette index for planar RGB (scalar reference)
+ * @param r Red samples
+ * @param g Green samples
+ * @param b Blue samples
+ * @param n Number of samples
+ * @param luma Out: Rec.601 luminance, (77R + 150G + 29B) >> 8
+ * @param color Out: base color index; a channel's bit is set when it is at
+ *        least half of the brightest channel, so hue survives in dark areas
+ */
+static void classify_rgb_scalar(const uint8_t *r, const uint8_t *g, const uint8_t *b,
+                                size_t n, uint8_t *luma, uint8_t *color) {
+    for (size_t i = 0; i < n; ++i) {
+        unsigned max = r[i] > g[i] ? r[i] : g[i];
+        if (b[i] > max) max = b[i];
+        unsigned half = (max + 1) >> 1;
+        
+        luma[i] = (uint8_t)((77u * r[i] + 150u * g[i] + 29u * b[i]) >> 8);
+        color[i] = (uint8_t)((r[i] >= half ? 1 : 0) |
+                             (g[i] >= half ? 2 : 0) |
+                             (b[i] >= half ? 4 : 0));
+    }
+}
+
+/**
+ * @brief Count leading cells equal to a given cell (scalar reference)
+ * @param cells Cells to scan
+ * @param n Number of cells
+ * @param bits Cell value as returned by cell_bits()
+ * @return Index of the first differing cell, or n if all are equal
+ */
+static size_t skip_equal_cells_scalar(const Cell *cells, size_t n, uint32_t bits) {
+    size_t i = 0;
+    while (i < n && cell_bits(cells[i]) == bits) ++i;
+    return i;
+}
+
+/**
+ * @brief Find the first cell matching a pattern under a mask (scalar reference)
+ * @param cells Cells to scan
+ * @param n Number of cells
+ * @param bits Pattern as returned by cell_bits(), already masked
+ * @param mask Cell bits that take part in the comparison
+ * @return Index of the first matching cell, or n if none match
+ */
+static size_t find_matching_cell_scalar(const Cell *cells, size_t n, uint32_t bits, uint32_t mask) {
+    size_t i = 0;
+    while (i < n && (cell_bits(cells[i]) & mask) != bits) ++i;
+    return i;
+}
+
+#if HAVE_SSE2
+/**
+ * @brief SSE2 version of find_matching_cell_scalar(), 4 cells per compare
+ */
+static size_t find_matching_cell_sse2(const Cell *cells, size_t n, uint32_t bits, uint32_t mask) {
+    const __m128i needle = _mm_set1_epi32((int)bits);
+    const __m128i vmask = _mm_set1_epi32((int)mask);
+    size_t i = 0;
+    
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *)(cells + i)), vmask);
+        unsigned hits = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi32(v, needle));
+        if (hits != 0) {
+            return i + (size_t)__builtin_ctz(hits) / sizeof(Cell);
+        }
+    }
+    return i + find_matching_cell_scalar(cells + i, n - i, bits, mask);
+}
+
+/**
+ * @brief SSE2 version of skip_equal_cells_scalar(), 4 cells per compare
+ */
+static size_t skip_equal_cells_sse2(const Cell *cells, size_t n, uint32_t bits) {
+    const __m128i needle = _mm_set1_epi32((int)bits);
+    size_t i = 0;
+    
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(cells + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi32(v, needle));
+        if (mask != 0xFFFFu) {
+            return i + (size_t)__builtin_ctz(~mask) / sizeof(Cell);
+        }
+    }
+    return i + skip_equal_cells_scalar(cells + i, n - i, bits);
+}
+
+/**
+ * @brief SSE2 version of accumulate_bytes_scalar(), 16 bytes per step
+ */
+static void accumulate_bytes_sse2(uint32_t *acc, const uint8_t *src, size_t n) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        __m128i *a = (__m128i *)(acc + i);
+        
+        _mm_storeu_si128(a + 0, _mm_add_epi32(_mm_loadu_si128(a + 0), _mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_si128(a + 2, _mm_add_epi32(_mm_loadu_si128(a + 2), _mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_si128(a + 3, _mm_add_epi32(_mm_loadu_si128(a + 3), _mm_unpackhi_epi16(hi, zero)));
+    }
+    accumulate_bytes_scalar(acc + i, src + i, n - i);
+}
+
+/**
+ * @brief Bits of the palette index for one channel (SSE2 helper)
+ * @return bit in every lane where channel >= half, 0 elsewhere
+ */
+static inline __m128i channel_bit_sse2(__m128i c, __m128i half, __m128i bit) {
+    __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(c, half), c);
+    return _mm_and_si128(ge, bit);
+}
+
+/**
+ * @brief SSE2 version of classify_rgb_scalar(), 16 samples per step
+ */
+static void classify_rgb_sse2(const uint8_t *r, const uint8_t *g, const uint8_t *b,
+                              size_t n, uint8_t *luma, uint8_t *color) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i wr = _mm_set1_epi16(77), wg = _mm_set1_epi16(150), wb = _mm_set1_epi16(29);
+    size_t i = 0;
+    
+    for (; i + 16 <= n; i += 16) {
+        __m128i vr = _mm_loadu_si128((const __m128i *)(r + i));
+        __m128i vg = _mm_loadu_si128((const __m128i *)(g + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        
+        // 16-bit weighted sums cannot overflow: 255 * 256 < 65536
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(
+                         _mm_mullo_epi16(_mm_unpacklo_epi8(vr, zero), wr),
+                         _mm_mullo_epi16(_mm_unpacklo_epi8(vg, zero), wg)),
+                         _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(
+                         _mm_mullo_epi16(_mm_unpackhi_epi8(vr, zero), wr),
+                         _mm_mullo_epi16(_mm_unpackhi_epi8(vg, zero), wg)),
+                         _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+        _mm_storeu_si128((__m128i *)(luma + i),
+                         _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+        
+        __m128i max = _mm_max_epu8(_mm_max_epu8(vr, vg), vb);
+        __m128i half = _mm_avg_epu8(max, zero);
+        __m128i idx = _mm_or_si128(_mm_or_si128(
+                          channel_bit_sse2(vr, half, _mm_set1_epi8(1)),
+                          channel_bit_sse2(vg, half, _mm_set1_epi8(2))),
+                          channel_bit_sse2(vb, half, _mm_set1_epi8(4)));
+        _mm_storeu_si128((__m128i *)(color + i), idx);
+    }
+    classify_rgb_scalar(r + i, g + i, b + i, n - i, luma + i, color + i);
+}
+#endif
+
+#if HAVE_AVX2
+/**
+ * @brief AVX2 version of skip_equal_cells_scalar(), 8 cells per compare
+ */
+__attribute__((target("avx2")))
+static size_t skip_equal_cells_avx2(const Cell *cells, size_t n, uint32_t bits) {
+    const __m256i needle = _mm256_set1_epi32((int)bits);
+    size_t i = 0;
+    
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(cells + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi32(v, needle));
+        if (mask != 0xFFFFFFFFu) {
+            return i + (size_t)__builtin_ctz(~mask) / sizeof(Cell);
+        }
+    }
+    return i + skip_equal_cells_scalar(cells + i, n - i, bits);
+}
+
+/**
+ * @brief AVX2 version of find_matching_cell_scalar(), 8 cells per compare
+ */
+__attribute__((target("avx2")))
+static size_t find_matching_cell_avx2(const Cell *cells, size_t n, uint32_t bits, uint32_t mask) {
+    const __m256i needle = _mm256_set1_epi32((int)bits);
+    const __m256i vmask = _mm256_set1_epi32((int)mask);
+    size_t i = 0;
+    
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(cells + i)), vmask);
+        unsigned hits = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi32(v, needle));
+        if (hits != 0) {
+            return i + (size_t)__builtin_ctz(hits) / sizeof(Cell);
+        }
+    }
+    return i + find_matching_cell_scalar(cells + i, n - i, bits, mask);
+}
+
+/**
+ * @brief AVX2 version of accumulate_bytes_scalar(), 32 bytes per step
+ */
+__attribute__((target("avx2")))
+static void accumulate_bytes_avx2(uint32_t *acc, const uint8_t *src, size_t n) {
+    size_t i = 0;
+    
+    for (; i + 32 <= n; i += 32) {
+        for (int k = 0; k < 4; ++k) {
+            __m128i v = _mm_loadl_epi64((const __m128i *)(src + i + 8 * k));
+            __m256i *a = (__m256i *)(acc + i + 8 * k);
+            _mm256_storeu_si256(a, _mm256_add_epi32(_mm256_loadu_si256(a),
+                                                    _mm256_cvtepu8_epi32(v)));
+        }
+    }
+    accumulate_bytes_scalar(acc + i, src + i, n - i);
+}
+
+/**
+ * @brief Bits of the palette index for one channel (AVX2 helper)
+ */
+__attribute__((target("avx2")))
+static inline __m256i channel_bit_avx2(__m256i c, __m256i half, __m256i bit) {
+    __m256i ge = _mm256_cmpeq_epi8(_mm256_max_epu8(c, half), c);
+    return _mm256_and_si256(ge, bit);
+}
+
+/**
+ * @brief Weighted 16-bit luminance sums of 16 samples (AVX2 helper)
+ */
+__attribute__((target("avx2")))
+static inline __m256i luma_sum_avx2(__m128i r, __m128i g, __m128i b) {
+    return _mm256_add_epi16(_mm256_add_epi16(
+               _mm256_mullo_epi16(_mm256_cvtepu8_epi16(r), _mm256_set1_epi16(77)),
+               _mm256_mullo_epi16(_mm256_cvtepu8_epi16(g), _mm256_set1_epi16(150))),
+               _mm256_mullo_epi16(_mm256_cvtepu8_epi16(b), _mm256_set1_epi16(29)));
+}
+
+/**
+ * @brief AVX2 version of classify_rgb_scalar(), 32 samples per step
+ */
+__attribute__((target("avx2")))
+static void classify_rgb_avx2(const uint8_t *r, const uint8_t *g, const uint8_t *b,
+                              size_t n, uint8_t *luma, uint8_t *color) {
+    size_t i = 0;
+    
+    for (; i + 32 <= n; i += 32) {
+        __m256i vr = _mm256_loadu_si256((const __m256i *)(r + i));
+        __m256i vg = _mm256_loadu_si256((const __m256i *)(g + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        
+        __m256i lo = luma_sum_avx2(_mm256_castsi256_si128(vr), _mm256_castsi256_si128(vg),
+                                   _mm256_castsi256_si128(vb));
+        __m256i hi = luma_sum_avx2(_mm256_extracti128_si256(vr, 1), _mm256_extracti128_si256(vg, 1),
+                                   _mm256_extracti128_si256(vb, 1));
+        // packus works per 128-bit lane; restore sample order afterwards
+        __m256i packed = _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8));
+        _mm256_storeu_si256((__m256i *)(luma + i), _mm256_permute4x64_epi64(packed, 0xD8));
+        
+        __m256i max = _mm256_max_epu8(_mm256_max_epu8(vr, vg), vb);
+        __m256i half = _mm256_avg_epu8(max, _mm256_setzero_si256());
+        __m256i idx = _mm256_or_si256(_mm256_or_si256(
+                          channel_bit_avx2(vr, half, _mm256_set1_epi8(1)),
+                          channel_bit_avx2(vg, half, _mm256_set1_epi8(2))),
+                          channel_bit_avx2(vb, half, _mm256_set1_epi8(4)));
+        _mm256_storeu_si256((__m256i *)(color + i), idx);
+    }
+    classify_rgb_scalar(r + i, g + i, b + i, n - i, luma + i, color + i);
+}
+#endif
+
+/**
+ * @brief Pick the widest kernels the running CPU supports
+ * @details Called once at startup, before any kernel is used.
+ */
+static void select_simd_kernels(void) {
+    simd.accumulate_bytes = accumulate_bytes_scalar;
+    simd.classify_rgb = classify_rgb_scalar;
+    simd.skip_equal_cells = skip_equal_cells_scalar;
+    simd.find_matching_cell = find_matching_cell_scalar;
+#if HAVE_SSE2
+    simd.accumulate_bytes = accumulate_bytes_sse2;
+    simd.classify_rgb = classify_rgb_sse2;
+    simd.skip_equal_cells = skip_equal_cells_sse2;
+    simd.find_matching_cell = find_matching_cell_sse2;
+#endif
+#if HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        simd.accumulate_bytes = accumulate_bytes_avx2;
+        simd.classify_rgb = classify_rgb_avx2;
+        simd.skip_equal_cells = skip_equal_cells_avx2;
+        simd.find_matching_cell = find_matching_cell_avx2;
+    }
+#endif
+}
+
+/*==============================================================================
+ * IMAGE IMPORT
+ *============================================================================*/
+
+/**
+ * @brief Read the next unsigned integer from a PNM header or ASCII body
+ * @param f File stream
+ * @param value Out: parsed value
+ * @return true on success
+ * @details Skips whitespace and '#' comments before the number.
+ */
+static bool pnm_read_uint(FILE *f, int *value) {
+    int c = fgetc(f);
+    
+    for (;;) {
+        if (c == '#') {
+            while (c != '\n' && c != EOF) c = fgetc(f);
+        } else if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            c = fgetc(f);
+        } else {
+            break;
+        }
     }
+    if (c < '0' || c > '9') return false;
     
-    fclose(f);
+    long v = 0;
+    while (c >= '0' && c <= '9') {
+        v = v * 10 + (c - '0');
+        if (v > 1000000) return false;
+        c = fgetc(f);
+    }
+    
+    // Exactly one whitespace byte separates the header from binary data
+    if (c != EOF && !(c == ' ' || c == '\t' || c == '\r' || c == '\n')) {
+        ungetc(c, f);
+    }
+    *value = (int)v;
+    return true;
 }
 
 /**
- * @brief Load a canvas from a file and overlay onto current canvas
- * @param filename Source filename (NULL uses DEFAULT_SAVE_FILE)
+ * @brief Open a PPM or PGM image and parse its header
+ * @param img Reader to initialize
+ * @param filename Image filename (P2, P3, P5 or P6)
+ * @return true on success; on failure nothing needs closing
+ */
+static bool pnm_open(PnmReader *img, const char *filename) {
+    memset(img, 0, sizeof(*img));
+    
+    img->f = fopen(filename, "rb");
+    if (!img->f) return false;
+    
+    char magic[2];
+    if (fread(magic, 1, 2, img->f) != 2 || magic[0] != 'P' ||
+        magic[1] < '2' || magic[1] > '6' || magic[1] == '4') {
+        fclose(img->f);
+        return false;
+    }
+    img->ascii = (magic[1] == '2' || magic[1] == '3');
+    img->channels = (magic[1] == '3' || magic[1] == '6') ? 3 : 1;
+    
+    if (!pnm_read_uint(img->f, &img->width) || !pnm_read_uint(img->f, &img->height) ||
+        !pnm_read_uint(img->f, &img->maxval) || img->width <= 0 || img->height <= 0 ||
+        img->maxval <= 0 || img->maxval > 65535) {
+        fclose(img->f);
+        return false;
+    }
+    
+    size_t sample_bytes = (img->maxval > 255) ? 2 : 1;
+    img->raw = malloc((size_t)img->width * (size_t)img->channels * sample_bytes);
+    if (!img->raw) {
+        fclose(img->f);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Read the next pixel row as interleaved 8-bit RGB
+ * @param img Open reader
+ * @param rgb Out: width * 3 bytes
+ * @return true on success, false on truncated or malformed data
+ */
+static bool pnm_read_row(PnmReader *img, uint8_t *rgb) {
+    size_t samples = (size_t)img->width * (size_t)img->channels;
+    size_t sample_bytes = (img->maxval > 255) ? 2 : 1;
+    
+    if (!img->ascii && fread(img->raw, sample_bytes, samples, img->f) != samples) {
+        return false;
+    }
+    
+    for (size_t i = 0; i < samples; ++i) {
+        int v;
+        if (img->ascii) {
+            if (!pnm_read_uint(img->f, &v)) return false;
+            if (v > img->maxval) v = img->maxval;
+        } else if (sample_bytes == 2) {
+            v = (img->raw[2 * i] << 8) | img->raw[2 * i + 1];
+        } else {
+            v = img->raw[i];
+        }
+        
+        uint8_t s = (uint8_t)((img->maxval == 255) ? v : (v * 255 + img->maxval / 2) / img->maxval);
+        if (img->channels == 3) {
+            rgb[i] = s;
+        } else {
+            rgb[3 * i] = rgb[3 * i + 1] = rgb[3 * i + 2] = s;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Close an image reader
+ * @param img Reader opened by pnm_open()
+ */
+static void pnm_close(PnmReader *img) {
+    fclose(img->f);
+    free(img->raw);
+}
+
+/**
+ * @brief Convert an image into cells at the top-left of the canvas
+ * @param img Open reader positioned at the first pixel row
+ * @param cols Target width in cells (clamped to image width)
+ * @param rows Target height in cells (clamped to image height)
+ * @return true on success
  * 
  * @details
- * Loading behavior:
- * - Reads canvas data from file in custom text format
- * - Overlays loaded data onto current canvas (preserving canvas size)
- * - If loaded canvas is smaller: only overlapping region is affected
- * - If loaded canvas is larger: clipped to current canvas boundaries
- * - Invalid files or read errors are silently ignored
- * - Canvas is automatically re-rendered after successful load
- * 
- * @note Memory allocation failures result in graceful abort
+ * The image is streamed one pixel row at a time. Each band of pixel rows
+ * that maps to one cell row is summed column-wise into 32-bit accumulators,
+ * then box-averaged per cell. Luminance picks a character from the
+ * density-ordered brush ramp (darkest is blank, brightest the first brush)
+ * and the averaged RGB picks the nearest base color hue. Both per-pixel
+ * accumulation and per-cell classification run through the SIMD kernels.
  */
-static void load_masterpiece(const char *filename) {
-    if (!filename) filename = DEFAULT_SAVE_FILE;
+static bool import_image(PnmReader *img, int cols, int rows) {
+    if (cols > img->width) cols = img->width;
+    if (rows > img->height) rows = img->height;
+    if (cols <= 0 || rows <= 0) return false;
     
-    FILE *f = fopen(filename, "r");
-    if (!f) return;
+    size_t row_bytes = (size_t)img->width * 3;
+    uint8_t *rgb = malloc(row_bytes);
+    uint32_t *acc = malloc(row_bytes * sizeof(uint32_t));
+    uint8_t *planes = malloc((size_t)cols * 5);
+    if (!rgb || !acc || !planes) {
+        free(rgb);
+        free(acc);
+        free(planes);
+        return false;
+    }
+    uint8_t *cell_r = planes, *cell_g = planes + cols, *cell_b = planes + 2 * cols;
+    uint8_t *luma = planes + 3 * cols, *color = planes + 4 * cols;
     
-    int file_width = 0, file_height = 0;
-    if (fscanf(f, "%d %d", &file_width, &file_height) != 2 ||
-        file_width <= 0 || file_height <= 0 ||
-        file_width > MAX_CANVAS_WIDTH || file_height > MAX_CANVAS_HEIGHT) {
-        fclose(f);
+    // Luminance ramp: level 0 is blank, then brushes from sparsest to densest
+    GlyphId ramp[256];
+    for (int l = 0; l < 256; ++l) {
+        int level = l * (IMPORT_RAMP_LEVELS + 1) / 256;
+        ramp[l] = (GlyphId)(level ? original_brush_chars[IMPORT_RAMP_LEVELS - level] : ' ');
+    }
+    
+    bool ok = true;
+    for (int cy = 0; cy < rows && ok; ++cy) {
+        int y0 = (int)((long)cy * img->height / rows);
+        int y1 = (int)((long)(cy + 1) * img->height / rows);
+        
+        memset(acc, 0, row_bytes * sizeof(uint32_t));
+        for (int y = y0; y < y1 && ok; ++y) {
+            ok = pnm_read_row(img, rgb);
+            if (ok) simd.accumulate_bytes(acc, rgb, row_bytes);
+        }
+        if (!ok) break;
+        
+        for (int cx = 0; cx < cols; ++cx) {
+            int x0 = (int)((long)cx * img->width / cols);
+            int x1 = (int)((long)(cx + 1) * img->width / cols);
+            uint32_t sum[3] = { 0, 0, 0 };
+            
+            for (int x = x0; x < x1; ++x) {
+                sum[0] += acc[3 * x];
+                sum[1] += acc[3 * x + 1];
+                sum[2] += acc[3 * x + 2];
+            }
+            uint32_t area = (uint32_t)(x1 - x0) * (uint32_t)(y1 - y0);
+            cell_r[cx] = (uint8_t)(sum[0] / area);
+            cell_g[cx] = (uint8_t)(sum[1] / area);
+            cell_b[cx] = (uint8_t)(sum[2] / area);
+        }
+        
+        simd.classify_rgb(cell_r, cell_g, cell_b, (size_t)cols, luma, color);
+        for (int cx = 0; cx < cols; ++cx) {
+            put_cell(cx, cy, make_cell(ramp[luma[cx]], color[cx]));
+        }
+    }
+    
+    free(rgb);
+    free(acc);
+    free(planes);
+    return ok;
+}
+
+/**
+ * @brief Choose a cell grid for an image, preserving its aspect ratio
+ * @param img Open reader
+ * @param max_cols Maximum width in cells
+ * @param max_rows Maximum height in cells (0 for no limit)
+ * @param cols Out: width in cells
+ * @param rows Out: height in cells
+ * @details Cells are assumed to be twice as tall as they are wide.
+ */
+static void import_grid_size(const PnmReader *img, int max_cols, int max_rows,
+                             int *cols, int *rows) {
+    *cols = max_cols;
+    *rows = (int)((long)img->height * max_cols / (2L * img->width));
+    
+    if (max_rows > 0 && *rows > max_rows) {
+        *rows = max_rows;
+        *cols = (int)(2L * img->width * max_rows / img->height);
+        if (*cols > max_cols) *cols = max_cols;
+    }
+    
+    // Cells are box-averaged, never upsampled
+    if (*cols > img->width) *cols = img->width;
+    if (*rows > img->height) *rows = img->height;
+    if (*cols < 1) *cols = 1;
+    if (*rows < 1) *rows = 1;
+}
+
+/**
+ * @brief Import an image onto the canvas and redraw
+ * @param filename Image filename (NULL uses DEFAULT_IMPORT_FILE)
+ * @details The image is scaled to fit the canvas and drawn from the
+ * top-left corner; the result is reported in the status bar.
+ */
+static void import_picture(const char *filename) {
+    if (!filename) filename = DEFAULT_IMPORT_FILE;
+    if (!active_layer_writable()) return;
+    
+    PnmReader img;
+    if (!pnm_open(&img, filename)) {
+        set_status_message("Import failed: cannot read PPM/PGM '%s'", filename);
         return;
     }
     
-    // Allocate temporary storage
-    size_t temp_size = (size_t)file_width * (size_t)file_height;
-    Cell *temp_canvas = malloc(temp_size * sizeof(Cell));
-    if (!temp_canvas) {
-        fclose(f);
+    int cols, rows;
+    import_grid_size(&img, g_app.canvas_width, g_app.canvas_height, &cols, &rows);
+    bool ok = import_image(&img, cols, rows);
+    pnm_close(&img);
+    
+    paint_entire_canvas();
+    if (ok) {
+        set_status_message("Imported %s (%dx%d cells)", filename, cols, rows);
+    } else {
+        set_status_message("Import failed: '%s' is truncated", filename);
+    }
+}
+
+/*==============================================================================
+ * COMMAND PROMPT
+ *============================================================================*/
+
+/**
+ * @brief Move the current foreground to the next 256-color palette entry
+ * @details An RGB foreground moves to its nearest palette entry instead;
+ * the background is kept.
+ */
+static void step_palette(void) {
+    Style style = style_of(g_app.current_color);
+    
+    if (style.fg & COLOR_RGB) {
+        unsigned char rgb[3];
+        palette_rgb(style.fg, rgb);
+        style.fg = (ColorSpec)nearest_palette(rgb, PALETTE_SIZE);
+    } else {
+        style.fg = (style.fg + 1) % PALETTE_SIZE;
+    }
+    g_app.current_color = style_intern(style);
+}
+
+/**
+ * @brief ":color FG[/BG]" - set both colors of the current style
+ * @param args Command arguments
+ */
+static void command_color(const char *args) {
+    StyleId color;
+    if (!parse_color(args, &color)) {
+        set_status_message("Usage: color FG[/BG] (a name, 0-255 or #rrggbb)");
+        return;
+    }
+    g_app.current_color = color;
+}
+
+/**
+ * @brief ":fg COLOR" / ":bg COLOR" - set one color of the current style
+ * @param args Command arguments
+ * @param background true to set the background
+ */
+static void command_set_color(const char *args, bool background) {
+    ColorSpec color;
+    const char *p = args;
+    if (!color_spec_parse(&p, &color) || *p) {
+        set_status_message("Usage: %s COLOR (a name, 0-255 or #rrggbb)", background ? "bg" : "fg");
         return;
     }
     
-    // Consume rest of header line
-    int ch;
-    do { 
-        ch = fgetc(f); 
-    } while (ch != '\n' && ch != EOF);
+    Style style = style_of(g_app.current_color);
+    if (background) style.bg = color; else style.fg = color;
+    g_app.current_color = style_intern(style);
+}
+
+/**
+ * @brief ":fg COLOR" - set the foreground of the current style
+ * @param args Command arguments
+ */
+static void command_fg(const char *args) {
+    command_set_color(args, false);
+}
+
+/**
+ * @brief ":bg COLOR" - set the background of the current style
+ * @param args Command arguments
+ */
+static void command_bg(const char *args) {
+    command_set_color(args, true);
+}
+
+/**
+ * @brief ":goto X Y" - move the cursor to a canvas (or document) coordinate
+ * @param args Command arguments
+ */
+static void command_goto(const char *args) {
+    int x, y, end = 0;
+    if (sscanf(args, "%d%*[ ,]%d %n", &x, &y, &end) != 2 || args[end]) {
+        set_status_message("Usage: goto X Y");
+        return;
+    }
+    goto_position(x, y);
+}
+
+/**
+ * @brief ":sym off|h|v|4|N" - choose mirror symmetry or N-fold radial symmetry
+ * @param args Command arguments
+ */
+static void command_sym(const char *args) {
+    static const struct { const char *name; int mode; } modes[] = {
+        { "off", SYMMETRY_OFF }, { "h", SYMMETRY_HORIZONTAL },
+        { "v", SYMMETRY_VERTICAL }, { "4", SYMMETRY_FOUR },
+    };
+    int folds = g_app.symmetry.folds ? g_app.symmetry.folds : SYMMETRY_DEFAULT_FOLDS;
     
-    // Read canvas data
-    bool read_success = true;
-    for (int y = 0; y < file_height && read_success; ++y) {
-        for (int x = 0; x < file_width && read_success; ++x) {
-            int color_val = 0, ascii_val = 32;
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i) {
+        if (strcmp(args, modes[i].name) == 0) {
+            symmetry_set(modes[i].mode, folds);
+            return;
+        }
+    }
+    
+    int end = 0;
+    if (sscanf(args, "%d %n", &folds, &end) != 1 || args[end] ||
+        folds < 2 || folds > SYMMETRY_MAX) {
+        set_status_message("Usage: sym off|h|v|4|N (N = 2-%d radial copies)", SYMMETRY_MAX);
+        return;
+    }
+    symmetry_set(SYMMETRY_RADIAL, folds);
+}
+
+/**
+ * @brief ":center [X Y]" - set the symmetry center (the cursor without arguments)
+ * @param args Command arguments
+ */
+static void command_center(const char *args) {
+    Symmetry *sym = &g_app.symmetry;
+    int x = g_app.cursor_x + g_app.document.view_x;
+    int y = g_app.cursor_y + g_app.document.view_y;
+    int end = 0;
+    
+    if (*args && (sscanf(args, "%d%*[ ,]%d %n", &x, &y, &end) != 2 || args[end])) {
+        set_status_message("Usage: center [X Y]");
+        return;
+    }
+    sym->centered = true;
+    sym->center_x = x;
+    sym->center_y = y;
+}
+
+/**
+ * @brief ":rotate 90|180|270" - rotate the selection or the active layer clockwise
+ * @param args Command arguments
+ */
+static void command_rotate(const char *args) {
+    int degrees, end = 0;
+    if (sscanf(args, "%d %n", &degrees, &end) != 1 || args[end] ||
+        (degrees != 90 && degrees != 180 && degrees != 270)) {
+        set_status_message("Usage: rotate 90|180|270");
+        return;
+    }
+    transform_rotate(degrees / 90);
+}
+
+/**
+ * @brief ":flip h|v" - mirror the selection or the active layer
+ * @param args Command arguments
+ */
+static void command_flip(const char *args) {
+    if (strcmp(args, "h") != 0 && strcmp(args, "v") != 0) {
+        set_status_message("Usage: flip h|v");
+        return;
+    }
+    transform_flip(args[0] == 'v');
+}
+
+/**
+ * @brief ":scale N|1/N|N/M" - resize the selection or the active layer
+ * @param args Command arguments
+ */
+static void command_scale(const char *args) {
+    int num, den = 1, end = 0;
+    if ((sscanf(args, "%d/%d %n", &num, &den, &end) != 2 &&
+         sscanf(args, "%d %n", &num, &end) != 1) || args[end] ||
+        num < 1 || den < 1 || num > TRANSFORM_SCALE_MAX * den || den > TRANSFORM_SCALE_MAX * num) {
+        set_status_message("Usage: scale N|1/N|N/M (1/%d to %d)", TRANSFORM_SCALE_MAX,
+                           TRANSFORM_SCALE_MAX);
+        return;
+    }
+    transform_scale(num, den);
+}
+
+/**
+ * @brief ":spray [PCT]" - switch to the spray brush, optionally setting its density
+ * @param args Command arguments
+ */
+static void command_spray(const char *args) {
+    int density = g_app.brush.density, end = 0;
+    if (*args && (sscanf(args, "%d %n", &density, &end) != 1 || args[end] ||
+                  density < 1 || density > 100)) {
+        set_status_message("Usage: spray [PCT] (1-100)");
+        return;
+    }
+    g_app.brush.density = density;
+    if (g_app.brush.shape != BRUSH_SHAPE_SPRAY) set_brush_shape(BRUSH_SHAPE_SPRAY);
+}
+
+/**
+ * @brief ":seed N" - restart the spray's random sequence from a seed
+ * @param args Command arguments
+ */
+static void command_seed(const char *args) {
+    unsigned long long seed;
+    int end = 0;
+    if (sscanf(args, "%llu %n", &seed, &end) != 1 || args[end]) {
+        set_status_message("Usage: seed N");
+        return;
+    }
+    random_seed(&g_app.rng, seed);
+}
+
+/**
+ * @brief ":dither A B [PCT]" - ordered-dither the selection or the active layer
+ * @param args Command arguments
+ * @details A and B are CHAR[:COLOR] patterns; parts left out come from the
+ * current brush. Without PCT the fill is a gradient from A to B.
+ */
+static void command_dither(const char *args) {
+    char spec[2][PROMPT_SIZE];
+    int percent = -1, end = 0;
+    int fields = sscanf(args, "%s %s %n", spec[0], spec[1], &end);
+    if (fields == 2 && args[end]) {
+        int tail = 0;
+        if (sscanf(args + end, "%d %n", &percent, &tail) != 1 || args[end + tail]) fields = 0;
+    }
+    
+    Cell cells[2];
+    uint32_t brush = cell_bits(make_cell(glyph_intern(brush_chars[g_app.brush_index]),
+                                         g_app.current_color));
+    for (int i = 0; i < 2 && fields == 2; ++i) {
+        uint32_t bits, mask;
+        if (!parse_cell_pattern(spec[i], &bits, &mask)) {
+            fields = 0;
+            break;
+        }
+        bits |= brush & ~mask;
+        memcpy(&cells[i], &bits, sizeof(bits));
+    }
+    if (fields != 2 || percent < -1 || percent > 100) {
+        set_status_message("Usage: dither A B [PCT] (A, B as CHAR[:COLOR]; PCT 0-100, "
+                           "gradient without)");
+        return;
+    }
+    dither_area(cells[0], cells[1], percent);
+}
+
+/**
+ * @var prompt_commands
+ * @brief Commands accepted at the ':' prompt
+ */
+static const struct {
+    const char *name;               /**< Command word */
+    void (*run)(const char *args);  /**< Handler, given the text after the word */
+} prompt_commands[] = {
+    { "color", command_color },
+    { "fg",    command_fg },
+    { "bg",    command_bg },
+    { "goto",  command_goto },
+    { "sym",   command_sym },
+    { "center", command_center },
+    { "rotate", command_rotate },
+    { "flip",  command_flip },
+    { "scale", command_scale },
+    { "spray", command_spray },
+    { "seed",  command_seed },
+    { "dither", command_dither },
+};
+
+/**
+ * @brief Run the command typed at the prompt
+ * @param line Command line: a command word, then its arguments
+ */
+static void prompt_run(const char *line) {
+    while (*line == ' ') ++line;
+    size_t len = strcspn(line, " ");
+    if (len == 0) return;
+    
+    const char *args = line + len;
+    while (*args == ' ') ++args;
+    
+    for (size_t i = 0; i < sizeof(prompt_commands) / sizeof(prompt_commands[0]); ++i) {
+        if (strlen(prompt_commands[i].name) == len &&
+            strncmp(line, prompt_commands[i].name, len) == 0) {
+            prompt_commands[i].run(args);
+            return;
+        }
+    }
+    set_status_message("Unknown command '%.*s'", (int)len, line);
+}
+
+/**
+ * @brief Apply one key to the open prompt
+ * @param key Key code
+ * @details Enter runs the line, Escape abandons it, Backspace deletes the
+ * last character; other printable ASCII is appended.
+ */
+static void prompt_key(int key) {
+    Prompt *prompt = &g_app.prompt;
+    
+    switch (key) {
+        case '\n': case '\r':
+            prompt->active = false;
+            prompt_run(prompt->text);
+            break;
             
-            if (fscanf(f, "%d,%d", &color_val, &ascii_val) != 2) {
-                read_success = false;
-                break;
-            }
+        case 27:
+            prompt->active = false;
+            break;
             
-            // Validate and store data
-            Cell *cell = &temp_canvas[y * file_width + x];
-            cell->color = (short)((color_val >= 0 && color_val < COLOR_COUNT) ? color_val : 7);
-            cell->ch = (unsigned char)((ascii_val >= 0 && ascii_val <= 255) ? ascii_val : ' ');
+        case KEY_BACKSPACE: case 127: case 8:
+            if (prompt->len > 0) prompt->text[--prompt->len] = '\0';
+            break;
             
-            // Skip whitespace
-            sneak_peek_at_file(f);
+        default:
+            if (key >= 0x20 && key < 0x7f && prompt->len + 1 < sizeof(prompt->text)) {
+                prompt->text[prompt->len++] = (char)key;
+                prompt->text[prompt->len] = '\0';
+            }
+            break;
+    }
+}
+
+/*==============================================================================
+ * TEXT ENTRY
+ *============================================================================*/
+
+/**
+ * @brief Write lines of text onto the active layer at the cursor
+ * @param text UTF-8 text, NUL-terminated
+ * @param len Bytes in text
+ * @param end_x Out: column after the last character written
+ * @param end_y Out: row of the last line written
+ * 
+ * @details
+ * Each line starts at the cursor column and is clipped at the canvas edge;
+ * lines past the bottom row are dropped. A line is decoded into a row of
+ * cells, written with one buffer_write_span() and recomposited once, so a
+ * pasted block costs one span per line whatever its size. CR LF and lone
+ * CR end lines like LF; tabs advance to the next multiple of 8 columns and
+ * other control characters are skipped.
+ */
+static void write_text(const char *text, size_t len, int *end_x, int *end_y) {
+    const char *p = text, *end = text + len;
+    int x0 = g_app.cursor_x, y = g_app.cursor_y;
+    int room = g_app.canvas_width - x0;
+    Cell *row = malloc((size_t)room * sizeof(Cell));
+    
+    *end_x = x0;
+    *end_y = y;
+    if (!row) {
+        set_status_message("Out of memory for the text");
+        return;
+    }
+    
+    CellBuffer *buf = &active_layer()->buf;
+    Cell blank = make_cell(' ', g_app.current_color);
+    while (p < end && y < g_app.canvas_height) {
+        int n = 0;
+        while (p < end && *p != '\n' && *p != '\r') {
+            unsigned char c = (unsigned char)*p;
+            if (c >= 0x20 && c < 0x7f) {
+                if (n < room) row[n] = make_cell(c, g_app.current_color);
+                ++n;
+                ++p;
+            } else if (c == '\t') {
+                for (int stop = (n / 8 + 1) * 8; n < stop; ++n) {
+                    if (n < room) row[n] = blank;
+                }
+                ++p;
+            } else if (c < 0x80) {
+                ++p;
+            } else {
+                uint32_t code = utf8_decode(&p);
+                if (code == UINT32_MAX) {
+                    ++p;
+                    continue;
+                }
+                if (n < room) row[n] = make_cell(glyph_intern(code), g_app.current_color);
+                ++n;
+            }
+        }
+        if (n > room) n = room;
+        if (n > 0) {
+            buffer_write_span(buf, y, x0, n, row, false);
+            recomposite_span(y, x0, x0 + n - 1);
         }
+        *end_x = x0 + n;
+        *end_y = y;
         
-        // Skip to end of line
-        do { 
-            ch = fgetc(f); 
-        } while (ch != '\n' && ch != EOF);
+        if (p < end && *p == '\r' && p + 1 < end && p[1] == '\n') ++p;
+        if (p < end) {
+            ++p;
+            ++y;
+        }
     }
+    free(row);
+}
+
+/**
+ * @brief Apply a bracketed paste
+ * @param text Pasted UTF-8 text, NUL-terminated
+ * @param len Bytes in text
+ * @details At the prompt, the first line is typed into it. Otherwise the
+ * block is written at the cursor in one operation; in text mode the cursor
+ * then follows it, as if it had been typed.
+ */
+static void paste_text(const char *text, size_t len) {
+    show_or_hide_cursor(false);
+    g_app.status_msg[0] = '\0';
     
-    fclose(f);
-    
-    if (!read_success) {
-        free(temp_canvas);
+    if (g_app.prompt.active) {
+        for (size_t i = 0; i < len && text[i] != '\n' && text[i] != '\r'; ++i) {
+            prompt_key((unsigned char)text[i]);
+        }
         return;
     }
+    if (!active_layer_writable()) return;
     
-    // Copy overlapping region to main canvas
-    int copy_width = (file_width < g_app.canvas_width) ? file_width : g_app.canvas_width;
-    int copy_height = (file_height < g_app.canvas_height) ? file_height : g_app.canvas_height;
+    int x, y;
+    write_text(text, len, &x, &y);
+    if (g_app.text.active) {
+        TextEntry *te = &g_app.text;
+        te->line_x = g_app.cursor_x;
+        g_app.cursor_x = x < g_app.canvas_width ? x : g_app.canvas_width - 1;
+        g_app.cursor_y = y;
+        te->next_x = g_app.cursor_x;
+        te->next_y = g_app.cursor_y;
+    }
+}
+
+/**
+ * @brief Toggle text mode
+ */
+static void text_toggle(void) {
+    TextEntry *te = &g_app.text;
+    te->active = !te->active;
+    te->line_x = te->next_x = g_app.cursor_x;
+    te->next_y = g_app.cursor_y;
+    te->pending_len = 0;
+}
+
+/**
+ * @brief Type one character at the cursor and advance it
+ * @param code Code point
+ */
+static void text_type(uint32_t code) {
+    TextEntry *te = &g_app.text;
+    if (g_app.cursor_x != te->next_x || g_app.cursor_y != te->next_y) {
+        te->line_x = g_app.cursor_x;  // Moved away: a new line of typing
+    }
+    if (!active_layer_writable()) return;
     
-    for (int y = 0; y < copy_height; ++y) {
-        for (int x = 0; x < copy_width; ++x) {
-            Cell *src = &temp_canvas[y * file_width + x];
-            Cell *dst = find_spot(x, y);
-            if (dst) {
-                *dst = *src;
-            }
+    Cell value = make_cell(code < 0x80 ? (GlyphId)code : glyph_intern(code), g_app.current_color);
+    buffer_write_span(&active_layer()->buf, g_app.cursor_y, g_app.cursor_x, 1, &value, false);
+    recomposite_span(g_app.cursor_y, g_app.cursor_x, g_app.cursor_x);
+    if (g_app.cursor_x < g_app.canvas_width - 1) g_app.cursor_x++;
+    te->next_x = g_app.cursor_x;
+    te->next_y = g_app.cursor_y;
+}
+
+/**
+ * @brief Apply a key in text mode
+ * @param key Key code
+ * @return true if the key was used; false lets it run as a command
+ *         (arrows and other function keys keep working)
+ * 
+ * @details
+ * Printable keys and UTF-8 sequences type, Enter starts the next line at
+ * the column typing began in, Backspace erases the character before the
+ * cursor, and Escape leaves text mode.
+ */
+static bool text_key(int key) {
+    TextEntry *te = &g_app.text;
+    
+    if (key >= 0x80 && key <= 0xff) {
+        if ((key & 0xC0) != 0x80) te->pending_len = 0;  // A lead byte starts over
+        if (te->pending_len < UTF8_MAX) te->pending[te->pending_len++] = (char)key;
+        te->pending[te->pending_len] = '\0';
+        
+        const char *p = te->pending;
+        uint32_t code = utf8_decode(&p);
+        if (code != UINT32_MAX) {
+            te->pending_len = 0;
+            text_type(code);
         }
+        return true;
     }
+    te->pending_len = 0;
     
-    free(temp_canvas);
-    paint_entire_canvas();
+    switch (key) {
+        case 27:
+            te->active = false;
+            return true;
+            
+        case '\n': case '\r':
+            if (g_app.cursor_x != te->next_x || g_app.cursor_y != te->next_y) {
+                te->line_x = g_app.cursor_x;
+            }
+            g_app.cursor_x = te->line_x;
+            if (g_app.cursor_y < g_app.canvas_height - 1) g_app.cursor_y++;
+            te->next_x = g_app.cursor_x;
+            te->next_y = g_app.cursor_y;
+            return true;
+            
+        case KEY_BACKSPACE: case 127: case 8:
+            if (g_app.cursor_x > 0 && active_layer_writable()) {
+                g_app.cursor_x--;
+                put_cell(g_app.cursor_x, g_app.cursor_y, active_layer()->buf.blank);
+                mark_dirty(g_app.cursor_x, g_app.cursor_y, g_app.cursor_x, g_app.cursor_y);
+                te->next_x = g_app.cursor_x;
+                te->next_y = g_app.cursor_y;
+            }
+            return true;
+            
+        default:
+            if (key >= 0x20 && key < 0x7f) {
+                text_type((uint32_t)key);
+                return true;
+            }
+            return false;
+    }
 }
 
 /*==============================================================================
@@ -556,23 +8727,54 @@ static void load_masterpiece(const char *filename) {
 static void input_stuff(int key) {
     // Turn off cursor before state changes
     show_or_hide_cursor(false);
+    g_app.status_msg[0] = '\0';
+    
+    if (g_app.prompt.active) {
+        prompt_key(key);
+        return;
+    }
+    if (g_app.text.active && text_key(key)) {
+        return;
+    }
+    
+    // Any other key stops playback before it acts
+    if (g_app.timeline.playing && key != 'g' && key != 'G') {
+        timeline_toggle_play();
+    }
     
     switch (key) {
         // === MOVEMENT CONTROLS ===
         case KEY_UP:
-            move_brush(0, -1);
+            move_accelerated(key, 0, -1);
             break;
             
         case KEY_DOWN:
-            move_brush(0, 1);
+            move_accelerated(key, 0, 1);
             break;
             
         case KEY_LEFT:
-            move_brush(-1, 0);
+            move_accelerated(key, -1, 0);
             break;
             
         case KEY_RIGHT:
-            move_brush(1, 0);
+            move_accelerated(key, 1, 0);
+            break;
+        
+        // Shift (or Ctrl) + arrows: jump to the next blank/non-blank boundary
+        case KEY_SR:
+            jump_cursor(0, -1);
+            break;
+            
+        case KEY_SF:
+            jump_cursor(0, 1);
+            break;
+            
+        case KEY_SLEFT:
+            jump_cursor(-1, 0);
+            break;
+            
+        case KEY_SRIGHT:
+            jump_cursor(1, 0);
             break;
         
         // === PAINTING CONTROLS ===
@@ -588,7 +8790,7 @@ static void input_stuff(int key) {
         case 'b': case 'B':  // Cycle through available brushes
             // Restore original brushes when cycling (exits eraser mode)
             memcpy(brush_chars, original_brush_chars, sizeof(brush_chars));
-            g_app.brush_index = (g_app.brush_index + 1) % BRUSH_COUNT;
+            g_app.brush_index = (int)((g_app.brush_index + 1) % BRUSH_COUNT);
             break;
             
         case 'e': case 'E':  // Enter eraser mode 
@@ -599,28 +8801,160 @@ static void input_stuff(int key) {
             brush_chars[0] = ' ';
             break;
             
-        case 'c':  // Cycle through color palette (lowercase only)
-            g_app.current_color = (short)((g_app.current_color + 1) % COLOR_COUNT);
+        case 'c':  // Cycle through the base colors
+            g_app.current_color = (StyleId)(g_app.current_color < STYLE_DIRECT - 1 ?
+                                            g_app.current_color + 1 : 0);
+            break;
+            
+        case 'C':  // Step the foreground through the 256-color palette
+            step_palette();
+            break;
+            
+        case ':':  // Open the command prompt
+            g_app.prompt.active = true;
+            g_app.prompt.len = 0;
+            g_app.prompt.text[0] = '\0';
+            break;
+            
+        case '+': case '=':  // Grow the solid brush
+            resize_brush(1);
+            break;
+            
+        case '-':  // Shrink the solid brush
+            resize_brush(-1);
+            break;
+            
+        case 'o': case 'O':  // Cycle square/round/spray brush
+            set_brush_shape(g_app.brush.shape == BRUSH_SHAPE_SQUARE ? BRUSH_SHAPE_ROUND :
+                            g_app.brush.shape == BRUSH_SHAPE_ROUND ? BRUSH_SHAPE_SPRAY :
+                            BRUSH_SHAPE_SQUARE);
+            break;
+            
+        case 't': case 'T':  // Load stamp brush (or return to the solid brush)
+            if (g_app.brush.shape == BRUSH_SHAPE_STAMP) {
+                set_brush_shape(BRUSH_SHAPE_SQUARE);
+            } else if (!load_stamp_brush(NULL)) {
+                set_status_message("Cannot load stamp from '%s'", DEFAULT_STAMP_FILE);
+            }
+            break;
+            
+        case 'w': case 'W':  // Type text at the cursor (Esc leaves)
+            text_toggle();
+            break;
+            
+        case 'z': case 'Z':  // Cycle sub-cell drawing modes
+            subcell_cycle();
+            break;
+            
+        case 'y': case 'Y':  // Cycle symmetry modes
+            symmetry_cycle();
+            break;
+            
+        case '\t':  // Cycle minimap corner overlay / full-screen overview
+            minimap_cycle();
+            break;
+            
+        case 'm': case 'M':  // Anchor/complete/clear the selection
+            toggle_selection();
+            break;
+            
+        case 'r': case 'R':  // Replace the cell under the cursor everywhere
+            replace_under_cursor();
             break;
             
         case 'x': case 'X':  // Clear entire canvas
             start_with_blank_canvas();
             break;
         
+        // === LAYER CONTROLS ===
+        case 'n': case 'N':  // New empty layer above the active one
+            add_layer();
+            break;
+            
+        case '[':  // Select the layer below
+            if (g_app.active_layer > 0) g_app.active_layer--;
+            break;
+            
+        case ']':  // Select the layer above
+            if (g_app.active_layer < g_app.layer_count - 1) g_app.active_layer++;
+            break;
+            
+        case 'v': case 'V':  // Show/hide the active layer
+            toggle_layer_visibility();
+            break;
+            
+        case 'k': case 'K':  // Lock/unlock the active layer
+            active_layer()->locked = !active_layer()->locked;
+            break;
+        
+        // === ANIMATION CONTROLS ===
+        case 'a': case 'A':  // Add a frame after the current one
+            timeline_add_frame();
+            break;
+            
+        case 'd': case 'D':  // Delete the current frame
+            timeline_delete_frame();
+            break;
+            
+        case ',': case '<':  // Previous frame
+            timeline_step(-1);
+            break;
+            
+        case '.': case '>':  // Next frame
+            timeline_step(1);
+            break;
+            
+        case 'u': case 'U':  // Toggle onion skin
+            timeline_toggle_onion();
+            break;
+            
+        case 'g': case 'G':  // Play/stop the animation
+            timeline_toggle_play();
+            break;
+        
+        // === INSTRUMENTATION ===
+        case 'f': case 'F':  // Toggle the stats line
+            g_app.show_stats = !g_app.show_stats;
+            break;
+        
         // === DIRECT COLOR SELECTION ===
         case '0': case '1': case '2': case '3':
         case '4': case '5': case '6': case '7':
-            g_app.current_color = (short)(key - '0');
+            g_app.current_color = (StyleId)(key - '0');
             break;
         
         // === FILE OPERATIONS ===
-        case 's': case 'S':  // Save canvas to file
-            save_masterpiece(NULL);
+        case 's': case 'S':  // Save canvas to file (or sync the open document)
+            if (!g_app.document.map) {
+                if (!save_masterpiece(NULL)) {
+                    set_status_message("Save failed: %s", strerror(errno));
+                } else if (g_app.save.skipped) {
+                    set_status_message("'%s' unchanged", g_app.save.path);
+                } else if (has_extension(g_app.save.path, ".bin") && g_app.save.patched_rows >= 0) {
+                    set_status_message("Saved '%s' (%d rows patched)",
+                                       g_app.save.path, g_app.save.patched_rows);
+                } else {
+                    set_status_message("Saved '%s'", g_app.save.path);
+                }
+            } else if (document_sync()) {
+                set_status_message(g_app.save.skipped ? "'%s' unchanged" : "Synced '%s'",
+                                   g_app.document.name);
+            } else {
+                set_status_message("Sync failed: %s", strerror(errno));
+            }
             break;
             
         case 'l': case 'L':  // Load canvas from file
             load_masterpiece(NULL);
             break;
+            
+        case 'p': case 'P':  // Publish canvas as ANSI art and asciicast
+            publish_masterpiece();
+            break;
+            
+        case 'i': case 'I':  // Import a PPM/PGM image as ASCII art
+            import_picture(NULL);
+            break;
         
         // === APPLICATION CONTROL ===
         case 'q': case 'Q': case 27:  // Quit application (q, Q, or Escape)
@@ -633,6 +8967,488 @@ static void input_stuff(int key) {
     }
 }
 
+/*==============================================================================
+ * INPUT THREAD
+ *============================================================================*/
+
+/**
+ * @brief Append a key to the queue (producer side)
+ * @param q Queue
+ * @param key Key code
+ * @return false if the queue is full
+ */
+static bool key_queue_push(KeyQueue *q, int key) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail - head == KEY_QUEUE_CAPACITY) return false;
+    
+    q->keys[tail & (KEY_QUEUE_CAPACITY - 1)] = key;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * @brief Take the oldest key from the queue (consumer side)
+ * @param q Queue
+ * @param key Out: key code
+ * @return false if the queue is empty
+ */
+static bool key_queue_pop(KeyQueue *q, int *key) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head == tail) return false;
+    
+    *key = q->keys[head & (KEY_QUEUE_CAPACITY - 1)];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * @brief Number of keys currently queued
+ * @param q Queue
+ * @return Queue depth (a snapshot; either side may be moving)
+ */
+static size_t key_queue_depth(KeyQueue *q) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    return tail - head;
+}
+
+/**
+ * @brief Append a paste to the paste queue (producer side)
+ * @param q Queue
+ * @param paste Paste; the consumer takes ownership of its text
+ * @return false if the queue is full
+ */
+static bool paste_queue_push(PasteQueue *q, Paste paste) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail - head == PASTE_QUEUE_CAPACITY) return false;
+    
+    q->pastes[tail & (PASTE_QUEUE_CAPACITY - 1)] = paste;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * @brief Take the oldest paste from the queue (consumer side)
+ * @param q Queue
+ * @param paste Out: paste (caller frees its text)
+ * @return false if the queue is empty
+ */
+static bool paste_queue_pop(PasteQueue *q, Paste *paste) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head == tail) return false;
+    
+    *paste = q->pastes[head & (PASTE_QUEUE_CAPACITY - 1)];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * @brief Get the next input byte, waiting at most timeout_ms
+ * @param in Input thread state
+ * @param timeout_ms Wait limit in milliseconds (-1 waits forever)
+ * @return Byte value, INPUT_TIMEOUT, or INPUT_CLOSED on EOF/stop request
+ */
+static int input_next_byte(InputThread *in, int timeout_ms) {
+    if (in->pos < in->len) {
+        return in->buf[in->pos++];
+    }
+    
+    for (;;) {
+        struct pollfd fds[2] = {
+            { .fd = STDIN_FILENO, .events = POLLIN },
+            { .fd = in->stop_pipe[0], .events = POLLIN },
+        };
+        int ready = poll(fds, 2, timeout_ms);
+        
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready < 0 || (fds[1].revents & POLLIN)) return INPUT_CLOSED;
+        if (ready == 0) return INPUT_TIMEOUT;
+        
+        ssize_t n = read(STDIN_FILENO, in->buf, sizeof(in->buf));
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (n <= 0) return INPUT_CLOSED;
+        
+        in->len = (size_t)n;
+        in->pos = 1;
+        return in->buf[0];
+    }
+}
+
+/**
+ * @brief Queue a key, waiting for room if the consumer has fallen behind
+ * @param in Input thread state
+ * @param key Key code
+ */
+static void input_deliver(InputThread *in, int key) {
+    while (!key_queue_push(&in->queue, key)) {
+        if (write(in->wake_pipe[1], "", 1) < 0) { /* pipe full: consumer is awake */ }
+        sched_yield();
+    }
+}
+
+/**
+ * @brief Append bytes to a paste being collected, growing it as needed
+ * @param paste Paste
+ * @param cap In/out: allocated size of paste->text
+ * @param data Bytes
+ * @param n Number of bytes
+ * @details Bytes past PASTE_MAX_BYTES, or that cannot be allocated, are dropped.
+ */
+static void paste_append(Paste *paste, size_t *cap, const void *data, size_t n) {
+    if (n > PASTE_MAX_BYTES - paste->len) n = PASTE_MAX_BYTES - paste->len;
+    if (paste->len + n + 1 > *cap) {
+        size_t size = *cap ? *cap : 4096;
+        while (size < paste->len + n + 1) size *= 2;
+        char *text = realloc(paste->text, size);
+        if (!text) return;
+        paste->text = text;
+        *cap = size;
+    }
+    memcpy(paste->text + paste->len, data, n);
+    paste->len += n;
+}
+
+/**
+ * @brief Collect a bracketed paste up to its end marker and queue it
+ * @param in Input thread state
+ * @return KEY_PASTE, ERR for an empty paste, or INPUT_CLOSED
+ * 
+ * @details
+ * Runs of bytes without an ESC are copied straight out of the read buffer,
+ * so a large paste costs a few memcpy() calls per read rather than work per
+ * byte. Only ESC starts a byte-wise match against the end marker.
+ */
+static int input_read_paste(InputThread *in) {
+    static const char end_marker[] = "\x1b[201~";
+    const size_t marker_len = sizeof(end_marker) - 1;
+    Paste paste = { NULL, 0 };
+    size_t cap = 0, matched = 0;
+    
+    for (;;) {
+        if (matched == 0 && in->pos < in->len) {
+            const unsigned char *start = in->buf + in->pos;
+            const unsigned char *esc = memchr(start, 0x1b, in->len - in->pos);
+            size_t run = esc ? (size_t)(esc - start) : in->len - in->pos;
+            paste_append(&paste, &cap, start, run);
+            in->pos += run;
+            if (!esc) continue;
+        }
+        
+        int c = input_next_byte(in, -1);
+        if (c == INPUT_CLOSED) {
+            free(paste.text);
+            return INPUT_CLOSED;
+        }
+        if (c == (unsigned char)end_marker[matched]) {
+            if (++matched == marker_len) break;
+            continue;
+        }
+        
+        // Not the marker after all: keep what matched, then retry on c
+        paste_append(&paste, &cap, end_marker, matched);
+        matched = (c == 0x1b);
+        if (!matched) {
+            unsigned char byte = (unsigned char)c;
+            paste_append(&paste, &cap, &byte, 1);
+        }
+    }
+    
+    if (paste.len == 0) {
+        free(paste.text);
+        return ERR;
+    }
+    paste.text[paste.len] = '\0';
+    while (!paste_queue_push(&in->pastes, paste)) {
+        if (write(in->wake_pipe[1], "", 1) < 0) { /* pipe full: consumer is awake */ }
+        sched_yield();
+    }
+    return KEY_PASTE;
+}
+
+/**
+ * @brief Decode the rest of an escape sequence
+ * @param in Input thread state
+ * @return Key code, ERR for unsupported sequences, or INPUT_CLOSED
+ * 
+ * @details
+ * A lone ESC (nothing follows within ESCAPE_TIMEOUT_MS) is the key 27.
+ * CSI and SS3 arrow sequences map to KEY_UP/DOWN/RIGHT/LEFT, or with a
+ * Shift or Ctrl modifier ("ESC [ 1 ; 2 C") to KEY_SR/SF/SRIGHT/SLEFT.
+ * "ESC [ 200 ~" opens a bracketed paste, which is read whole and becomes
+ * a single KEY_PASTE. Any other sequence is consumed up to its final byte
+ * and dropped.
+ */
+static int input_decode_escape(InputThread *in) {
+    int c = input_next_byte(in, ESCAPE_TIMEOUT_MS);
+    if (c == INPUT_TIMEOUT) return 27;
+    if (c == INPUT_CLOSED) return INPUT_CLOSED;
+    if (c != '[' && c != 'O') {
+        // Alt+key: report the escape, keep the key for the next read
+        in->pos--;
+        return 27;
+    }
+    
+    // The modifier is the last parameter: 1 + (1 Shift, 2 Alt, 4 Ctrl)
+    int param = 0;
+    for (;;) {
+        c = input_next_byte(in, ESCAPE_TIMEOUT_MS);
+        if (c < 0) return (c == INPUT_CLOSED) ? INPUT_CLOSED : ERR;
+        if (c >= 0x40 && c <= 0x7e) break;
+        param = (c >= '0' && c <= '9') ? param * 10 + (c - '0') : 0;
+    }
+    bool jump = param > 1 && ((param - 1) & 5);
+    
+    switch (c) {
+        case 'A': return jump ? KEY_SR : KEY_UP;
+        case 'B': return jump ? KEY_SF : KEY_DOWN;
+        case 'C': return jump ? KEY_SRIGHT : KEY_RIGHT;
+        case 'D': return jump ? KEY_SLEFT : KEY_LEFT;
+        case '~': return param == 200 ? input_read_paste(in) : ERR;
+        default:  return ERR;
+    }
+}
+
+/**
+ * @brief Input thread body: read, decode and queue keys until stopped
+ * @param arg InputThread state
+ * @return NULL
+ * @details Never touches ncurses; the main thread owns the screen.
+ */
+static void* input_thread_main(void *arg) {
+    InputThread *in = arg;
+    
+    for (;;) {
+        int c = input_next_byte(in, -1);
+        if (c == 0x1b) c = input_decode_escape(in);
+        if (c == INPUT_CLOSED) break;
+        if (c != ERR) input_deliver(in, c);
+        
+        // Wake the consumer once per chunk read from the terminal
+        if (in->pos >= in->len && write(in->wake_pipe[1], "", 1) < 0) {
+            /* pipe full: consumer is already due to wake */
+        }
+    }
+    
+    atomic_store_explicit(&in->closed, true, memory_order_release);
+    if (write(in->wake_pipe[1], "", 1) < 0) { /* consumer wakes regardless */ }
+    return NULL;
+}
+
+/**
+ * @brief Start reading keys on a dedicated thread
+ * @return true on success
+ * @details Also turns on bracketed paste, so pasted text arrives between
+ * markers instead of looking like typed commands.
+ */
+static bool start_input_thread(void) {
+    InputThread *in = &g_input;
+    
+    if (pipe(in->wake_pipe) != 0) return false;
+    if (pipe(in->stop_pipe) != 0) {
+        close(in->wake_pipe[0]);
+        close(in->wake_pipe[1]);
+        return false;
+    }
+    fcntl(in->wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(in->wake_pipe[1], F_SETFL, O_NONBLOCK);
+    
+    if (pthread_create(&in->thread, NULL, input_thread_main, in) != 0) {
+        close(in->wake_pipe[0]);
+        close(in->wake_pipe[1]);
+        close(in->stop_pipe[0]);
+        close(in->stop_pipe[1]);
+        return false;
+    }
+    
+    static const char paste_on[] = "\x1b[?2004h";
+    if (write(STDOUT_FILENO, paste_on, sizeof(paste_on) - 1) < 0) { /* pastes arrive as keys */ }
+    return true;
+}
+
+/**
+ * @brief Stop the input thread and release its pipes
+ */
+static void stop_input_thread(void) {
+    InputThread *in = &g_input;
+    static const char paste_off[] = "\x1b[?2004l";
+    
+    if (write(STDOUT_FILENO, paste_off, sizeof(paste_off) - 1) < 0) { /* terminal gone */ }
+    if (write(in->stop_pipe[1], "", 1) < 0) { /* thread may already be gone */ }
+    pthread_join(in->thread, NULL);
+    
+    Paste paste;
+    while (paste_queue_pop(&in->pastes, &paste)) free(paste.text);
+    close(in->wake_pipe[0]);
+    close(in->wake_pipe[1]);
+    close(in->stop_pipe[0]);
+    close(in->stop_pipe[1]);
+}
+
+/**
+ * @brief Block until the input thread signals new keys (or EOF)
+ * @param timeout_ms Wait limit in milliseconds (-1 waits forever)
+ */
+static void wait_for_input(int timeout_ms) {
+    if (key_queue_depth(&g_input.queue) > 0) return;
+    
+    struct pollfd fd = { .fd = g_input.wake_pipe[0], .events = POLLIN };
+    if (poll(&fd, 1, timeout_ms) > 0) {
+        char drain[64];
+        while (read(g_input.wake_pipe[0], drain, sizeof(drain)) > 0) {}
+    }
+}
+
+/**
+ * @brief Apply every queued key to the model
+ * @return Number of keys processed
+ * @details Called once per main loop iteration; the screen is refreshed
+ * once after the whole batch instead of once per key. A KEY_PASTE goes
+ * straight to paste_text() with its queued text, skipping input_stuff().
+ */
+static size_t process_input_batch(void) {
+    size_t depth = key_queue_depth(&g_input.queue);
+    size_t batch = 0;
+    int key;
+    
+    while (g_app.running && key_queue_pop(&g_input.queue, &key)) {
+        Paste paste;
+        if (key != KEY_PASTE) {
+            input_stuff(key);
+        } else if (paste_queue_pop(&g_input.pastes, &paste)) {
+            paste_text(paste.text, paste.len);
+            free(paste.text);
+        }
+        batch++;
+    }
+    
+    if (batch > 0) {
+        g_app.stats.queue_depth = depth;
+        if (depth > g_app.stats.queue_high_water) g_app.stats.queue_high_water = depth;
+        g_app.stats.last_batch = batch;
+        g_app.stats.keys_total += batch;
+    }
+    
+    if (key_queue_depth(&g_input.queue) == 0 &&
+        atomic_load_explicit(&g_input.closed, memory_order_acquire)) {
+        g_app.running = false;  // Terminal closed
+    }
+    return batch;
+}
+
+/*==============================================================================
+ * FRAME PACING
+ *============================================================================*/
+
+/**
+ * @brief Read the monotonic clock
+ * @return Microseconds since an arbitrary fixed point
+ */
+static int64_t now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Pick the default frame rate cap for this session
+ * @return FRAME_RATE_REMOTE over SSH, FRAME_RATE_LOCAL otherwise
+ */
+static int default_frame_rate(void) {
+    if (getenv("SSH_CONNECTION") || getenv("SSH_TTY")) {
+        return FRAME_RATE_REMOTE;
+    }
+    return FRAME_RATE_LOCAL;
+}
+
+/**
+ * @brief Reset the frame scheduler
+ * @param max_fps Frame rate cap
+ * @param adaptive Lower the rate automatically when refreshes run long
+ */
+static void frames_init(int max_fps, bool adaptive) {
+    FrameScheduler *fs = &g_app.frames;
+    
+    memset(fs, 0, sizeof(*fs));
+    fs->max_fps = max_fps;
+    fs->fps = max_fps;
+    fs->adaptive = adaptive;
+}
+
+/**
+ * @brief Time until the next frame may be emitted
+ * @return Milliseconds to wait for input: -1 (forever) when nothing is
+ *         pending, 0 when a frame is already due
+ */
+static int frames_wait_ms(void) {
+    const FrameScheduler *fs = &g_app.frames;
+    if (!fs->dirty) return -1;
+    
+    int64_t remaining = fs->next_frame_us - now_usec();
+    if (remaining <= 0) return 0;
+    return (int)((remaining + 999) / 1000);
+}
+
+/**
+ * @brief Adjust the frame rate from the duration of the last refresh
+ * @param write_us How long refresh() took
+ * 
+ * @details
+ * A smoothed refresh time above the frame budget drops the rate by a
+ * quarter (down to FRAME_RATE_MIN). After FRAME_RATE_RECOVERY frames in a
+ * row under a quarter of the budget, the rate climbs back by a quarter
+ * toward the configured cap.
+ */
+static void frames_adapt(int64_t write_us) {
+    FrameScheduler *fs = &g_app.frames;
+    
+    fs->write_avg_us = (fs->frame_count == 0) ? write_us
+                                              : (7 * fs->write_avg_us + write_us) / 8;
+    if (!fs->adaptive) return;
+    
+    int64_t budget_us = 1000000 / fs->fps;
+    if (fs->write_avg_us > budget_us) {
+        fs->fps = fs->fps * 3 / 4;
+        if (fs->fps < FRAME_RATE_MIN) fs->fps = FRAME_RATE_MIN;
+        fs->fast_frames = 0;
+    } else if (fs->write_avg_us * 4 < budget_us && fs->fps < fs->max_fps) {
+        if (++fs->fast_frames >= FRAME_RATE_RECOVERY) {
+            fs->fps += (fs->fps + 3) / 4;
+            if (fs->fps > fs->max_fps) fs->fps = fs->max_fps;
+            fs->fast_frames = 0;
+        }
+    } else {
+        fs->fast_frames = 0;
+    }
+}
+
+/**
+ * @brief Emit a frame if the model changed and the frame interval elapsed
+ * @details Everything drawn since the previous frame has accumulated in the
+ * ncurses virtual screen, so one refresh() sends a single consolidated
+ * update to the terminal.
+ */
+static void frames_tick(void) {
+    FrameScheduler *fs = &g_app.frames;
+    if (!fs->dirty) return;
+    
+    int64_t start = now_usec();
+    if (start < fs->next_frame_us) return;
+    
+    refresh_view();
+    int64_t end = now_usec();
+    
+    // Cells whose color pair was rebound while drawing are redrawn next frame
+    fs->dirty = g_app.dirty_bottom >= 0;
+    fs->next_frame_us = start + 1000000 / fs->fps;
+    frames_adapt(end - start);
+    fs->last_write_us = end - start;
+    fs->frame_count++;
+}
+
 /*==============================================================================
  * INITIALIZATION AND CLEANUP
  *============================================================================*/
@@ -651,16 +9467,81 @@ static bool setup_palette(void) {
     }
     
     // Initialize color pairs (foreground on black background)
-    // Pairs 1-8 map to color indices 0-7
+    // Pairs 1-8 map to color indices 0-7; the rest are bound on demand
     for (short i = 0; i < COLOR_COUNT; ++i) {
         if (init_pair(i + 1, base_colors[i], COLOR_BLACK) == ERR) {
             return false;
         }
     }
     
+    pair_cache_init();
+    return true;
+}
+
+/**
+ * @brief Allocate an empty canvas of the given size
+ * @param width Canvas width in characters
+ * @param height Canvas height in characters
+ * @return true on success; on failure g_app.canvas.cells is left NULL
+ */
+static bool canvas_allocate(int width, int height) {
+    g_app.canvas_width = width;
+    g_app.canvas_height = height;
+    
+    // Composite plus a single visible base layer
+    g_app.layer_count = 1;
+    g_app.active_layer = 0;
+    g_app.layers[0].visible = true;
+    g_app.layers[0].locked = false;
+    g_app.scratch_row = malloc((size_t)width * sizeof(Cell));
+    g_app.scratch_spans = malloc((size_t)height * sizeof(RowSpan));
+    g_app.dirty_rows = calloc((size_t)height, sizeof(RowSpan));
+    g_app.dirty_top = height;
+    g_app.dirty_bottom = -1;
+    
+    // Single-cell square brush
+    g_app.brush.shape = BRUSH_SHAPE_SQUARE;
+    g_app.brush.size = 1;
+    g_app.brush.density = SPRAY_DEFAULT_DENSITY;
+    g_app.brush.spans = g_app.brush.solid_spans;
+    rebuild_brush_mask();
+    
+    // A new canvas has no saved baseline to patch
+    g_app.save.baseline[0] = '\0';
+    
+    if (!buffer_init(&g_app.canvas, width, height) ||
+        !buffer_init(&g_app.layers[0].buf, width, height) ||
+        !(g_app.canvas.row_edit = calloc((size_t)height, sizeof(uint64_t))) ||
+        !g_app.scratch_row || !g_app.scratch_spans || !g_app.dirty_rows) {
+        canvas_release();
+        return false;
+    }
     return true;
 }
 
+/**
+ * @brief Free the composite, all layers and scratch storage
+ */
+static void canvas_release(void) {
+    document_close();
+    buffer_free(&g_app.canvas);
+    for (int i = 0; i < g_app.layer_count; ++i) {
+        buffer_free(&g_app.layers[i].buf);
+    }
+    g_app.layer_count = 0;
+    g_app.active_layer = 0;
+    free(g_app.scratch_row);
+    free(g_app.scratch_spans);
+    free(g_app.dirty_rows);
+    g_app.scratch_row = NULL;
+    g_app.scratch_spans = NULL;
+    g_app.dirty_rows = NULL;
+    set_brush_shape(BRUSH_SHAPE_SQUARE);  // Frees any stamp
+    subcell_release();
+    minimap_free();
+    timeline_free();
+}
+
 /**
  * @brief Adjusts canvas size to fit current terminal window
  */
@@ -670,22 +9551,10 @@ static void canvas_fit(void) {
     int available_height = LINES - (STATUS_LINES_TOP + STATUS_LINES_BOTTOM);
     
     // Clamp to reasonable limits
-    g_app.canvas_width = (available_width < MAX_CANVAS_WIDTH) ? 
-                        available_width : MAX_CANVAS_WIDTH;
-    g_app.canvas_height = (available_height < MAX_CANVAS_HEIGHT) ? 
-                         available_height : MAX_CANVAS_HEIGHT;
-    
-    // Allocate canvas memory
-    size_t canvas_size = (size_t)g_app.canvas_width * (size_t)g_app.canvas_height;
-    g_app.canvas = malloc(canvas_size * sizeof(Cell));
-    
-    if (g_app.canvas) {
-        // Initialize all cells to empty/white
-        for (size_t i = 0; i < canvas_size; ++i) {
-            g_app.canvas[i].ch = ' ';
-            g_app.canvas[i].color = 7;  // Default to white
-        }
-    }
+    canvas_allocate((available_width < MAX_CANVAS_WIDTH) ? 
+                    available_width : MAX_CANVAS_WIDTH,
+                    (available_height < MAX_CANVAS_HEIGHT) ? 
+                    available_height : MAX_CANVAS_HEIGHT);
     
     // Initialize cursor to center of canvas
     g_app.cursor_x = g_app.canvas_width / 2;
@@ -722,7 +9591,7 @@ static bool start_stuff(void) {
     
     // Setup canvas
     canvas_fit();
-    if (!g_app.canvas) {
+    if (!g_app.canvas.cells) {
         endwin();
         fprintf(stderr, "Error: Failed to allocate canvas memory\n");
         return false;
@@ -733,6 +9602,8 @@ static bool start_stuff(void) {
     g_app.brush_index = 0;
     g_app.current_color = 7;  // Default to white
     g_app.running = true;
+    subcell_build_tables();
+    random_seed(&g_app.rng, RANDOM_DEFAULT_SEED);
     
     return true;
 }
@@ -741,20 +9612,625 @@ static bool start_stuff(void) {
  * @brief Clean up application resources
  */
 static void clean_stuff(void) {
-    if (g_app.canvas) {
-        free(g_app.canvas);
-        g_app.canvas = NULL;
-    }
+    autosave_stop();  // Writes any pending backup
+    canvas_release();
+    pair_cache_free();
     
     endwin();  // Restore terminal
 }
 
+/*==============================================================================
+ * COMMAND LINE (HEADLESS)
+ *============================================================================*/
+
+/**
+ * @brief Replace the canvas with the contents of a saved file
+ * @param filename Source filename
+ * @return true on success
+ * @details Sizes the canvas to the file instead of the terminal; used by the
+ * headless commands, which never initialize ncurses.
+ */
+static bool canvas_from_file(const char *filename) {
+    int width = 0, height = 0;
+    Cell *cells = read_any_canvas(filename, &width, &height);
+    if (!cells) return false;
+    if (width > MAX_CANVAS_WIDTH || height > MAX_CANVAS_HEIGHT) {
+        free(cells);
+        return false;
+    }
+    
+    canvas_release();
+    if (!canvas_allocate(width, height)) {
+        free(cells);
+        return false;
+    }
+    
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            put_cell(x, y, cells[y * width + x]);
+        }
+    }
+    
+    free(cells);
+    return true;
+}
+
+/**
+ * @brief Write the canvas to a file, picking the format by extension
+ * @param filename Target filename; .txt saves in the native format and
+ *        .bin in the binary one
+ * @return true on success
+ */
+static bool write_by_extension(const char *filename) {
+    if (has_extension(filename, ".txt")) {
+        return save_masterpiece(filename);
+    }
+    if (has_extension(filename, ".bin")) {
+        return save_binary(filename);
+    }
+    return export_by_extension(filename);
+}
+
+/**
+ * @brief Convert an image file into a canvas file
+ * @param input PPM/PGM image
+ * @param output Output file, format by extension
+ * @param max_cols Width in cells; height follows the image aspect ratio
+ * @return Process exit status
+ */
+static int run_import_command(const char *input, const char *output, int max_cols) {
+    PnmReader img;
+    if (!pnm_open(&img, input)) {
+        fprintf(stderr, "Error: Cannot read PPM/PGM image '%s'\n", input);
+        return 1;
+    }
+    
+    int cols, rows;
+    if (max_cols > MAX_CANVAS_WIDTH) max_cols = MAX_CANVAS_WIDTH;
+    import_grid_size(&img, max_cols, MAX_CANVAS_HEIGHT, &cols, &rows);
+    
+    int status = 0;
+    if (!canvas_allocate(cols, rows) || !import_image(&img, cols, rows)) {
+        fprintf(stderr, "Error: Cannot convert image '%s'\n", input);
+        status = 1;
+    } else if (!write_by_extension(output)) {
+        fprintf(stderr, "Error: Cannot write '%s': %s\n", output, strerror(errno));
+        status = 1;
+    }
+    
+    pnm_close(&img);
+    canvas_release();
+    return status;
+}
+
+/**
+ * @brief Parse a style given as FG[/BG], each a name, palette index or #rrggbb
+ * @param text Style text; names are case-insensitive
+ * @param color Out: style ID
+ * @return true if the whole text is a style
+ */
+static bool parse_color(const char *text, StyleId *color) {
+    const char *p = text;
+    return style_parse(&p, color) && *p == '\0';
+}
+
+/**
+ * @brief Parse a CHAR[:COLOR] cell pattern
+ * @param spec Pattern; either part may be left empty to mean "any"
+ *        (or "keep", for a replacement)
+ * @param bits Out: cell bits of the given parts
+ * @param mask Out: which cell bits were given
+ * @return true if the pattern is valid
+ */
+static bool parse_cell_pattern(const char *spec, uint32_t *bits, uint32_t *mask) {
+    const char *colon = strchr(spec, ':');
+    const char *end = colon ? colon : spec + strlen(spec);
+    GlyphId glyph = 0;
+    StyleId color = 0;
+    
+    *mask = 0;
+    if (end > spec) {
+        const char *p = spec;
+        uint32_t code = utf8_decode(&p);
+        if (code == UINT32_MAX || p != end) return false;
+        glyph = glyph_intern(code);
+        *mask |= cell_bits(make_cell(0xFFFF, 0));
+    }
+    if (colon && colon[1]) {
+        if (!parse_color(colon + 1, &color)) return false;
+        *mask |= cell_bits(make_cell(0, 0xFFFF));
+    }
+    *bits = cell_bits(make_cell(glyph, color)) & *mask;
+    return *mask != 0;
+}
+
+/**
+ * @brief Replace matching cells in a saved canvas
+ * @param input Canvas file
+ * @param output Output file, format by extension
+ * @param from CHAR[:COLOR] pattern to find
+ * @param to CHAR[:COLOR] replacement; omitted parts are kept
+ * @return Process exit status
+ */
+static int run_replace_command(const char *input, const char *output,
+                               const char *from, const char *to) {
+    uint32_t find_bits, find_mask, to_bits, to_mask;
+    if (!parse_cell_pattern(from, &find_bits, &find_mask) ||
+        !parse_cell_pattern(to, &to_bits, &to_mask)) {
+        fprintf(stderr, "Error: Patterns are CHAR, :COLOR or CHAR:COLOR "
+                        "(color FG[/BG], each a name, 0-255 or #rrggbb)\n");
+        return 2;
+    }
+    
+    // Blank cells are never stored, so they cannot be matched
+    if ((find_mask & cell_bits(make_cell(0xFFFF, 0))) && (from[0] == ' ')) {
+        fprintf(stderr, "Error: Cannot match blank cells\n");
+        return 2;
+    }
+    
+    int status = 0;
+    if (!canvas_from_file(input)) {
+        fprintf(stderr, "Error: Cannot read canvas from '%s'\n", input);
+        status = 1;
+    } else {
+        int count = replace_matching(find_bits, find_mask, to_bits, to_mask);
+        if (!write_by_extension(output)) {
+            fprintf(stderr, "Error: Cannot write '%s': %s\n", output, strerror(errno));
+            status = 1;
+        } else {
+            printf("%d cell%s replaced\n", count, count == 1 ? "" : "s");
+        }
+    }
+    
+    canvas_release();
+    return status;
+}
+
+/**
+ * @brief qsort() comparator for file names
+ */
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/**
+ * @brief Summarize a canvas
+ * @param cells Row-major cells
+ * @param width Canvas width
+ * @param height Canvas height
+ * @param st Out: statistics
+ */
+static void canvas_stats(const Cell *cells, int width, int height, CanvasStats *st) {
+    uint64_t seen[GLYPH_MAX / 64] = { 0 };
+    
+    memset(st, 0, sizeof(*st));
+    st->width = width;
+    st->height = height;
+    st->left = width;
+    st->top = height;
+    st->right = st->bottom = -1;
+    
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            const Cell *cell = &cells[(size_t)y * width + x];
+            if (cell_is_blank(cell)) continue;
+            
+            st->used++;
+            if (cell->color < STYLE_DIRECT) st->colors[cell->color]++; else st->other_colors++;
+            uint64_t bit = 1ull << (cell->glyph & 63);
+            if (!(seen[cell->glyph >> 6] & bit)) {
+                seen[cell->glyph >> 6] |= bit;
+                st->glyphs++;
+            }
+            if (x < st->left) st->left = x;
+            if (x > st->right) st->right = x;
+            if (y < st->top) st->top = y;
+            if (y > st->bottom) st->bottom = y;
+        }
+    }
+}
+
+/**
+ * @brief Format canvas statistics as one line
+ * @param buf Output buffer
+ * @param size Buffer size
+ * @param name File name to lead the line with
+ * @param st Statistics
+ */
+static void format_stats(char *buf, size_t size, const char *name, const CanvasStats *st) {
+    long total = (long)st->width * st->height;
+    int n = snprintf(buf, size, "%s: %dx%d, %ld cells used (%.1f%%), %d characters",
+                     name, st->width, st->height, st->used,
+                     100.0 * (double)st->used / (double)total, st->glyphs);
+    
+    if (st->used > 0 && n > 0 && (size_t)n < size) {
+        n += snprintf(buf + n, size - (size_t)n, ", bounds (%d,%d)-(%d,%d), colors:",
+                      st->left, st->top, st->right, st->bottom);
+        for (int c = 0; c < COLOR_COUNT && n > 0 && (size_t)n < size; ++c) {
+            if (st->colors[c] == 0) continue;
+            n += snprintf(buf + n, size - (size_t)n, " %s %ld", color_names[c], st->colors[c]);
+        }
+        if (st->other_colors > 0 && n > 0 && (size_t)n < size) {
+            snprintf(buf + n, size - (size_t)n, " other %ld", st->other_colors);
+        }
+    }
+}
+
+/**
+ * @brief Run one batch command on one file
+ * @param cmd Command to run
+ * @param input Canvas file
+ * @param output Output file (BATCH_CONVERT only)
+ * @param msg Out: stats line on success, reason on failure
+ * @param msg_size Size of msg
+ * @return true on success
+ * @details Only touches thread-local state, so workers can run it in parallel.
+ */
+static bool run_batch_file(BatchCommand cmd, const char *input, const char *output,
+                           char *msg, size_t msg_size) {
+    int width = 0, height = 0;
+    Cell *cells;
+    
+    switch (cmd) {
+        case BATCH_VALIDATE:
+            cells = read_canvas_strict(input, &width, &height, msg, msg_size);
+            if (!cells) return false;
+            free(cells);
+            snprintf(msg, msg_size, "OK (%dx%d)", width, height);
+            return true;
+            
+        case BATCH_STAT: {
+            cells = read_canvas_strict(input, &width, &height, msg, msg_size);
+            if (!cells) return false;
+            
+            CanvasStats st;
+            canvas_stats(cells, width, height, &st);
+            free(cells);
+            format_stats(msg, msg_size, input, &st);
+            return true;
+        }
+            
+        case BATCH_CONVERT: {
+            bool ok = false;
+            if (!canvas_from_file(input)) {
+                report_error(msg, msg_size, "cannot read canvas");
+            } else if (!write_by_extension(output)) {
+                report_error(msg, msg_size, "cannot write '%s': %s", output, strerror(errno));
+            } else {
+                ok = true;
+            }
+            canvas_release();
+            return ok;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Build the output path for a converted file
+ * @param buf Output buffer
+ * @param size Buffer size
+ * @param out_dir Output directory
+ * @param name Input file name (without directory)
+ * @param ext New extension, including the dot
+ * @return true if the path fit
+ */
+static bool batch_output_path(char *buf, size_t size, const char *out_dir,
+                              const char *name, const char *ext) {
+    const char *dot = strrchr(name, '.');
+    int stem = dot ? (int)(dot - name) : (int)strlen(name);
+    int n = snprintf(buf, size, "%s/%.*s%s", out_dir, stem, name, ext);
+    return n > 0 && (size_t)n < size;
+}
+
+/**
+ * @brief Batch worker: claim files from the shared list until none are left
+ * @param arg BatchJob
+ * @return NULL
+ */
+static void* batch_worker(void *arg) {
+    BatchJob *job = arg;
+    char input[PATH_MAX], output[PATH_MAX], msg[BATCH_MESSAGE_SIZE];
+    
+    for (;;) {
+        size_t i = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed);
+        if (i >= job->count) break;
+        
+        const char *name = job->names[i];
+        bool ok = snprintf(input, sizeof(input), "%s/%s", job->dir, name) < (int)sizeof(input);
+        if (ok && job->cmd == BATCH_CONVERT) {
+            ok = batch_output_path(output, sizeof(output), job->out_dir, name, job->ext);
+        }
+        if (!ok) {
+            snprintf(msg, sizeof(msg), "path too long");
+        } else {
+            struct stat st;
+            if (stat(input, &st) == 0) {
+                atomic_fetch_add_explicit(&job->bytes, (uint64_t)st.st_size, memory_order_relaxed);
+            }
+            ok = run_batch_file(job->cmd, input, output, msg, sizeof(msg));
+            glyph_table_free();  // Each file interns its own glyphs and styles
+            style_table_free();
+        }
+        
+        // One call per line keeps lines from different workers whole
+        if (!ok) {
+            atomic_fetch_add_explicit(&job->failed, 1, memory_order_relaxed);
+            fprintf(stderr, "%s: %s\n", input, msg);
+        } else if (job->cmd == BATCH_STAT) {
+            fprintf(stdout, "%s\n", msg);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief List the canvas files (.txt and .bin) in a directory
+ * @param job Job to fill (names, count)
+ * @return true on success
+ * @details Names are sorted so runs are reproducible.
+ */
+static bool batch_list_files(BatchJob *job) {
+    DIR *dir = opendir(job->dir);
+    if (!dir) return false;
+    
+    size_t capacity = 0;
+    struct dirent *entry;
+    bool ok = true;
+    
+    while (ok && (entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' || !(has_extension(name, ".txt") || has_extension(name, ".bin"))) {
+            continue;
+        }
+        if (job->count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            char **names = realloc(job->names, capacity * sizeof(char *));
+            if (!names) { ok = false; break; }
+            job->names = names;
+        }
+        if (!(job->names[job->count] = strdup(name))) { ok = false; break; }
+        job->count++;
+    }
+    closedir(dir);
+    
+    if (ok) {
+        qsort(job->names, job->count, sizeof(char *), compare_names);
+    }
+    return ok;
+}
+
+/**
+ * @brief Run a command over every canvas file of a directory in parallel
+ * @param job Job with cmd, dir, out_dir, ext and jobs set
+ * @return Process exit status: 0 if every file succeeded
+ * 
+ * @details
+ * Workers pull the next file index from a shared atomic counter, so
+ * uneven file sizes balance out. A throughput and failure summary goes
+ * to stderr at the end.
+ */
+static int run_batch(BatchJob *job) {
+    if (!batch_list_files(job)) {
+        fprintf(stderr, "Error: Cannot read directory '%s': %s\n", job->dir, strerror(errno));
+        return 1;
+    }
+    if (job->cmd == BATCH_CONVERT && mkdir(job->out_dir, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create '%s': %s\n", job->out_dir, strerror(errno));
+        return 1;
+    }
+    
+    int workers = job->jobs;
+    if ((size_t)workers > job->count) workers = job->count > 0 ? (int)job->count : 1;
+    pthread_t *threads = malloc((size_t)workers * sizeof(pthread_t));
+    if (!threads) return 1;
+    
+    int64_t start = now_usec();
+    int started = 0;
+    for (; started < workers; ++started) {
+        if (pthread_create(&threads[started], NULL, batch_worker, job) != 0) break;
+    }
+    if (started == 0) {
+        batch_worker(job);  // No threads available; do the work here
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    double seconds = (double)(now_usec() - start) / 1e6;
+    free(threads);
+    
+    size_t failed = atomic_load(&job->failed);
+    double megabytes = (double)atomic_load(&job->bytes) / (1024.0 * 1024.0);
+    if (seconds <= 0) seconds = 1e-6;
+    fprintf(stderr, "%zu files, %zu failed, %.1f MB in %.2f s "
+                    "(%.0f files/s, %.1f MB/s), %d worker%s\n",
+            job->count, failed, megabytes, seconds,
+            (double)job->count / seconds, megabytes / seconds,
+            started ? started : 1, started == 1 ? "" : "s");
+    
+    for (size_t i = 0; i < job->count; ++i) {
+        free(job->names[i]);
+    }
+    free(job->names);
+    return failed ? 1 : 0;
+}
+
+/**
+ * @brief Run validate or stat on files named on the command line
+ * @param cmd BATCH_VALIDATE or BATCH_STAT
+ * @param files File names
+ * @param count Number of files
+ * @return Process exit status: 0 if every file succeeded
+ */
+static int run_file_command(BatchCommand cmd, char **files, int count) {
+    char msg[BATCH_MESSAGE_SIZE];
+    int status = 0;
+    
+    for (int i = 0; i < count; ++i) {
+        bool ok = run_batch_file(cmd, files[i], NULL, msg, sizeof(msg));
+        if (!ok) {
+            fprintf(stderr, "%s: %s\n", files[i], msg);
+            status = 1;
+        } else if (cmd == BATCH_STAT) {
+            printf("%s\n", msg);
+        } else {
+            printf("%s: %s\n", files[i], msg);
+        }
+    }
+    return status;
+}
+
+/**
+ * @brief Print command line usage
+ * @param prog Program name
+ */
+static void print_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--fps N] [--no-adaptive] [--anim-fps N]\n"
+            "          [--open doc.bin] [--save file] [--autosave SECONDS]\n"
+            "          [--autosave-edits N] [--backups N]\n"
+            "                               Start the interactive editor; terminal\n"
+            "                                  updates are capped at N per second\n"
+            "                                  (default 60, or 15 over SSH);\n"
+            "                                  animations play at --anim-fps (12);\n"
+            "                                  --open maps a binary document;\n"
+            "                                  S/L use --save (a .bin file saves\n"
+            "                                  only the rows changed since);\n"
+            "                                  autosave keeps --backups (5) copies\n"
+            "                                  as <save file stem>.N.bin\n"
+            "       %s create <doc.bin> <width> <height>\n"
+            "                               Create an empty binary document (up\n"
+            "                                  to 65535x65535) for --open\n"
+            "       %s export <in> <out>    Export a saved canvas; format by\n"
+            "                                  extension (.ans .cast .html .ppm)\n"
+            "       %s import <image> <out> [columns]\n"
+            "                               Convert a PPM/PGM image to a canvas\n"
+            "                                  (.txt) or any export format\n"
+            "       %s replace <in> <out> <from> <to>\n"
+            "                               Replace cells matching CHAR[:COLOR];\n"
+            "                                  e.g. '#:red' '*:blue', ':red' ':green'\n"
+            "       %s convert <in> <out>   Convert between canvas formats (.txt,\n"
+            "                                  .bin) or to any export format\n"
+            "       %s validate <file>...   Strictly check canvas files\n"
+            "       %s stat <file>...       Print size, usage, bounds and colors\n"
+            "       %s batch validate|stat <dir> [-j N]\n"
+            "       %s batch convert <dir> <out_dir> <.ext> [-j N]\n"
+            "                               Run over every .txt/.bin file of a\n"
+            "                                  directory with N workers (default:\n"
+            "                                  one per core)\n",
+            prog, prog, prog, prog, prog, prog, prog, prog, prog, prog);
+}
+
+/**
+ * @brief Run a headless subcommand
+ * @param argc Argument count
+ * @param argv Argument vector
+ * @return Process exit status
+ */
+static int run_command_line(int argc, char **argv) {
+    if (strcmp(argv[1], "export") == 0 && argc == 4) {
+        int status = 0;
+        
+        if (!canvas_from_file(argv[2])) {
+            fprintf(stderr, "Error: Cannot read canvas from '%s'\n", argv[2]);
+            status = 1;
+        } else if (!export_by_extension(argv[3])) {
+            fprintf(stderr, "Error: Cannot export to '%s': %s\n",
+                    argv[3], strerror(errno));
+            status = 1;
+        }
+        
+        canvas_release();
+        return status;
+    }
+    
+    if (strcmp(argv[1], "import") == 0 && (argc == 4 || argc == 5)) {
+        int cols = (argc == 5) ? atoi(argv[4]) : IMPORT_DEFAULT_COLUMNS;
+        if (cols <= 0) {
+            print_usage(argv[0]);
+            return 2;
+        }
+        return run_import_command(argv[2], argv[3], cols);
+    }
+    
+    if (strcmp(argv[1], "replace") == 0 && argc == 6) {
+        return run_replace_command(argv[2], argv[3], argv[4], argv[5]);
+    }
+    
+    if (strcmp(argv[1], "create") == 0 && argc == 5) {
+        int width = atoi(argv[3]), height = atoi(argv[4]);
+        if (width < 1 || height < 1 || width > MAX_DOCUMENT_SIDE || height > MAX_DOCUMENT_SIDE) {
+            print_usage(argv[0]);
+            return 2;
+        }
+        if (!document_create(argv[2], width, height)) {
+            fprintf(stderr, "Error: Cannot create '%s': %s\n", argv[2], strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+    
+    if (strcmp(argv[1], "convert") == 0 && argc == 4) {
+        char msg[BATCH_MESSAGE_SIZE];
+        if (!run_batch_file(BATCH_CONVERT, argv[2], argv[3], msg, sizeof(msg))) {
+            fprintf(stderr, "Error: %s: %s\n", argv[2], msg);
+            return 1;
+        }
+        return 0;
+    }
+    
+    if (strcmp(argv[1], "validate") == 0 && argc >= 3) {
+        return run_file_command(BATCH_VALIDATE, argv + 2, argc - 2);
+    }
+    
+    if (strcmp(argv[1], "stat") == 0 && argc >= 3) {
+        return run_file_command(BATCH_STAT, argv + 2, argc - 2);
+    }
+    
+    if (strcmp(argv[1], "batch") == 0 && argc >= 4) {
+        BatchJob job = { 0 };
+        int rest = 4;
+        
+        job.dir = argv[3];
+        job.jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (strcmp(argv[2], "validate") == 0) {
+            job.cmd = BATCH_VALIDATE;
+        } else if (strcmp(argv[2], "stat") == 0) {
+            job.cmd = BATCH_STAT;
+        } else if (strcmp(argv[2], "convert") == 0 && argc >= 6 && argv[5][0] == '.') {
+            job.cmd = BATCH_CONVERT;
+            job.out_dir = argv[4];
+            job.ext = argv[5];
+            rest = 6;
+        } else {
+            print_usage(argv[0]);
+            return 2;
+        }
+        
+        if (rest + 2 == argc && strcmp(argv[rest], "-j") == 0) {
+            job.jobs = atoi(argv[rest + 1]);
+        } else if (rest != argc) {
+            job.jobs = 0;
+        }
+        if (job.jobs < 1) {
+            print_usage(argv[0]);
+            return 2;
+        }
+        return run_batch(&job);
+    }
+    
+    print_usage(argv[0]);
+    return 2;
+}
+
 /*==============================================================================
  * MAIN APPLICATION LOOP
  *============================================================================*/
 
 /**
  * @brief Main application entry point
+ * @param argc Argument count
+ * @param argv Arguments; any subcommand runs headless instead of the editor
  * @return 0 on successful completion, 1 on initialization failure
  * 
  * @details
@@ -762,29 +10238,127 @@ static void clean_stuff(void) {
  * 1. Initialize ncurses and application state
  * 2. Validate terminal capabilities and size
  * 3. Allocate and initialize canvas
- * 4. Enter main event loop processing user input
- * 5. Clean up resources and restore terminal
+ * 4. Start the input thread
+ * 5. Enter main event loop applying queued input in batches and emitting
+ *    paced frames
+ * 6. Stop the input thread, clean up resources and restore terminal
  * 
  * @note All resources are properly cleaned up regardless of exit path
  */
-int main(void) {
+int main(int argc, char **argv) {
+    setlocale(LC_CTYPE, "");  // Wide-character output and wcwidth() follow the terminal
+    select_simd_kernels();
+    
+    // Headless subcommands never touch the terminal
+    if (argc > 1 && argv[1][0] != '-') {
+        return run_command_line(argc, argv);
+    }
+    
+    // Editor options
+    int max_fps = default_frame_rate();
+    bool adaptive = true;
+    const char *document_path = NULL;
+    g_app.timeline.fps = ANIM_DEFAULT_FPS;
+    g_app.save.path = DEFAULT_SAVE_FILE;
+    g_app.autosave.backups = AUTOSAVE_DEFAULT_BACKUPS;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+            max_fps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--no-adaptive") == 0) {
+            adaptive = false;
+        } else if (strcmp(argv[i], "--open") == 0 && i + 1 < argc) {
+            document_path = argv[++i];
+        } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            g_app.save.path = argv[++i];
+        } else if (strcmp(argv[i], "--autosave") == 0 && i + 1 < argc) {
+            g_app.autosave.interval_s = atoi(argv[++i]);
+            if (g_app.autosave.interval_s < 1) {
+                max_fps = 0;
+                break;
+            }
+        } else if (strcmp(argv[i], "--autosave-edits") == 0 && i + 1 < argc) {
+            g_app.autosave.every_edits = atoi(argv[++i]);
+            if (g_app.autosave.every_edits < 1) {
+                max_fps = 0;
+                break;
+            }
+        } else if (strcmp(argv[i], "--backups") == 0 && i + 1 < argc) {
+            g_app.autosave.backups = atoi(argv[++i]);
+            if (g_app.autosave.backups < 1 || g_app.autosave.backups > AUTOSAVE_MAX_BACKUPS) {
+                max_fps = 0;
+                break;
+            }
+        } else if (strcmp(argv[i], "--anim-fps") == 0 && i + 1 < argc) {
+            g_app.timeline.fps = atoi(argv[++i]);
+            if (g_app.timeline.fps < 1 || g_app.timeline.fps > FRAME_RATE_MAX) {
+                max_fps = 0;
+                break;
+            }
+        } else {
+            max_fps = 0;
+            break;
+        }
+    }
+    if (max_fps < 1 || max_fps > FRAME_RATE_MAX) {
+        print_usage(argv[0]);
+        return 2;
+    }
+    frames_init(max_fps, adaptive);
+    
     // Initialize application subsystems
     if (!start_stuff()) {
         return 1;
     }
     
+    if (document_path && !open_document(document_path)) {
+        char reason[STATUS_MESSAGE_SIZE];
+        snprintf(reason, sizeof(reason), "%s", g_app.status_msg);
+        clean_stuff();
+        fprintf(stderr, "Error: %s\n", reason);
+        return 1;
+    }
+    
     // Perform initial screen render
     paint_entire_canvas();
     refresh_view();
     
+    if (!start_input_thread()) {
+        clean_stuff();
+        fprintf(stderr, "Error: Failed to start input thread\n");
+        return 1;
+    }
+    if (!autosave_start()) {
+        stop_input_thread();
+        clean_stuff();
+        fprintf(stderr, "Error: Failed to start autosave\n");
+        return 1;
+    }
+    
     // Main event processing loop
     while (g_app.running) {
-        int key = getch();
-        input_stuff(key);
-        refresh_view();
+        int wait_ms = frames_wait_ms();
+        int anim_ms = timeline_wait_ms();
+        if (anim_ms >= 0 && (wait_ms < 0 || anim_ms < wait_ms)) {
+            wait_ms = anim_ms;
+        }
+        int autosave_ms = autosave_wait_ms();
+        if (autosave_ms >= 0 && (wait_ms < 0 || autosave_ms < wait_ms)) {
+            wait_ms = autosave_ms;
+        }
+        
+        wait_for_input(wait_ms);
+        if (process_input_batch() > 0) {
+            g_app.frames.dirty = true;
+        }
+        if (timeline_tick()) {
+            g_app.frames.dirty = true;
+        }
+        autosave_tick();
+        frames_tick();
     }
     
     // Clean up and restore terminal state
+    stop_input_thread();
     clean_stuff();
     return 0;
 }
\ No newline at end of file